@@ -0,0 +1,431 @@
+/*
+ * nvs_bench.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// ArduinoNvs on the emulated partition: throughput per value type, blob
+/// size and partition fill level, with the flash traffic each op causes,
+/// the NVS lookups `getInt()` needs depending on what it has cached and
+/// the heap allocations per call of each API flavour.
+///
+///   nvs_bench [--quick] [--image file] [--pages n] [--realtime]
+///
+/// "ops/s" is host time and says little about the target, the flash
+/// columns come from the emulator's cost model and are what to compare.
+/// Any value read back wrong makes the run exit with 1.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <vector>
+
+#include "ArduinoNvs.h"
+#include "nvs_emu.h"
+
+static bool quick;
+static int failures;
+
+static std::atomic<size_t> heap_allocs(0);
+static std::atomic<size_t> heap_bytes(0);
+
+void *operator new(size_t size)
+{
+    if (!nvs_emu_busy())
+    {
+        heap_allocs++;
+        heap_bytes += size;
+    }
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+struct Probe
+{
+    nvs_emu_stats_t flash;
+    std::chrono::steady_clock::time_point start;
+
+    Probe()
+    {
+        flash = nvs_emu_stats();
+        start = std::chrono::steady_clock::now();
+    }
+
+    void report(const char *name, size_t ops)
+    {
+        int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start)
+                         .count();
+        nvs_emu_stats_t now = nvs_emu_stats();
+        double n = ops ? (double)ops : 1;
+        printf("%-22s %10.0f %9.1f %8.2f %9.1f %8.3f %7.3f %8.2f\n", name, us ? ops * 1e6 / us : 0.0,
+               (now.flash_us - flash.flash_us) / n, (now.entries_written - flash.entries_written) / n,
+               (now.bytes_written - flash.bytes_written) / n, (now.page_erases - flash.page_erases) / n,
+               (now.gc_runs - flash.gc_runs) / n, (now.lookups - flash.lookups) / n);
+    }
+};
+
+static void header(const char *title)
+{
+    printf("\n%s\n%-22s %10s %9s %8s %9s %8s %7s %8s\n", title, "op", "ops/s", "flash_us", "entries", "bytes",
+           "erases", "gc", "lookups");
+}
+
+static void check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+template <typename T>
+static void bench_int(ArduinoNvs &nvs, const char *name, size_t iterations)
+{
+    char label[32];
+    const char *key = name;
+    {
+        Probe p;
+        for (size_t i = 0; i < iterations; i++)
+            nvs.setInt(key, (T)(i + 1), false);
+        snprintf(label, sizeof(label), "set %s", name);
+        p.report(label, iterations);
+    }
+    {
+        Probe p;
+        int64_t sum = 0;
+        for (size_t i = 0; i < iterations; i++)
+            sum += nvs.getInt(key);
+        snprintf(label, sizeof(label), "get %s", name);
+        p.report(label, iterations);
+        check(sum == (int64_t)iterations * (int64_t)(T)iterations, label);
+    }
+}
+
+static void bench_types(ArduinoNvs &nvs, size_t iterations)
+{
+    header("per type");
+    bench_int<uint8_t>(nvs, "u8", iterations);
+    bench_int<int16_t>(nvs, "i16", iterations);
+    bench_int<uint32_t>(nvs, "u32", iterations);
+    bench_int<int64_t>(nvs, "i64", iterations);
+    bench_int<uint64_t>(nvs, "u64", iterations);
+
+    static const size_t lengths[] = {15, 63, 255};
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    {
+        std::vector<char> value(lengths[l] + 1, 'a');
+        value[lengths[l]] = 0;
+        char label[32];
+        {
+            Probe p;
+            for (size_t i = 0; i < iterations; i++)
+            {
+                value[0] = 'a' + i % 26;
+                nvs.setString("str", value.data(), false);
+            }
+            snprintf(label, sizeof(label), "set str%u", (unsigned)lengths[l]);
+            p.report(label, iterations);
+        }
+        {
+            Probe p;
+            bool ok = true;
+            for (size_t i = 0; i < iterations; i++)
+            {
+                char buf[256 + 1];
+                size_t len = sizeof(buf);
+                ok &= nvs.getString("str", buf, len) && strcmp(buf, value.data()) == 0;
+            }
+            snprintf(label, sizeof(label), "get str%u", (unsigned)lengths[l]);
+            p.report(label, iterations);
+            check(ok, label);
+        }
+    }
+
+    {
+        Probe p;
+        for (size_t i = 0; i < iterations; i++)
+            nvs.commit();
+        p.report("commit", iterations);
+    }
+    {
+        Probe p;
+        for (size_t i = 0; i < iterations; i++)
+            nvs.setInt("u32c", (uint32_t)i, true);
+        p.report("set u32 + commit", iterations);
+    }
+}
+
+static void bench_blobs(ArduinoNvs &nvs, size_t iterations)
+{
+    header("blob sizes");
+    static const size_t sizes[] = {32, 256, 1024, 4000, 8000, 16000};
+    size_t count = quick ? 5 : sizeof(sizes) / sizeof(sizes[0]);
+    for (size_t s = 0; s < count; s++)
+    {
+        std::vector<uint8_t> data(sizes[s]);
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = (uint8_t)(i * 7);
+        char label[32];
+        size_t n = iterations / (1 + sizes[s] / 1024);
+        if (n < 4)
+            n = 4;
+        {
+            Probe p;
+            for (size_t i = 0; i < n; i++)
+            {
+                data[0] = (uint8_t)i;
+                check(nvs.setBlob("blob", data, false), "set blob");
+            }
+            snprintf(label, sizeof(label), "set blob%u", (unsigned)sizes[s]);
+            p.report(label, n);
+        }
+        {
+            Probe p;
+            bool ok = true;
+            std::vector<uint8_t> out;
+            for (size_t i = 0; i < n; i++)
+                ok &= nvs.getBlob("blob", out) && out == data;
+            snprintf(label, sizeof(label), "get blob%u", (unsigned)sizes[s]);
+            p.report(label, n);
+            check(ok, label);
+        }
+        nvs.erase("blob");
+    }
+}
+
+/// Fills another namespace to `percent` of the usable entries, then
+/// rewrites a few keys so updates have to reclaim erased space.
+static void bench_fill(ArduinoNvs &nvs, size_t iterations)
+{
+    header("namespace fill");
+    ArduinoNvs fill("fill");
+    static const unsigned levels[] = {0, 50, 75, 90};
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+    {
+        nvs.eraseAll();
+        fill.eraseAll();
+        nvs_stats_t stats;
+        nvs_get_stats(NULL, &stats);
+        size_t usable = stats.total_entries - NVS_EMU_PAGE_ENTRIES;
+        size_t target = usable * levels[l] / 100;
+        char key[16];
+        for (unsigned i = 0; stats.used_entries < target; i++)
+        {
+            snprintf(key, sizeof(key), "f%u", i);
+            if (!fill.setInt(key, (uint32_t)i, false))
+                break;
+            nvs_get_stats(NULL, &stats);
+        }
+
+        char label[32];
+        Probe p;
+        size_t ok = 0;
+        for (size_t i = 0; i < iterations; i++)
+        {
+            snprintf(key, sizeof(key), "k%u", (unsigned)(i % 8));
+            char value[48];
+            snprintf(value, sizeof(value), "value %u of the rewrite loop", (unsigned)i);
+            ok += nvs.setString(key, value, false);
+        }
+        snprintf(label, sizeof(label), "set str @%u%%", levels[l]);
+        p.report(label, iterations);
+        check(ok == iterations, label);
+    }
+    fill.eraseAll();
+    nvs.eraseAll();
+}
+
+/// Lookups per `getInt()` by stored type: a fresh instance (empty type
+/// cache, probes until the type matches), a warm one, one with a snapshot
+/// and a missing key.
+static void bench_get_int()
+{
+    struct IntKey
+    {
+        const char *key;
+        nvs_type_t type;
+    };
+    static const IntKey keys[] = {{"li_u8", NVS_TYPE_U8},   {"li_i16", NVS_TYPE_I16}, {"li_u16", NVS_TYPE_U16},
+                                  {"li_i32", NVS_TYPE_I32}, {"li_u32", NVS_TYPE_U32}, {"li_i64", NVS_TYPE_I64},
+                                  {"li_u64", NVS_TYPE_U64}, {"li_none", NVS_TYPE_ANY}};
+    ArduinoNvs writer("lookup");
+    writer.eraseAll();
+    writer.setInt("li_u8", (uint8_t)8);
+    writer.setInt("li_i16", (int16_t)-16);
+    writer.setInt("li_u16", (uint16_t)16);
+    writer.setInt("li_i32", (int32_t)-32);
+    writer.setInt("li_u32", (uint32_t)32);
+    writer.setInt("li_i64", (int64_t)-64);
+    writer.setInt("li_u64", (uint64_t)64);
+
+    printf("\ngetInt lookups per call\n%-10s %6s %6s %9s\n", "type", "cold", "warm", "snapshot");
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        ArduinoNvs reader("lookup");
+        uint64_t before = nvs_emu_stats().lookups;
+        int64_t cold = reader.getInt(keys[i].key, -1);
+        uint64_t cold_lookups = nvs_emu_stats().lookups - before;
+
+        before = nvs_emu_stats().lookups;
+        int64_t warm = reader.getInt(keys[i].key, -1);
+        uint64_t warm_lookups = nvs_emu_stats().lookups - before;
+
+        ArduinoNvs preloaded("lookup");
+        preloaded.preload();
+        before = nvs_emu_stats().lookups;
+        int64_t snap = preloaded.getInt(keys[i].key, -1);
+        uint64_t snap_lookups = nvs_emu_stats().lookups - before;
+
+        printf("%-10s %6u %6u %9u\n", keys[i].key + 3, (unsigned)cold_lookups, (unsigned)warm_lookups,
+               (unsigned)snap_lookups);
+        check(cold == warm && warm == snap && (keys[i].type != NVS_TYPE_ANY) == (cold != -1), keys[i].key);
+    }
+    writer.eraseAll();
+}
+
+struct AllocProbe
+{
+    size_t allocs;
+    size_t bytes;
+
+    AllocProbe() : allocs(heap_allocs), bytes(heap_bytes) {}
+
+    void report(const char *name, size_t ops)
+    {
+        printf("%-34s %8.2f %9.1f\n", name, (double)(heap_allocs - allocs) / ops, (double)(heap_bytes - bytes) / ops);
+    }
+};
+
+#define ALLOC_CASE(name, n, body)          \
+    do                                     \
+    {                                      \
+        AllocProbe probe;                  \
+        for (size_t i = 0; i < (n); i++)   \
+        {                                  \
+            body;                          \
+        }                                  \
+        probe.report(name, (n));           \
+    } while (0)
+
+/// Heap traffic per call once warm. Values differ per iteration so every
+/// set reaches flash. The host String keeps up to 15 chars inline, the
+/// key below fits, so String keyed calls only show their value copies.
+static void bench_allocs(ArduinoNvs &nvs, size_t n)
+{
+    printf("\nheap allocations per call\n%-34s %8s %9s\n", "op", "allocs", "bytes");
+    static const char key[] = "alloc_key";
+    String skey(key);
+    char text[65];
+    memset(text, 'x', 64);
+    text[64] = 0;
+    uint8_t blob[200];
+    memset(blob, 0x5a, sizeof(blob));
+    char buf[65];
+    uint8_t out[sizeof(blob)];
+    bool ok = true;
+
+    nvs.setInt(key, (uint32_t)0, false);
+    nvs.getInt(key);
+    ALLOC_CASE("setInt(const char *)", n, ok &= nvs.setInt(key, (uint32_t)i + 1, false));
+    ALLOC_CASE("setInt(String)", n, ok &= nvs.setInt(skey, (uint32_t)i + 1, false));
+    ALLOC_CASE("getInt(const char *)", n, ok &= nvs.getInt(key) != 0);
+    ALLOC_CASE("getInt(String)", n, ok &= nvs.getInt(skey) != 0);
+    nvs.erase(key);
+
+    nvs.setFloat(key, 1.5f, false);
+    ALLOC_CASE("setFloat(const char *)", n, ok &= nvs.setFloat(key, (float)i, false));
+    ALLOC_CASE("getFloat(const char *)", n, ok &= nvs.getFloat(key, -1) >= 0);
+    nvs.erase(key);
+
+    nvs.setString(key, text, false);
+    ALLOC_CASE("setString(const char *, char *)", n, text[0] = 'a' + i % 26;
+               ok &= nvs.setString(key, text, false));
+    ALLOC_CASE("getString(key, char *, len)", n, size_t len = sizeof(buf); ok &= nvs.getString(key, buf, len));
+    ALLOC_CASE("getString(key, String &)", n, String res; ok &= nvs.getString(key, res));
+    ALLOC_CASE("getString(key) -> String", n, ok &= nvs.getString(key).length() == 64);
+    nvs.erase(key);
+
+    nvs.setBlob(key, blob, sizeof(blob), false);
+    ALLOC_CASE("setBlob(const char *, uint8_t *)", n, blob[0] = (uint8_t)i;
+               ok &= nvs.setBlob(key, blob, sizeof(blob), false));
+    ALLOC_CASE("getBlob(key, uint8_t *, len)", n, ok &= nvs.getBlob(key, out, sizeof(out)));
+    ALLOC_CASE("getBlob(key, vector &)", n, std::vector<uint8_t> v; ok &= nvs.getBlob(key, v));
+    ALLOC_CASE("getBlob(key) -> vector", n, ok &= nvs.getBlob(key).size() == sizeof(blob));
+    ALLOC_CASE("getBlobSize(const char *)", n, ok &= nvs.getBlobSize(key) == sizeof(blob));
+    nvs.erase(key);
+
+    ALLOC_CASE("commit()", n, ok &= nvs.commit());
+    check(ok, "allocation cases");
+}
+
+int main(int argc, char **argv)
+{
+    nvs_emu_config_t config = nvs_emu_default_config();
+    config.pages = 16;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+            quick = true;
+        else if (strcmp(argv[i], "--realtime") == 0)
+            config.realtime = true;
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+            config.path = argv[++i];
+        else if (strcmp(argv[i], "--pages") == 0 && i + 1 < argc)
+            config.pages = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick] [--image file] [--pages n] [--realtime]\n", argv[0]);
+            return 2;
+        }
+    }
+    nvs_emu_configure(&config);
+    size_t iterations = quick ? 50 : 2000;
+
+    ArduinoNvs nvs("bench");
+    if (!nvs.isValid())
+    {
+        printf("FAIL: cannot open the emulated partition\n");
+        return 1;
+    }
+    nvs.eraseAll();
+    printf("partition %u pages, %u iterations, per op: flash_us modelled flash time, entries and bytes\n"
+           "programmed, sector erases, garbage collections and index lookups\n",
+           (unsigned)config.pages, (unsigned)iterations);
+
+    bench_types(nvs, iterations);
+    bench_blobs(nvs, iterations);
+    bench_fill(nvs, iterations);
+    bench_get_int();
+    bench_allocs(nvs, iterations);
+
+    printf("\n%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
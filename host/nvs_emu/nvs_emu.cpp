@@ -0,0 +1,1542 @@
+/*
+ * nvs_emu.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// The page and item formats follow components/nvs_flash of IDF 4.x:
+///
+///   page   = header (32) | entry state bitmap (32, 2 bits per entry) | 126 entries
+///   item   = ns, type, span, chunk index, crc32, key[16], data[8]
+///
+/// Strings take one item plus `span - 1` data entries on a single page.
+/// Blobs are written as BLOB_DATA chunks that fill the active page, then a
+/// BLOB_IDX item; chunk indexes alternate between 0 and 128 per version so
+/// the old value stays readable until the new index is written. Updates
+/// append the new item before marking the old one erased, a full page is
+/// closed and one page is always kept EMPTY so garbage collection can
+/// move the live items of the page with most erased entries.
+///
+/// Writes AND into the image like NOR flash and every program or erase
+/// goes through `flash_*()` below, which does the accounting and the power
+/// cut injection. A RAM index of (namespace, chunk, key) -> location
+/// replaces the hash list of the real implementation.
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "esp_partition.h"
+#include "nvs.h"
+#include "nvs_emu.h"
+#include "nvs_flash.h"
+
+namespace
+{
+
+const uint32_t PAGE_EMPTY = 0xffffffff;
+const uint32_t PAGE_ACTIVE = 0xfffffffe;
+const uint32_t PAGE_FULL = 0xfffffffc;
+const uint32_t PAGE_FREEING = 0xfffffff8;
+
+const uint8_t ENTRY_EMPTY = 3;
+const uint8_t ENTRY_WRITTEN = 2;
+const uint8_t ENTRY_ERASED = 0;
+
+const uint8_t TYPE_BLOB_DATA = 0x42;
+const uint8_t TYPE_BLOB_IDX = 0x48;
+const uint8_t CHUNK_ANY = 0xff;
+const uint8_t VER_0 = 0;
+const uint8_t VER_1 = 128;
+const uint8_t NS_INDEX = 0;
+const uint8_t NS_ANY = 0xff;
+
+const size_t PAGE_SIZE = NVS_EMU_PAGE_SIZE;
+const size_t ENTRY_SIZE = NVS_EMU_ENTRY_SIZE;
+const size_t ENTRIES = NVS_EMU_PAGE_ENTRIES;
+const size_t BITMAP_OFFSET = 32;
+const size_t ENTRY_OFFSET = 64;
+const size_t CHUNK_MAX = (ENTRIES - 1) * ENTRY_SIZE;
+const size_t BLOB_MAX = 508000;
+
+#pragma pack(push, 1)
+struct PageHeader
+{
+    uint32_t state;
+    uint32_t seq;
+    uint8_t version;
+    uint8_t reserved[19];
+    uint32_t crc;
+};
+
+struct Item
+{
+    uint8_t ns;
+    uint8_t type;
+    uint8_t span;
+    uint8_t chunk;
+    uint32_t crc;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    union
+    {
+        uint8_t raw[8];
+        struct
+        {
+            uint16_t size;
+            uint16_t reserved;
+            uint32_t crc;
+        } var;
+        struct
+        {
+            uint32_t size;
+            uint8_t count;
+            uint8_t start;
+            uint16_t reserved;
+        } idx;
+    } data;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(PageHeader) == 32, "page header is one entry");
+static_assert(sizeof(Item) == ENTRY_SIZE, "item is one entry");
+
+struct Page
+{
+    uint32_t state;
+    uint32_t seq;
+    size_t next;   ///< first never written entry
+    size_t used;   ///< entries of live items
+    size_t erased;
+};
+
+struct Key
+{
+    uint8_t ns;
+    uint8_t chunk;
+    std::string name;
+
+    bool operator<(const Key &o) const
+    {
+        if (ns != o.ns)
+            return ns < o.ns;
+        if (name != o.name)
+            return name < o.name;
+        return chunk < o.chunk;
+    }
+};
+
+struct Loc
+{
+    size_t page;
+    size_t entry;
+    uint8_t span;
+    uint8_t type;
+};
+
+struct Handle
+{
+    uint8_t ns;
+    bool read_only;
+    bool open;
+};
+
+struct Emu
+{
+    std::recursive_mutex lock;
+    nvs_emu_config_t config;
+    std::string path;
+    uint8_t *image;
+    size_t size;
+    int fd;
+    bool ready;
+    std::vector<Page> pages;
+    int active;
+    uint32_t next_seq;
+    std::map<Key, Loc> index;
+    std::map<std::string, uint8_t> namespaces;
+    std::vector<Handle> handles;
+    nvs_emu_stats_t stats;
+    uint32_t fail_after;
+    bool armed;
+    bool dead;
+    esp_partition_t partition;
+
+    Emu() : image(NULL), size(0), fd(-1), ready(false), active(-1), next_seq(0), fail_after(0), armed(false),
+            dead(false)
+    {
+        config = nvs_emu_default_config();
+        memset(&stats, 0, sizeof(stats));
+        memset(&partition, 0, sizeof(partition));
+    }
+};
+
+Emu &emu()
+{
+    static Emu e;
+    return e;
+}
+
+thread_local int api_depth;
+
+/// Serializes the API like the NVS mutex in IDF and marks the thread as
+/// inside the emulator for `nvs_emu_busy()`.
+struct ApiLock
+{
+    Emu &e;
+
+    explicit ApiLock(Emu &emu) : e(emu)
+    {
+        e.lock.lock();
+        api_depth++;
+    }
+
+    ~ApiLock()
+    {
+        api_depth--;
+        e.lock.unlock();
+    }
+};
+
+uint32_t crc32(uint32_t crc, const void *data, size_t len)
+{
+    static uint32_t table[256];
+    if (!table[1])
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+uint32_t item_crc(const Item &item)
+{
+    uint32_t crc = crc32(0xffffffff, &item, 4);
+    crc = crc32(crc, item.key, sizeof(item.key));
+    return crc32(crc, item.data.raw, sizeof(item.data.raw));
+}
+
+uint32_t header_crc(const PageHeader &h)
+{
+    return crc32(0xffffffff, (const uint8_t *)&h + 4, offsetof(PageHeader, crc) - 4);
+}
+
+bool is_var(uint8_t type)
+{
+    return type == NVS_TYPE_STR || type == TYPE_BLOB_DATA;
+}
+
+uint8_t *page_ptr(size_t page)
+{
+    return emu().image + page * PAGE_SIZE;
+}
+
+Item *entry_ptr(size_t page, size_t entry)
+{
+    return (Item *)(page_ptr(page) + ENTRY_OFFSET + entry * ENTRY_SIZE);
+}
+
+void charge(uint32_t us)
+{
+    Emu &e = emu();
+    e.stats.flash_us += us;
+    if (e.config.realtime && us)
+        usleep(us);
+}
+
+/// Counts one flash operation against an armed power cut.
+bool flash_alive()
+{
+    Emu &e = emu();
+    if (e.dead)
+        return false;
+    if (e.armed)
+    {
+        if (e.fail_after == 0)
+        {
+            e.dead = true;
+            return false;
+        }
+        e.fail_after--;
+    }
+    return true;
+}
+
+bool flash_program(size_t offset, const void *data, size_t len, uint32_t us)
+{
+    if (!flash_alive())
+        return false;
+    Emu &e = emu();
+    const uint8_t *src = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++)
+        e.image[offset + i] &= src[i];
+    e.stats.bytes_written += len;
+    charge(us);
+    return true;
+}
+
+bool flash_erase(size_t page)
+{
+    if (!flash_alive())
+        return false;
+    Emu &e = emu();
+    memset(page_ptr(page), 0xff, PAGE_SIZE);
+    e.stats.page_erases++;
+    charge(e.config.erase_us);
+    return true;
+}
+
+uint8_t entry_state(size_t page, size_t entry)
+{
+    const uint32_t *bitmap = (const uint32_t *)(page_ptr(page) + BITMAP_OFFSET);
+    return (bitmap[entry / 16] >> ((entry % 16) * 2)) & 3;
+}
+
+/// One word program per bitmap word touched, like `alterEntryRangeState()`.
+bool set_entry_state(size_t page, size_t first, size_t count, uint8_t state)
+{
+    Emu &e = emu();
+    size_t entry = first;
+    while (entry < first + count)
+    {
+        size_t word = entry / 16;
+        uint32_t value = 0xffffffff;
+        for (; entry < first + count && entry / 16 == word; entry++)
+        {
+            uint32_t shift = (entry % 16) * 2;
+            value &= ~(3u << shift) | ((uint32_t)state << shift);
+        }
+        if (!flash_program(page * PAGE_SIZE + BITMAP_OFFSET + word * 4, &value, 4, e.config.state_write_us))
+            return false;
+        e.stats.state_writes++;
+    }
+    return true;
+}
+
+bool set_page_state(size_t page, uint32_t state)
+{
+    Emu &e = emu();
+    if (!flash_program(page * PAGE_SIZE, &state, 4, e.config.state_write_us))
+        return false;
+    e.stats.state_writes++;
+    e.pages[page].state = state;
+    return true;
+}
+
+bool activate_page(size_t page)
+{
+    Emu &e = emu();
+    PageHeader h;
+    memset(&h, 0xff, sizeof(h));
+    h.state = PAGE_ACTIVE;
+    h.seq = e.next_seq++;
+    h.version = 0xfe;
+    h.crc = header_crc(h);
+    if (!flash_program(page * PAGE_SIZE, &h, sizeof(h), e.config.entry_write_us))
+        return false;
+    e.stats.state_writes++;
+    Page &p = e.pages[page];
+    p.state = PAGE_ACTIVE;
+    p.seq = h.seq;
+    p.next = 0;
+    p.used = 0;
+    p.erased = 0;
+    e.active = (int)page;
+    return true;
+}
+
+bool erase_page(size_t page)
+{
+    Emu &e = emu();
+    if (!flash_erase(page))
+        return false;
+    Page &p = e.pages[page];
+    p.state = PAGE_EMPTY;
+    p.seq = 0;
+    p.next = 0;
+    p.used = 0;
+    p.erased = 0;
+    if (e.active == (int)page)
+        e.active = -1;
+    return true;
+}
+
+bool drop_entries(const Loc &loc)
+{
+    Emu &e = emu();
+    if (!set_entry_state(loc.page, loc.entry, loc.span, ENTRY_ERASED))
+        return false;
+    Page &p = e.pages[loc.page];
+    p.used -= std::min(p.used, (size_t)loc.span);
+    p.erased += loc.span;
+    return true;
+}
+
+bool find(const Key &key, Loc &loc)
+{
+    Emu &e = emu();
+    e.stats.lookups++;
+    std::map<Key, Loc>::iterator it = e.index.find(key);
+    if (it == e.index.end())
+        return false;
+    loc = it->second;
+    return true;
+}
+
+std::vector<size_t> empty_pages()
+{
+    Emu &e = emu();
+    std::vector<size_t> list;
+    for (size_t i = 0; i < e.pages.size(); i++)
+        if (e.pages[i].state == PAGE_EMPTY)
+            list.push_back(i);
+    return list;
+}
+
+/// Copies a live item to the end of the active page, the caller made room.
+bool move_item(const Key &key, Loc &loc)
+{
+    Emu &e = emu();
+    Page &dst = e.pages[e.active];
+    size_t bytes = loc.span * ENTRY_SIZE;
+    const Item *src = entry_ptr(loc.page, loc.entry);
+    size_t offset = e.active * PAGE_SIZE + ENTRY_OFFSET + dst.next * ENTRY_SIZE;
+    if (!flash_program(offset, src, bytes, e.config.entry_write_us * loc.span))
+        return false;
+    e.stats.entries_written += loc.span;
+    if (!set_entry_state(e.active, dst.next, loc.span, ENTRY_WRITTEN))
+        return false;
+    loc.page = e.active;
+    loc.entry = dst.next;
+    dst.next += loc.span;
+    dst.used += loc.span;
+    e.index[key] = loc;
+    return true;
+}
+
+/// Moves every live item of `victim` to the active page and erases it.
+esp_err_t reclaim(size_t victim)
+{
+    Emu &e = emu();
+    std::vector<std::pair<size_t, Key> > live;
+    for (std::map<Key, Loc>::iterator it = e.index.begin(); it != e.index.end(); ++it)
+        if (it->second.page == victim)
+            live.push_back(std::make_pair(it->second.entry, it->first));
+    std::sort(live.begin(), live.end(), [](const std::pair<size_t, Key> &a, const std::pair<size_t, Key> &b) {
+        return a.first < b.first;
+    });
+    for (size_t i = 0; i < live.size(); i++)
+    {
+        Loc loc = e.index[live[i].second];
+        if (!move_item(live[i].second, loc))
+            return ESP_FAIL;
+    }
+    if (!erase_page(victim))
+        return ESP_FAIL;
+    e.stats.gc_runs++;
+    return ESP_OK;
+}
+
+/// Closes the active page and opens the next one, collecting garbage into
+/// the reserved page when it is the last EMPTY one.
+esp_err_t next_page()
+{
+    Emu &e = emu();
+    if (e.active >= 0)
+    {
+        if (!set_page_state(e.active, PAGE_FULL))
+            return ESP_FAIL;
+        e.active = -1;
+    }
+    std::vector<size_t> empty = empty_pages();
+    if (empty.size() >= 2)
+        return activate_page(empty[0]) ? ESP_OK : ESP_FAIL;
+    if (empty.empty())
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+
+    int victim = -1;
+    for (size_t i = 0; i < e.pages.size(); i++)
+    {
+        if (e.pages[i].state != PAGE_FULL || e.pages[i].erased == 0)
+            continue;
+        if (victim < 0 || e.pages[i].erased > e.pages[victim].erased)
+            victim = (int)i;
+    }
+    if (victim < 0)
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    if (!set_page_state(victim, PAGE_FREEING) || !activate_page(empty[0]))
+        return ESP_FAIL;
+    return reclaim(victim);
+}
+
+esp_err_t reserve(size_t span)
+{
+    Emu &e = emu();
+    for (;;)
+    {
+        if (e.active >= 0 && ENTRIES - e.pages[e.active].next >= span)
+            return ESP_OK;
+        esp_err_t err = next_page();
+        if (err != ESP_OK)
+            return err;
+    }
+}
+
+/// Appends one item with `size` payload bytes (variable types) or the
+/// 8 raw bytes in `raw` (everything else). A previous item under the same
+/// key is marked erased once the new one is written, wherever garbage
+/// collection moved it meanwhile.
+esp_err_t write_item(uint8_t ns, uint8_t type, uint8_t chunk, const char *key, const void *payload, size_t size,
+                     const uint8_t *raw, Loc *out)
+{
+    Emu &e = emu();
+    size_t span = is_var(type) ? 1 + (size + ENTRY_SIZE - 1) / ENTRY_SIZE : 1;
+    if (span > ENTRIES)
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+    esp_err_t err = reserve(span);
+    if (err != ESP_OK)
+        return err;
+
+    // On the stack, the benchmarks count heap allocations of the library.
+    uint8_t buf[ENTRIES * ENTRY_SIZE];
+    memset(buf, 0xff, span * ENTRY_SIZE);
+    Item &item = *(Item *)buf;
+    item.ns = ns;
+    item.type = type;
+    item.span = (uint8_t)span;
+    item.chunk = chunk;
+    memset(item.key, 0, sizeof(item.key));
+    strncpy(item.key, key, sizeof(item.key) - 1);
+    if (is_var(type))
+    {
+        item.data.var.size = (uint16_t)size;
+        item.data.var.reserved = 0xffff;
+        item.data.var.crc = crc32(0xffffffff, payload, size);
+        memcpy(buf + ENTRY_SIZE, payload, size);
+    }
+    else
+    {
+        memcpy(item.data.raw, raw, sizeof(item.data.raw));
+    }
+    item.crc = item_crc(item);
+
+    Page &p = e.pages[e.active];
+    size_t offset = e.active * PAGE_SIZE + ENTRY_OFFSET + p.next * ENTRY_SIZE;
+    if (!flash_program(offset, buf, span * ENTRY_SIZE, e.config.entry_write_us * span))
+        return ESP_FAIL;
+    e.stats.entries_written += span;
+    if (!set_entry_state(e.active, p.next, span, ENTRY_WRITTEN))
+        return ESP_FAIL;
+
+    Loc loc;
+    loc.page = e.active;
+    loc.entry = p.next;
+    loc.span = (uint8_t)span;
+    loc.type = type;
+    p.next += span;
+    p.used += span;
+    Key k = {ns, chunk, key};
+    std::map<Key, Loc>::iterator it = e.index.find(k);
+    bool replace = it != e.index.end();
+    Loc old = replace ? it->second : loc;
+    e.index[k] = loc;
+    if (out)
+        *out = loc;
+    if (replace && !drop_entries(old))
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+const uint8_t *item_payload(const Loc &loc, size_t &size)
+{
+    Emu &e = emu();
+    const Item *item = entry_ptr(loc.page, loc.entry);
+    size = item->data.var.size;
+    e.stats.entries_read += loc.span;
+    return (const uint8_t *)(item + 1);
+}
+
+bool erase_key(uint8_t ns, const char *key, const Loc &loc)
+{
+    Emu &e = emu();
+    if (loc.type == TYPE_BLOB_IDX)
+    {
+        const Item *idx = entry_ptr(loc.page, loc.entry);
+        uint8_t start = idx->data.idx.start, count = idx->data.idx.count;
+        for (uint8_t c = start; c < start + count; c++)
+        {
+            Key ck = {ns, c, key};
+            Loc cl;
+            if (find(ck, cl))
+            {
+                if (!drop_entries(cl))
+                    return false;
+                e.index.erase(ck);
+            }
+        }
+    }
+    if (!drop_entries(loc))
+        return false;
+    Key k = {ns, CHUNK_ANY, key};
+    e.index.erase(k);
+    return true;
+}
+
+/// Walks the chunks of the blob `loc` indexes, `out` receives the value
+/// and `compare`, when set, is checked against it instead. False when a
+/// chunk is missing or the data differs.
+bool read_blob(uint8_t ns, const char *key, const Loc &loc, uint8_t *out, const uint8_t *compare)
+{
+    const Item *idx = entry_ptr(loc.page, loc.entry);
+    emu().stats.entries_read++;
+    size_t offset = 0;
+    for (uint8_t c = idx->data.idx.start; c < idx->data.idx.start + idx->data.idx.count; c++)
+    {
+        Key ck = {ns, c, key};
+        Loc cl;
+        if (!find(ck, cl))
+            return false;
+        size_t size;
+        const uint8_t *data = item_payload(cl, size);
+        if (offset + size > idx->data.idx.size)
+            return false;
+        if (compare && memcmp(compare + offset, data, size) != 0)
+            return false;
+        if (out)
+            memcpy(out + offset, data, size);
+        offset += size;
+    }
+    return offset == idx->data.idx.size;
+}
+
+size_t max_blob_size()
+{
+    size_t size = (emu().pages.size() - 1) * CHUNK_MAX / 2;
+    return std::min(size, BLOB_MAX);
+}
+
+/// New chunks under the other version, then the index, then the old
+/// version is erased, so a power cut leaves either value readable.
+esp_err_t write_blob(uint8_t ns, const char *key, const uint8_t *data, size_t length, const Loc *old)
+{
+    Emu &e = emu();
+    uint8_t start = VER_0, old_start = VER_0, old_count = 0;
+    if (old)
+    {
+        const Item *idx = entry_ptr(old->page, old->entry);
+        old_start = idx->data.idx.start;
+        old_count = idx->data.idx.count;
+        start = old_start == VER_0 ? VER_1 : VER_0;
+    }
+
+    uint8_t count = 0;
+    size_t offset = 0;
+    esp_err_t err = ESP_OK;
+    while (offset < length)
+    {
+        if (count == VER_1 - 1)
+        {
+            err = ESP_ERR_NVS_VALUE_TOO_LONG;
+            break;
+        }
+        if (e.active < 0 || ENTRIES - e.pages[e.active].next < 2)
+        {
+            err = next_page();
+            if (err != ESP_OK)
+                break;
+        }
+        size_t room = (ENTRIES - e.pages[e.active].next - 1) * ENTRY_SIZE;
+        size_t n = std::min(length - offset, room);
+        err = write_item(ns, TYPE_BLOB_DATA, start + count, key, data + offset, n, NULL, NULL);
+        if (err != ESP_OK)
+            break;
+        offset += n;
+        count++;
+    }
+
+    if (err == ESP_OK)
+    {
+        uint8_t raw[8];
+        memset(raw, 0xff, sizeof(raw));
+        uint32_t size = (uint32_t)length;
+        memcpy(raw, &size, 4);
+        raw[4] = count;
+        raw[5] = start;
+        err = write_item(ns, TYPE_BLOB_IDX, CHUNK_ANY, key, NULL, 0, raw, NULL);
+    }
+
+    uint8_t drop_start = err == ESP_OK ? old_start : start;
+    uint8_t drop_count = err == ESP_OK ? old_count : count;
+    for (uint8_t c = drop_start; c < drop_start + drop_count; c++)
+    {
+        Key ck = {ns, c, key};
+        std::map<Key, Loc>::iterator it = e.index.find(ck);
+        if (it == e.index.end())
+            continue;
+        if (!drop_entries(it->second))
+            return ESP_FAIL;
+        e.index.erase(it);
+    }
+    return err;
+}
+
+bool is_blank(const uint8_t *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        if (p[i] != 0xff)
+            return false;
+    return true;
+}
+
+/// Scans one written page, older duplicates lose like in `Page::load()`.
+bool load_page(size_t page)
+{
+    Emu &e = emu();
+    Page &p = e.pages[page];
+    size_t i = 0;
+    size_t last = 0;
+    while (i < ENTRIES)
+    {
+        uint8_t state = entry_state(page, i);
+        if (state == ENTRY_EMPTY)
+        {
+            if (!is_blank((const uint8_t *)entry_ptr(page, i), ENTRY_SIZE))
+            {
+                // Programmed but never marked written: interrupted write.
+                if (!set_entry_state(page, i, 1, ENTRY_ERASED))
+                    return false;
+                p.erased++;
+                last = i + 1;
+            }
+            i++;
+            continue;
+        }
+        last = i + 1;
+        if (state != ENTRY_WRITTEN)
+        {
+            p.erased++;
+            i++;
+            continue;
+        }
+        const Item *item = entry_ptr(page, i);
+        bool valid = item->crc == item_crc(*item) && item->span >= 1 && i + item->span <= ENTRIES;
+        if (valid && is_var(item->type))
+            valid = item->span == 1 + (item->data.var.size + ENTRY_SIZE - 1) / ENTRY_SIZE &&
+                    crc32(0xffffffff, item + 1, item->data.var.size) == item->data.var.crc;
+        for (size_t k = 1; valid && k < item->span; k++)
+            valid = entry_state(page, i + k) == ENTRY_WRITTEN;
+        if (!valid)
+        {
+            if (!set_entry_state(page, i, 1, ENTRY_ERASED))
+                return false;
+            p.erased++;
+            i++;
+            continue;
+        }
+
+        char name[NVS_KEY_NAME_MAX_SIZE];
+        memcpy(name, item->key, sizeof(name));
+        name[sizeof(name) - 1] = 0;
+        Key k = {item->ns, item->chunk, name};
+        std::map<Key, Loc>::iterator it = e.index.find(k);
+        if (it != e.index.end())
+        {
+            if (!drop_entries(it->second))
+                return false;
+        }
+        Loc loc;
+        loc.page = page;
+        loc.entry = i;
+        loc.span = item->span;
+        loc.type = item->type;
+        e.index[k] = loc;
+        p.used += item->span;
+        i += item->span;
+        last = i;
+    }
+    p.next = last;
+    return true;
+}
+
+/// Drops chunks no index refers to and indexes with missing chunks.
+bool drop_orphans()
+{
+    Emu &e = emu();
+    std::vector<Key> orphans;
+    for (std::map<Key, Loc>::iterator it = e.index.begin(); it != e.index.end(); ++it)
+    {
+        const Key &k = it->first;
+        if (it->second.type == TYPE_BLOB_DATA)
+        {
+            Key ik = {k.ns, CHUNK_ANY, k.name};
+            std::map<Key, Loc>::iterator idx = e.index.find(ik);
+            bool ok = idx != e.index.end() && idx->second.type == TYPE_BLOB_IDX;
+            if (ok)
+            {
+                const Item *item = entry_ptr(idx->second.page, idx->second.entry);
+                ok = k.chunk >= item->data.idx.start && k.chunk < item->data.idx.start + item->data.idx.count;
+            }
+            if (!ok)
+                orphans.push_back(k);
+        }
+        else if (it->second.type == TYPE_BLOB_IDX)
+        {
+            const Item *item = entry_ptr(it->second.page, it->second.entry);
+            for (uint8_t c = item->data.idx.start; c < item->data.idx.start + item->data.idx.count; c++)
+            {
+                Key ck = {k.ns, c, k.name};
+                if (e.index.find(ck) == e.index.end())
+                {
+                    orphans.push_back(k);
+                    break;
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < orphans.size(); i++)
+    {
+        if (!drop_entries(e.index[orphans[i]]))
+            return false;
+        e.index.erase(orphans[i]);
+    }
+    if (!orphans.empty())
+        return drop_orphans(); // chunks of a dropped index
+    return true;
+}
+
+esp_err_t load()
+{
+    Emu &e = emu();
+    size_t count = e.size / PAGE_SIZE;
+    e.pages.assign(count, Page());
+    e.index.clear();
+    e.namespaces.clear();
+    e.active = -1;
+    e.next_seq = 0;
+
+    std::vector<std::pair<uint32_t, size_t> > order;
+    for (size_t i = 0; i < count; i++)
+    {
+        const PageHeader *h = (const PageHeader *)page_ptr(i);
+        Page &p = e.pages[i];
+        p.state = h->state;
+        p.seq = h->seq;
+        bool known = h->state == PAGE_ACTIVE || h->state == PAGE_FULL || h->state == PAGE_FREEING;
+        if (h->state == PAGE_EMPTY)
+        {
+            if (!is_blank(page_ptr(i), PAGE_SIZE) && !erase_page(i))
+                return ESP_FAIL;
+            continue;
+        }
+        if (!known || h->crc != header_crc(*h))
+        {
+            if (!erase_page(i))
+                return ESP_FAIL;
+            continue;
+        }
+        order.push_back(std::make_pair(h->seq, i));
+        e.next_seq = std::max(e.next_seq, h->seq + 1);
+    }
+    std::sort(order.begin(), order.end());
+    for (size_t i = 0; i < order.size(); i++)
+        if (!load_page(order[i].second))
+            return ESP_FAIL;
+    if (!drop_orphans())
+        return ESP_FAIL;
+
+    // Newest ACTIVE page stays active, others were left by a power cut.
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        size_t page = order[i].second;
+        if (e.pages[page].state != PAGE_ACTIVE)
+            continue;
+        if (e.active >= 0 && !set_page_state(e.active, PAGE_FULL))
+            return ESP_FAIL;
+        e.active = (int)page;
+    }
+
+    // Finish an interrupted garbage collection.
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        size_t page = order[i].second;
+        if (e.pages[page].state != PAGE_FREEING)
+            continue;
+        if (e.active < 0 || ENTRIES - e.pages[e.active].next < e.pages[page].used)
+        {
+            std::vector<size_t> empty = empty_pages();
+            if (empty.empty())
+                return ESP_ERR_NVS_NO_FREE_PAGES;
+            if (e.active >= 0 && !set_page_state(e.active, PAGE_FULL))
+                return ESP_FAIL;
+            if (!activate_page(empty[0]))
+                return ESP_FAIL;
+        }
+        esp_err_t err = reclaim(page);
+        if (err != ESP_OK)
+            return err;
+    }
+
+    if (empty_pages().empty())
+        return ESP_ERR_NVS_NO_FREE_PAGES;
+
+    for (std::map<Key, Loc>::iterator it = e.index.begin(); it != e.index.end(); ++it)
+    {
+        if (it->first.ns != NS_INDEX || it->second.type != NVS_TYPE_U8)
+            continue;
+        e.namespaces[it->first.name] = entry_ptr(it->second.page, it->second.entry)->data.raw[0];
+    }
+    return ESP_OK;
+}
+
+bool map_image()
+{
+    Emu &e = emu();
+    if (e.image)
+        return true;
+    e.size = e.config.pages * PAGE_SIZE;
+    if (e.config.path)
+    {
+        e.path = e.config.path;
+        e.fd = open(e.path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (e.fd < 0)
+            return false;
+        struct stat st;
+        fstat(e.fd, &st);
+        if ((size_t)st.st_size < e.size)
+        {
+            std::vector<uint8_t> blank(e.size - st.st_size, 0xff);
+            if (pwrite(e.fd, blank.data(), blank.size(), st.st_size) != (ssize_t)blank.size())
+                return false;
+        }
+        void *p = mmap(NULL, e.size, PROT_READ | PROT_WRITE, MAP_SHARED, e.fd, 0);
+        if (p == MAP_FAILED)
+            return false;
+        e.image = (uint8_t *)p;
+    }
+    else
+    {
+        void *p = mmap(NULL, e.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return false;
+        e.image = (uint8_t *)p;
+        memset(e.image, 0xff, e.size);
+    }
+    e.partition.type = ESP_PARTITION_TYPE_DATA;
+    e.partition.subtype = ESP_PARTITION_SUBTYPE_DATA_NVS;
+    e.partition.address = 0x9000;
+    e.partition.size = (uint32_t)e.size;
+    strcpy(e.partition.label, NVS_DEFAULT_PART_NAME);
+    return true;
+}
+
+void unmap_image()
+{
+    Emu &e = emu();
+    if (!e.image)
+        return;
+    munmap(e.image, e.size);
+    if (e.fd >= 0)
+        close(e.fd);
+    e.image = NULL;
+    e.fd = -1;
+}
+
+esp_err_t check_key(const char *key)
+{
+    if (!key || !*key)
+        return ESP_ERR_NVS_INVALID_NAME;
+    if (strlen(key) > NVS_KEY_NAME_MAX_SIZE - 1)
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    return ESP_OK;
+}
+
+esp_err_t get_handle(nvs_handle_t handle, bool write, uint8_t &ns)
+{
+    Emu &e = emu();
+    if (!e.ready)
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    if (handle == 0 || handle > e.handles.size() || !e.handles[handle - 1].open)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    if (write && e.handles[handle - 1].read_only)
+        return ESP_ERR_NVS_READ_ONLY;
+    if (e.dead)
+        return ESP_FAIL;
+    ns = e.handles[handle - 1].ns;
+    return ESP_OK;
+}
+
+esp_err_t set_int(nvs_handle_t handle, const char *key, nvs_type_t type, const void *value, size_t len)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    uint8_t ns;
+    esp_err_t err = get_handle(handle, true, ns);
+    if (err == ESP_OK)
+        err = check_key(key);
+    if (err != ESP_OK)
+        return err;
+
+    uint8_t raw[8];
+    memset(raw, 0xff, sizeof(raw));
+    memcpy(raw, value, len);
+    Key k = {ns, CHUNK_ANY, key};
+    Loc old;
+    bool exists = find(k, old);
+    if (exists)
+    {
+        if (old.type != type)
+            return ESP_ERR_NVS_TYPE_MISMATCH;
+        e.stats.entries_read++;
+        if (memcmp(entry_ptr(old.page, old.entry)->data.raw, raw, sizeof(raw)) == 0)
+            return ESP_OK;
+    }
+    return write_item(ns, type, CHUNK_ANY, key, NULL, 0, raw, NULL);
+}
+
+esp_err_t get_int(nvs_handle_t handle, const char *key, nvs_type_t type, void *out, size_t len)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    uint8_t ns;
+    esp_err_t err = get_handle(handle, false, ns);
+    if (err == ESP_OK)
+        err = check_key(key);
+    if (err != ESP_OK)
+        return err;
+    Key k = {ns, CHUNK_ANY, key};
+    Loc loc;
+    if (!find(k, loc))
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (loc.type != type)
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    e.stats.entries_read++;
+    memcpy(out, entry_ptr(loc.page, loc.entry)->data.raw, len);
+    return ESP_OK;
+}
+
+} // namespace
+
+struct nvs_opaque_iterator_t
+{
+    std::vector<nvs_entry_info_t> entries;
+    size_t pos;
+};
+
+extern "C" nvs_emu_config_t nvs_emu_default_config(void)
+{
+    nvs_emu_config_t config;
+    config.path = NULL;
+    config.pages = 5;
+    config.entry_write_us = 100;
+    config.state_write_us = 20;
+    config.erase_us = 45000;
+    config.commit_us = 0;
+    config.realtime = false;
+    return config;
+}
+
+extern "C" void nvs_emu_configure(const nvs_emu_config_t *config)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    e.config = *config;
+    if (e.config.pages < 2)
+        e.config.pages = 2;
+}
+
+extern "C" nvs_emu_stats_t nvs_emu_stats(void)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    return e.stats;
+}
+
+extern "C" void nvs_emu_reset_stats(void)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    memset(&e.stats, 0, sizeof(e.stats));
+}
+
+extern "C" void nvs_emu_fail_after(uint32_t writes)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    e.armed = writes != 0;
+    e.fail_after = writes;
+    e.dead = false;
+}
+
+extern "C" esp_err_t nvs_emu_power_cycle(void)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    e.armed = false;
+    e.dead = false;
+    if (!e.image)
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    esp_err_t err = load();
+    e.ready = err == ESP_OK;
+    return err;
+}
+
+extern "C" bool nvs_emu_busy(void)
+{
+    return api_depth != 0;
+}
+
+extern "C" size_t nvs_emu_free_pages(void)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    return empty_pages().size();
+}
+
+extern "C" esp_err_t nvs_flash_init(void)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    if (e.ready)
+        return ESP_OK;
+    if (!map_image())
+        return ESP_ERR_NVS_PART_NOT_FOUND;
+    esp_err_t err = load();
+    e.ready = err == ESP_OK;
+    return err;
+}
+
+extern "C" esp_err_t nvs_flash_deinit(void)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    if (!e.ready)
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    e.ready = false;
+    e.handles.clear();
+    e.index.clear();
+    e.namespaces.clear();
+    unmap_image();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_flash_erase(void)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    if (!map_image())
+        return ESP_ERR_NOT_FOUND;
+    return esp_partition_erase_range(&e.partition, 0, e.size);
+}
+
+extern "C" const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                           const char *label)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    if (type != ESP_PARTITION_TYPE_DATA)
+        return NULL;
+    if (subtype != ESP_PARTITION_SUBTYPE_DATA_NVS && subtype != ESP_PARTITION_SUBTYPE_ANY)
+        return NULL;
+    if (label && strcmp(label, NVS_DEFAULT_PART_NAME) != 0)
+        return NULL;
+    if (!map_image())
+        return NULL;
+    return &e.partition;
+}
+
+extern "C" esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    if (partition != &e.partition || offset % PAGE_SIZE || size % PAGE_SIZE || offset + size > e.size)
+        return ESP_ERR_INVALID_ARG;
+    for (size_t page = offset / PAGE_SIZE; page < (offset + size) / PAGE_SIZE; page++)
+    {
+        if (!flash_erase(page))
+            return ESP_FAIL;
+    }
+    e.ready = false;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    if (partition != &e.partition || src_offset + size > e.size)
+        return ESP_ERR_INVALID_ARG;
+    memcpy(dst, e.image + src_offset, size);
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    if (!e.ready)
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    esp_err_t err = check_key(name);
+    if (err != ESP_OK)
+        return err;
+
+    std::map<std::string, uint8_t>::iterator it = e.namespaces.find(name);
+    uint8_t ns;
+    if (it != e.namespaces.end())
+    {
+        ns = it->second;
+    }
+    else
+    {
+        if (open_mode == NVS_READONLY)
+            return ESP_ERR_NVS_NOT_FOUND;
+        std::vector<bool> taken(NS_ANY, false);
+        for (it = e.namespaces.begin(); it != e.namespaces.end(); ++it)
+            taken[it->second] = true;
+        ns = 0;
+        for (uint8_t i = 1; i < NS_ANY; i++)
+        {
+            if (!taken[i])
+            {
+                ns = i;
+                break;
+            }
+        }
+        if (ns == 0)
+            return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        uint8_t raw[8];
+        memset(raw, 0xff, sizeof(raw));
+        raw[0] = ns;
+        err = write_item(NS_INDEX, NVS_TYPE_U8, CHUNK_ANY, name, NULL, 0, raw, NULL);
+        if (err != ESP_OK)
+            return err;
+        e.namespaces[name] = ns;
+    }
+    Handle h = {ns, open_mode == NVS_READONLY, true};
+    e.handles.push_back(h);
+    *out_handle = (nvs_handle_t)e.handles.size();
+    return ESP_OK;
+}
+
+extern "C" void nvs_close(nvs_handle_t handle)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    if (handle && handle <= e.handles.size())
+        e.handles[handle - 1].open = false;
+}
+
+extern "C" esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    uint8_t ns;
+    esp_err_t err = get_handle(handle, false, ns);
+    if (err != ESP_OK)
+        return err;
+    e.stats.commits++;
+    charge(e.config.commit_us);
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    uint8_t ns;
+    esp_err_t err = get_handle(handle, true, ns);
+    if (err == ESP_OK)
+        err = check_key(key);
+    if (err != ESP_OK)
+        return err;
+    Key k = {ns, CHUNK_ANY, key};
+    Loc loc;
+    if (!find(k, loc))
+        return ESP_ERR_NVS_NOT_FOUND;
+    return erase_key(ns, key, loc) ? ESP_OK : ESP_FAIL;
+}
+
+extern "C" esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    uint8_t ns;
+    esp_err_t err = get_handle(handle, true, ns);
+    if (err != ESP_OK)
+        return err;
+    std::vector<Key> keys;
+    for (std::map<Key, Loc>::iterator it = e.index.begin(); it != e.index.end(); ++it)
+        if (it->first.ns == ns)
+            keys.push_back(it->first);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (!drop_entries(e.index[keys[i]]))
+            return ESP_FAIL;
+        e.index.erase(keys[i]);
+    }
+    return ESP_OK;
+}
+
+#define NVS_EMU_INT(name, ctype, type)                                                   \
+    extern "C" esp_err_t nvs_set_##name(nvs_handle_t handle, const char *key, ctype value) \
+    {                                                                                    \
+        return set_int(handle, key, type, &value, sizeof(value));                        \
+    }                                                                                    \
+    extern "C" esp_err_t nvs_get_##name(nvs_handle_t handle, const char *key, ctype *out)  \
+    {                                                                                    \
+        return get_int(handle, key, type, out, sizeof(*out));                            \
+    }
+
+NVS_EMU_INT(i8, int8_t, NVS_TYPE_I8)
+NVS_EMU_INT(u8, uint8_t, NVS_TYPE_U8)
+NVS_EMU_INT(i16, int16_t, NVS_TYPE_I16)
+NVS_EMU_INT(u16, uint16_t, NVS_TYPE_U16)
+NVS_EMU_INT(i32, int32_t, NVS_TYPE_I32)
+NVS_EMU_INT(u32, uint32_t, NVS_TYPE_U32)
+NVS_EMU_INT(i64, int64_t, NVS_TYPE_I64)
+NVS_EMU_INT(u64, uint64_t, NVS_TYPE_U64)
+
+extern "C" esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    uint8_t ns;
+    esp_err_t err = get_handle(handle, true, ns);
+    if (err == ESP_OK)
+        err = check_key(key);
+    if (err != ESP_OK)
+        return err;
+    size_t size = strlen(value) + 1;
+    if (size > CHUNK_MAX)
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+
+    Key k = {ns, CHUNK_ANY, key};
+    Loc old;
+    bool exists = find(k, old);
+    if (exists)
+    {
+        if (old.type != NVS_TYPE_STR)
+            return ESP_ERR_NVS_TYPE_MISMATCH;
+        size_t old_size;
+        const uint8_t *data = item_payload(old, old_size);
+        if (old_size == size && memcmp(data, value, size) == 0)
+            return ESP_OK;
+    }
+    return write_item(ns, NVS_TYPE_STR, CHUNK_ANY, key, value, size, NULL, NULL);
+}
+
+extern "C" esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    uint8_t ns;
+    esp_err_t err = get_handle(handle, true, ns);
+    if (err == ESP_OK)
+        err = check_key(key);
+    if (err != ESP_OK)
+        return err;
+    if (length > max_blob_size())
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+
+    Key k = {ns, CHUNK_ANY, key};
+    Loc old;
+    bool exists = find(k, old);
+    if (exists)
+    {
+        if (old.type != TYPE_BLOB_IDX)
+            return ESP_ERR_NVS_TYPE_MISMATCH;
+        if (entry_ptr(old.page, old.entry)->data.idx.size == length &&
+            read_blob(ns, key, old, NULL, (const uint8_t *)value))
+            return ESP_OK;
+    }
+    return write_blob(ns, key, (const uint8_t *)value, length, exists ? &old : NULL);
+}
+
+extern "C" esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out_value, size_t *length)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    uint8_t ns;
+    esp_err_t err = get_handle(handle, false, ns);
+    if (err == ESP_OK)
+        err = check_key(key);
+    if (err != ESP_OK)
+        return err;
+    Key k = {ns, CHUNK_ANY, key};
+    Loc loc;
+    if (!find(k, loc))
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (loc.type != NVS_TYPE_STR)
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    size_t size;
+    const uint8_t *data = item_payload(loc, size);
+    if (!out_value)
+    {
+        *length = size;
+        return ESP_OK;
+    }
+    if (*length < size)
+    {
+        *length = size;
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, data, size);
+    *length = size;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    uint8_t ns;
+    esp_err_t err = get_handle(handle, false, ns);
+    if (err == ESP_OK)
+        err = check_key(key);
+    if (err != ESP_OK)
+        return err;
+    Key k = {ns, CHUNK_ANY, key};
+    Loc loc;
+    if (!find(k, loc))
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (loc.type != TYPE_BLOB_IDX)
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    size_t size = entry_ptr(loc.page, loc.entry)->data.idx.size;
+    if (!out_value)
+    {
+        e.stats.entries_read++;
+        *length = size;
+        return ESP_OK;
+    }
+    if (*length < size)
+    {
+        *length = size;
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    if (!read_blob(ns, key, loc, (uint8_t *)out_value, NULL))
+        return ESP_ERR_NVS_NOT_FOUND;
+    *length = size;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_get_stats(const char *part_name, nvs_stats_t *nvs_stats)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    if (!nvs_stats)
+        return ESP_ERR_INVALID_ARG;
+    memset(nvs_stats, 0, sizeof(*nvs_stats));
+    if (part_name && strcmp(part_name, NVS_DEFAULT_PART_NAME) != 0)
+        return ESP_ERR_NVS_PART_NOT_FOUND;
+    if (!e.ready)
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    // Erased entries count as free like in `PageManager::fillStats()`.
+    for (size_t i = 0; i < e.pages.size(); i++)
+    {
+        nvs_stats->total_entries += ENTRIES;
+        nvs_stats->used_entries += e.pages[i].used;
+        nvs_stats->free_entries += ENTRIES - e.pages[i].used;
+    }
+    nvs_stats->namespace_count = e.namespaces.size();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_get_used_entry_count(nvs_handle_t handle, size_t *used_entries)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    uint8_t ns;
+    esp_err_t err = get_handle(handle, false, ns);
+    if (err != ESP_OK)
+        return err;
+    *used_entries = 0;
+    for (std::map<Key, Loc>::iterator it = e.index.begin(); it != e.index.end(); ++it)
+        if (it->first.ns == ns)
+            *used_entries += it->second.span;
+    return ESP_OK;
+}
+
+extern "C" nvs_iterator_t nvs_entry_find(const char *part_name, const char *namespace_name, nvs_type_t type)
+{
+    Emu &e = emu();
+    ApiLock locker(e);
+    if (!e.ready || (part_name && strcmp(part_name, NVS_DEFAULT_PART_NAME) != 0))
+        return NULL;
+    std::map<uint8_t, std::string> names;
+    for (std::map<std::string, uint8_t>::iterator it = e.namespaces.begin(); it != e.namespaces.end(); ++it)
+        names[it->second] = it->first;
+
+    nvs_opaque_iterator_t *iter = new nvs_opaque_iterator_t();
+    iter->pos = 0;
+    for (std::map<Key, Loc>::iterator it = e.index.begin(); it != e.index.end(); ++it)
+    {
+        const Key &k = it->first;
+        if (k.ns == NS_INDEX || it->second.type == TYPE_BLOB_DATA)
+            continue;
+        if (namespace_name && names[k.ns] != namespace_name)
+            continue;
+        nvs_type_t t = it->second.type == TYPE_BLOB_IDX ? NVS_TYPE_BLOB : (nvs_type_t)it->second.type;
+        if (type != NVS_TYPE_ANY && type != t)
+            continue;
+        nvs_entry_info_t info;
+        memset(&info, 0, sizeof(info));
+        strncpy(info.namespace_name, names[k.ns].c_str(), sizeof(info.namespace_name) - 1);
+        strncpy(info.key, k.name.c_str(), sizeof(info.key) - 1);
+        info.type = t;
+        iter->entries.push_back(info);
+    }
+    if (iter->entries.empty())
+    {
+        delete iter;
+        return NULL;
+    }
+    return iter;
+}
+
+extern "C" nvs_iterator_t nvs_entry_next(nvs_iterator_t iterator)
+{
+    if (!iterator)
+        return NULL;
+    if (++iterator->pos >= iterator->entries.size())
+    {
+        delete iterator;
+        return NULL;
+    }
+    return iterator;
+}
+
+extern "C" void nvs_entry_info(nvs_iterator_t iterator, nvs_entry_info_t *out_info)
+{
+    *out_info = iterator->entries[iterator->pos];
+}
+
+extern "C" void nvs_release_iterator(nvs_iterator_t iterator)
+{
+    delete iterator;
+}
@@ -0,0 +1,93 @@
+/*
+ * nvs_emu.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// File backed emulator of the IDF NVS partition for host builds. It keeps
+/// the on-flash layout of IDF 4.x (4 KiB pages, 32 byte entries, 126 per
+/// page, multi-page blobs as versioned chunks plus an index item), so entry
+/// counts, page fill and garbage collection match the target. Flash time is
+/// modelled from per operation costs and reported with the counters below.
+#ifndef __NVS_EMU_H__
+#define __NVS_EMU_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NVS_EMU_PAGE_SIZE 4096
+#define NVS_EMU_ENTRY_SIZE 32
+#define NVS_EMU_PAGE_ENTRIES 126
+
+typedef struct
+{
+    const char *path;         ///< image file, NULL keeps the image in RAM
+    size_t pages;             ///< partition size in pages, one is kept free for GC
+    uint32_t entry_write_us;  ///< programming one 32 byte entry
+    uint32_t state_write_us;  ///< programming one entry state or page header word
+    uint32_t erase_us;        ///< erasing one 4 KiB sector
+    uint32_t commit_us;       ///< `nvs_commit()`, writes are immediate in IDF
+    bool realtime;            ///< also sleep the modelled time
+} nvs_emu_config_t;
+
+typedef struct
+{
+    uint64_t lookups;         ///< index probes by get, set and erase
+    uint64_t entries_read;
+    uint64_t entries_written;
+    uint64_t bytes_written;   ///< entries, state words and page headers
+    uint64_t state_writes;
+    uint64_t page_erases;
+    uint64_t gc_runs;         ///< pages reclaimed by moving their live items
+    uint64_t commits;
+    uint64_t flash_us;        ///< modelled flash time of everything above
+} nvs_emu_stats_t;
+
+/// Defaults: RAM image of 5 pages (0x5000, the Arduino default partition),
+/// 100 us per entry, 20 us per state word, 45 ms per sector erase.
+nvs_emu_config_t nvs_emu_default_config(void);
+
+/// Takes effect at the next `nvs_flash_init()`.
+void nvs_emu_configure(const nvs_emu_config_t *config);
+
+nvs_emu_stats_t nvs_emu_stats(void);
+void nvs_emu_reset_stats(void);
+
+/// Simulated power cut: after `writes` more flash operations every write is
+/// dropped and the API fails. 0 disarms.
+void nvs_emu_fail_after(uint32_t writes);
+
+/// Rebuilds the state from the image like a reboot, recovering interrupted
+/// operations. Open handles stay valid.
+esp_err_t nvs_emu_power_cycle(void);
+
+/// Pages currently in the EMPTY state, the reserved GC page included.
+size_t nvs_emu_free_pages(void);
+
+/// True while the calling thread is inside the emulator, benchmarks use it
+/// to leave the emulator's own heap use out of their counts.
+bool nvs_emu_busy(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
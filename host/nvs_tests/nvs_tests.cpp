@@ -0,0 +1,826 @@
+/*
+ * nvs_tests.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// Functional tests of the NVS code on the emulated partition, one case
+/// per run so each starts from an empty RAM image.
+///
+///   nvs_tests <case>
+///
+/// Prints every failed check and exits with 1 if there was any.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "ArduinoNvs.h"
+#include "NvsConfigStore.h"
+#include "NvsRecord.h"
+#include "NvsRWLock.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "nvs_emu.h"
+
+static std::atomic<int> failures(0);
+
+#define CHECK(cond) check((cond), __LINE__, #cond)
+
+static void check(bool ok, int line, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: line %d: %s\n", line, what);
+        failures++;
+    }
+}
+
+static std::vector<uint8_t> pattern(size_t length, int seed)
+{
+    std::vector<uint8_t> v(length);
+    for (size_t i = 0; i < length; i++)
+        v[i] = (uint8_t)(i * 7 + seed * 31);
+    return v;
+}
+
+static std::vector<uint8_t> read_large(ArduinoNvs &nvs, const char *key)
+{
+    std::vector<uint8_t> v(nvs.getLargeBlobSize(key));
+    if (!v.empty() && nvs.readLargeBlob(key, 0, v.data(), v.size()) != v.size())
+        v.clear();
+    return v;
+}
+
+static size_t count_keys(const char *ns)
+{
+    size_t n = 0;
+    for (nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns, NVS_TYPE_ANY); it; it = nvs_entry_next(it))
+        n++;
+    return n;
+}
+
+/// A power cut at any point of a rewrite leaves either the old or the new
+/// value readable, and a clean rewrite leaves no stale shards behind.
+static void test_large_blob_power_cut()
+{
+    ArduinoNvs nvs("lb_cut");
+    std::vector<uint8_t> cur = pattern(5000, 0);
+    CHECK(nvs.setLargeBlob("big", cur.data(), cur.size()));
+    int changed = 0;
+    int kept = 0;
+    for (uint32_t cut = 1; cut < 400; cut += 3)
+    {
+        std::vector<uint8_t> next = pattern(cut % 2 ? 7000 : 3000, cut);
+        nvs_emu_fail_after(cut);
+        nvs.setLargeBlob("big", next.data(), next.size());
+        nvs_emu_fail_after(0);
+        CHECK(nvs_emu_power_cycle() == ESP_OK);
+        std::vector<uint8_t> got = read_large(nvs, "big");
+        if (got == next)
+        {
+            changed++;
+            cur = next;
+        }
+        else if (got == cur)
+            kept++;
+        else
+        {
+            printf("FAIL: cut after %u writes: blob corrupted, %u bytes\n", (unsigned)cut, (unsigned)got.size());
+            failures++;
+            return;
+        }
+    }
+    CHECK(changed > 0 && kept > 0);
+
+    // Header, claim key and 2 shards of 1984 bytes.
+    std::vector<uint8_t> next = pattern(3000, 99);
+    CHECK(nvs.setLargeBlob("big", next.data(), next.size()));
+    CHECK(read_large(nvs, "big") == next);
+    CHECK(count_keys("lb_cut") == 4);
+    CHECK(nvs.eraseLargeBlob("big"));
+    CHECK(count_keys("lb_cut") == 0);
+}
+
+/// Serves a buffer and reads the namespace on every byte, which only
+/// works while writeLargeBlob() reads its source without the lock.
+class ProbingStream : public Stream
+{
+public:
+    ProbingStream(ArduinoNvs &nvs, const std::vector<uint8_t> &data) : _nvs(nvs), _data(data), _pos(0), _probes(0) {}
+    int available() override { return (int)(_data.size() - _pos); }
+    int read() override
+    {
+        if (_nvs.getInt("probe") == 42)
+            _probes++;
+        return _pos < _data.size() ? _data[_pos++] : -1;
+    }
+    int peek() override { return _pos < _data.size() ? _data[_pos] : -1; }
+    size_t write(uint8_t) override { return 0; }
+    size_t probes() { return _probes; }
+
+private:
+    ArduinoNvs &_nvs;
+    const std::vector<uint8_t> &_data;
+    size_t _pos;
+    size_t _probes;
+};
+
+static void test_large_blob_stream()
+{
+    ArduinoNvs nvs("lb_stream");
+    ArduinoNvs other("lb_stream");
+    CHECK(nvs.setInt("probe", (int32_t)42));
+    std::vector<uint8_t> data = pattern(4500, 3);
+    ProbingStream src(other, data);
+    CHECK(nvs.setLargeBlob("big", src, data.size()));
+    CHECK(src.probes() == data.size());
+    CHECK(read_large(nvs, "big") == data);
+}
+
+static bool has_internal_keys(const char *ns)
+{
+    nvs_entry_info_t info;
+    for (nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns, NVS_TYPE_ANY); it; it = nvs_entry_next(it))
+    {
+        nvs_entry_info(it, &info);
+        if (strncmp(info.key, "__", 2) == 0)
+            return true;
+    }
+    return false;
+}
+
+/// Export, then import into another namespace: every value comes back,
+/// packed ones unpacked and without their markers.
+static void test_export_import()
+{
+    ArduinoNvs src("exp_src");
+    src.setCompression(true, 16);
+    std::string text(300, 'a');
+    std::vector<uint8_t> blob(400, 0x55);
+    std::vector<uint8_t> big = pattern(4500, 1);
+    CHECK(src.setInt("u8", (uint8_t)200));
+    CHECK(src.setInt("i16", (int16_t)-1234));
+    CHECK(src.setInt("u64", (uint64_t)0x123456789abcULL));
+    CHECK(src.setString("short", "hi"));
+    CHECK(src.setString("text", text.c_str()));
+    CHECK(src.setBlob("blob", blob));
+    CHECK(src.setLargeBlob("big", big.data(), big.size()));
+    CHECK(src.compressStats().values == 2);
+    CHECK(has_internal_keys("exp_src"));
+
+    std::vector<uint8_t> snapshot;
+    CHECK(src.exportTo(snapshot));
+
+    ArduinoNvs dst("exp_dst");
+    dst.setCompression(true, 16);
+    CHECK(dst.setString("text", std::string(200, 'b').c_str()));
+    CHECK(has_internal_keys("exp_dst"));
+    dst.setCompression(false);
+    CHECK(dst.importFrom(snapshot.data(), snapshot.size()));
+    CHECK(!has_internal_keys("exp_dst"));
+    CHECK(dst.getInt("u8") == 200);
+    CHECK(dst.getIntType("i16") == NVS_TYPE_I16 && dst.getInt("i16") == -1234);
+    CHECK(dst.getInt("u64") == 0x123456789abcLL);
+    CHECK(dst.getString("short") == "hi");
+    CHECK(dst.getString("text") == text.c_str());
+    CHECK(dst.getBlob("blob") == blob);
+    CHECK(read_large(dst, "big") == big);
+
+    // Damaged or truncated snapshots are refused before anything is written.
+    std::vector<uint8_t> bad = snapshot;
+    bad[20] ^= 1;
+    CHECK(!dst.importFrom(bad.data(), bad.size(), true));
+    CHECK(!dst.importFrom(snapshot.data(), snapshot.size() / 2, true));
+    CHECK(dst.getString("short") == "hi");
+}
+
+/// Exposes the handle to look at the stored types.
+class RawNvs : public ArduinoNvs
+{
+public:
+    explicit RawNvs(const char *ns) : ArduinoNvs(ns) {}
+    nvs_handle handle()
+    {
+        isValid();
+        return _nvs_handle;
+    }
+};
+
+static std::string text(size_t length, bool compressible, int seed = 0)
+{
+    std::string s;
+    for (size_t i = 0; i < length; i++)
+        s += compressible ? (char)('a' + (i + seed) % 7) : (char)('a' + (i * 7919 + i * i * 31 + seed) % 26);
+    return s;
+}
+
+static bool blob_is(ArduinoNvs &nvs, const char *key, const void *data, size_t length)
+{
+    std::vector<uint8_t> got = nvs.getBlob(key);
+    return nvs.getBlobSize(key) == length && got.size() == length && memcmp(got.data(), data, length) == 0;
+}
+
+static void compression_round_trip(bool writeBack)
+{
+    const char *ns = writeBack ? "lz_wb" : "lz_wt";
+    RawNvs nvs(ns);
+    if (writeBack)
+        CHECK(nvs.setWriteBack(true, 8, 0));
+    size_t length = 0;
+
+    // A plain blob that looks like a packed one is returned as stored.
+    uint8_t fake[64] = {'N', 'V', 'Z', 'b', 200, 0, 0, 0, 0xff, 'x'};
+    CHECK(nvs.setBlob("fake", fake, sizeof(fake)));
+    CHECK(blob_is(nvs, "fake", fake, sizeof(fake)));
+
+    nvs.setCompression(true, 64);
+    std::string big = text(2000, true);
+    CHECK(nvs.setBlob("b", (const uint8_t *)big.data(), big.size()));
+    CHECK(nvs.compressStats().values == 1);
+    CHECK(nvs.compressStats().stored_bytes < big.size() / 4);
+    CHECK(blob_is(nvs, "b", big.data(), big.size()));
+
+    // A packed string keeps its blob once compression is off, framed
+    // without compression or short.
+    CHECK(nvs.setString("s", big.c_str()));
+    CHECK(nvs.getString("s") == big.c_str());
+    nvs.setCompression(false);
+    std::string rnd = text(500, false);
+    CHECK(nvs.setString("s", rnd.c_str()));
+    CHECK(nvs.getString("s") == rnd.c_str());
+    CHECK(nvs.setString("s", "hi"));
+    char buf[8];
+    length = sizeof(buf);
+    CHECK(nvs.getString("s", buf, length) && strcmp(buf, "hi") == 0);
+    CHECK(nvs.commit());
+    CHECK(nvs_get_blob(nvs.handle(), "s", NULL, &length) == ESP_OK);
+
+    // A plain string is not packed later on.
+    CHECK(nvs.setString("ps", big.c_str()));
+    nvs.setCompression(true, 64);
+    CHECK(nvs.setString("ps", (big + "x").c_str()));
+    CHECK(nvs.getString("ps") == (big + "x").c_str());
+    CHECK(nvs.commit());
+    CHECK(nvs_get_str(nvs.handle(), "ps", NULL, &length) == ESP_OK);
+
+    // Plain blobs and erases drop the marker of a packed value.
+    CHECK(nvs.setBlob("b", fake, sizeof(fake)));
+    CHECK(blob_is(nvs, "b", fake, sizeof(fake)));
+    CHECK(nvs.setBlob("e", (const uint8_t *)big.data(), big.size()));
+    CHECK(nvs.erase("e"));
+    nvs.setCompression(false);
+    CHECK(nvs.setBlob("e", fake, sizeof(fake)));
+    CHECK(blob_is(nvs, "e", fake, sizeof(fake)));
+    CHECK(nvs.commit());
+
+    // Markers survive a reopen and a preload snapshot.
+    RawNvs other(ns);
+    CHECK(other.getString("s") == "hi");
+    CHECK(blob_is(other, "b", fake, sizeof(fake)));
+    CHECK(other.preload());
+    CHECK(other.getString("s") == "hi");
+    CHECK(blob_is(other, "fake", fake, sizeof(fake)));
+}
+
+static void test_compression()
+{
+    compression_round_trip(false);
+    compression_round_trip(true);
+}
+
+static ArduinoNvs *shared_nvs;
+static std::atomic<int> setters_done(0);
+
+/// Alternates between a packed and a plain value, which moves the marker.
+static void setter_task(void *param)
+{
+    int id = (int)(intptr_t)param;
+    std::string packs = text(400, true, id);
+    std::string plain = text(400, false, id);
+    for (int i = 0; i < 100; i++)
+    {
+        const std::string &v = i % 2 ? plain : packs;
+        CHECK(shared_nvs->setBlob("blob", (const uint8_t *)v.data(), v.size(), false));
+        CHECK(shared_nvs->setString("str", (i % 2 ? plain : packs).c_str(), false));
+    }
+    setters_done++;
+    vTaskDelete(NULL);
+}
+
+/// Concurrent setters of one key: whatever value ends up stored reads back
+/// whole, its marker matches.
+static void test_compression_concurrent()
+{
+    ArduinoNvs nvs("lz_race");
+    nvs.setCompression(true, 64);
+    shared_nvs = &nvs;
+    for (int i = 0; i < 4; i++)
+        xTaskCreate(setter_task, "setter", 8192, (void *)(intptr_t)i, 1, NULL);
+    while (setters_done < 4)
+        vTaskDelay(pdMS_TO_TICKS(5));
+    CHECK(nvs.commit());
+
+    std::vector<std::string> values;
+    for (int i = 0; i < 4; i++)
+    {
+        values.push_back(text(400, true, i));
+        values.push_back(text(400, false, i));
+    }
+    ArduinoNvs other("lz_race");
+    std::vector<uint8_t> blob = other.getBlob("blob");
+    std::string str = other.getString("str").c_str();
+    bool blob_ok = false;
+    bool str_ok = false;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        blob_ok |= std::string(blob.begin(), blob.end()) == values[i];
+        str_ok |= str == values[i];
+    }
+    CHECK(blob_ok);
+    CHECK(str_ok);
+}
+
+/// Sets only reach flash on commit, erases are pending like sets, and
+/// values equal to the stored ones are not rewritten.
+static void test_write_back()
+{
+    ArduinoNvs nvs("wb");
+    ArduinoNvs flash("wb");
+    CHECK(nvs.setInt("kept", (int32_t)1));
+    CHECK(nvs.setInt("gone", (int32_t)2));
+    CHECK(nvs.setWriteBack(true, 0, 0));
+
+    CHECK(nvs.setInt("a", (int32_t)10));
+    CHECK(nvs.setString("s", "text"));
+    CHECK(nvs.setInt("a", (int32_t)11));
+    CHECK(nvs.dirtyCount() == 2);
+    CHECK(nvs.getInt("a") == 11 && nvs.getString("s") == "text");
+    CHECK(flash.getInt("a", -1) == -1);
+
+    // Set then erased before the flush: nothing reaches flash.
+    CHECK(nvs.setInt("tmp", (int32_t)3));
+    CHECK(nvs.erase("tmp"));
+    CHECK(nvs.getInt("tmp", -1) == -1);
+    CHECK(nvs.erase("gone"));
+    CHECK(nvs.getInt("gone", -1) == -1 && flash.getInt("gone", -1) == 2);
+
+    // Unchanged on flash, counted dirty but not rewritten.
+    CHECK(nvs.setInt("kept", (int32_t)1));
+    nvs.resetWriteStats();
+    CHECK(nvs.commit());
+    CHECK(nvs.dirtyCount() == 0);
+    CHECK(nvs.writeStats().sets == 2);
+    CHECK(flash.getInt("a") == 11 && flash.getString("s") == "text");
+    CHECK(flash.getInt("tmp", -1) == -1 && flash.getInt("gone", -1) == -1 && flash.getInt("kept") == 1);
+
+    // The dirty threshold commits by itself.
+    CHECK(nvs.setWriteBack(false));
+    CHECK(nvs.setWriteBack(true, 3, 0));
+    for (int i = 0; i < 3; i++)
+        CHECK(nvs.setInt(("t" + std::to_string(i)).c_str(), (int32_t)i));
+    CHECK(nvs.dirtyCount() == 0 && flash.getInt("t2", -1) == 2);
+
+    // eraseAll() drops pending values, disabling the cache flushes it.
+    CHECK(nvs.setInt("x", (int32_t)5));
+    CHECK(nvs.eraseAll());
+    CHECK(nvs.dirtyCount() == 0 && nvs.getInt("x", -1) == -1 && flash.getInt("a", -1) == -1);
+    CHECK(nvs.setInt("y", (int32_t)6));
+    CHECK(nvs.setWriteBack(false));
+    CHECK(flash.getInt("y") == 6);
+
+    // The interval flush.
+    CHECK(nvs.setWriteBack(true, 0, 20));
+    CHECK(nvs.setInt("z", (int32_t)7));
+    for (int i = 0; i < 50 && nvs.dirtyCount(); i++)
+        vTaskDelay(pdMS_TO_TICKS(10));
+    CHECK(nvs.dirtyCount() == 0 && flash.getInt("z") == 7);
+}
+
+/// More keys than the cache holds, synchronous and on the writer task: the
+/// cache stays within its limit and every value lands.
+static void test_write_back_full()
+{
+    for (int async = 0; async < 2; async++)
+    {
+        const char *ns = async ? "wb_async" : "wb_sync";
+        ArduinoNvs nvs(ns);
+        CHECK(async ? nvs.setAsync(true) : nvs.setWriteBack(true, 0, 0));
+        size_t keys = ARDUINONVS_CACHE_MAX_ENTRIES * 3;
+        size_t most = 0;
+        for (size_t i = 0; i < keys; i++)
+        {
+            CHECK(nvs.setInt(("k" + std::to_string(i)).c_str(), (uint32_t)i));
+            most = std::max(most, nvs.dirtyCount());
+        }
+        CHECK(most <= ARDUINONVS_CACHE_MAX_ENTRIES);
+        if (async)
+        {
+            ArduinoNvs::Ticket ticket = nvs.commitAsync();
+            CHECK(ticket && nvs.waitFor(ticket) && nvs.lastAsyncError() == ESP_OK);
+        }
+        else
+            CHECK(nvs.commit());
+        CHECK(nvs.dirtyCount() == 0);
+        ArduinoNvs flash(ns);
+        size_t missing = 0;
+        for (size_t i = 0; i < keys; i++)
+            missing += flash.getInt(("k" + std::to_string(i)).c_str(), -1) != (int64_t)i;
+        CHECK(missing == 0);
+    }
+}
+
+/// An invalid key fails only its own entry, and a batch cut short by a
+/// failing flash applies completely once retried.
+static void test_batch_partial_failure()
+{
+    ArduinoNvs nvs("batch");
+    CHECK(nvs.setInt("c", (int32_t)9));
+    CHECK(nvs.setString("old", "gone soon"));
+
+    ArduinoNvs::Batch batch(nvs);
+    batch.setInt("a", (int32_t)1)
+        .setInt("this_key_is_way_too_long", (int32_t)2)
+        .setInt("c", (int32_t)3)
+        .erase("old");
+    CHECK(batch.size() == 4);
+    CHECK(batch.result(1) == ESP_ERR_NVS_KEY_TOO_LONG);
+    CHECK(batch.failures() == 1);
+
+    nvs_emu_fail_after(1);
+    CHECK(!batch.apply());
+    CHECK(batch.failures() > 1);
+    nvs_emu_fail_after(0);
+    CHECK(nvs_emu_power_cycle() == ESP_OK);
+    int64_t c = nvs.getInt("c");
+    CHECK(c == 9 || c == 3);
+
+    CHECK(!batch.apply());
+    CHECK(batch.failures() == 1);
+    CHECK(batch.result(0) == ESP_OK);
+    CHECK(batch.result(1) == ESP_ERR_NVS_KEY_TOO_LONG);
+    CHECK(batch.result(2) == ESP_OK);
+    CHECK(batch.result(3) == ESP_OK);
+    CHECK(nvs.getInt("a") == 1);
+    CHECK(nvs.getInt("c") == 3);
+    CHECK(nvs.getString("old") == "");
+    CHECK(count_keys("batch") == 2);
+}
+
+struct RWLockState
+{
+    NvsRWLock lock;
+    std::atomic<int> readers;
+    std::atomic<int> writers;
+    std::atomic<int> overlaps;
+    std::atomic<int> writes;
+    std::atomic<int> running;
+    std::atomic<bool> stop;
+};
+
+static void rwlock_reader(void *arg)
+{
+    RWLockState *st = (RWLockState *)arg;
+    while (!st->stop)
+    {
+        NvsReadLocker locker(st->lock);
+        st->readers++;
+        if (st->writers)
+            st->overlaps++;
+        usleep(200);
+        st->readers--;
+    }
+    st->running--;
+    vTaskDelete(NULL);
+}
+
+static void rwlock_writer(void *arg)
+{
+    RWLockState *st = (RWLockState *)arg;
+    while (!st->stop)
+    {
+        {
+            NvsWriteLocker locker(st->lock);
+            if (++st->writers != 1 || st->readers)
+                st->overlaps++;
+            usleep(100);
+            st->writers--;
+            st->writes++;
+        }
+        usleep(500);
+    }
+    st->running--;
+    vTaskDelete(NULL);
+}
+
+/// Readers that always overlap each other neither starve the writers nor
+/// run alongside them.
+static void test_rwlock_contention()
+{
+    RWLockState st;
+    st.readers = 0;
+    st.writers = 0;
+    st.overlaps = 0;
+    st.writes = 0;
+    st.running = 8;
+    st.stop = false;
+    for (int i = 0; i < 6; i++)
+        xTaskCreate(rwlock_reader, "reader", 4096, &st, 1, NULL);
+    for (int i = 0; i < 2; i++)
+        xTaskCreate(rwlock_writer, "writer", 4096, &st, 1, NULL);
+    usleep(1000000);
+    st.stop = true;
+    while (st.running)
+        usleep(1000);
+    CHECK(st.overlaps == 0);
+    CHECK(st.writes > 100);
+    CHECK(st.lock.contention() > 0);
+    CHECK(st.lock.waitUs() > 0);
+}
+
+static constexpr NvsKey<float> kGain("gain", 1.0f);
+static constexpr NvsKey<double> kRatio("ratio", -0.25);
+static constexpr NvsKey<bool> kEnabled("enabled", true);
+static constexpr NvsKey<int16_t> kOffset("offset", -7);
+static constexpr NvsKey<uint64_t> kUptime("uptime");
+
+static_assert(NvsTraits<float>::type == NVS_TYPE_U32, "float is stored as U32");
+static_assert(NvsTraits<double>::type == NVS_TYPE_U64, "double is stored as U64");
+static_assert(NvsTraits<bool>::type == NVS_TYPE_U8, "bool is stored as U8");
+
+/// Typed keys read their default until set, store floating point values
+/// as integers of the same width, and do not read a key of another type.
+static void test_typed_keys()
+{
+    ArduinoNvs nvs("typed");
+    CHECK(nvs.get(kGain) == 1.0f);
+    CHECK(nvs.get(kRatio) == -0.25);
+    CHECK(nvs.get(kEnabled));
+    CHECK(nvs.get(kOffset) == -7);
+    CHECK(nvs.get(kUptime) == 0);
+
+    CHECK(nvs.set(kGain, 2.5f));
+    CHECK(nvs.set(kRatio, 1e300));
+    CHECK(nvs.set(kEnabled, false));
+    CHECK(nvs.set(kOffset, (int16_t)-30000));
+    CHECK(nvs.set(kUptime, 0x123456789abcdefull));
+    CHECK(nvs.get(kGain) == 2.5f);
+    CHECK(nvs.get(kRatio) == 1e300);
+    CHECK(!nvs.get(kEnabled));
+    CHECK(nvs.get(kOffset) == -30000);
+    CHECK(nvs.get(kUptime) == 0x123456789abcdefull);
+    CHECK(nvs.getIntType("gain") == NVS_TYPE_U32);
+    CHECK(nvs.getIntType("ratio") == NVS_TYPE_U64);
+    CHECK(nvs.getIntType("enabled") == NVS_TYPE_U8);
+    CHECK(nvs.getIntType("offset") == NVS_TYPE_I16);
+
+    // Stored as I32 by the untyped API, a typed key of another width misses.
+    CHECK(nvs.setInt("level", (int32_t)3));
+    CHECK(nvs.get(NvsKey<uint8_t>("level", 9)) == 9);
+    CHECK(nvs.get(NvsKey<int32_t>("level", 9)) == 3);
+
+    // The same through the write-back cache.
+    CHECK(nvs.setWriteBack(true, 0, 0));
+    CHECK(nvs.set(kGain, -1.5f));
+    CHECK(nvs.get(kGain) == -1.5f);
+    CHECK(nvs.get(NvsKey<uint8_t>("level", 9)) == 9);
+    CHECK(nvs.commit());
+    CHECK(nvs.setWriteBack(false));
+    ArduinoNvs flash("typed");
+    CHECK(flash.get(kGain) == -1.5f);
+}
+
+/// 503 keys of every kind through the image generator: each key resolves
+/// to its own value, near misses and unknown keys to nothing.
+static void test_config_store()
+{
+#ifndef NVS_CFGSTORE_GEN
+    printf("FAIL: built without NVS_CFGSTORE_GEN, python3 was not found\n");
+    failures++;
+#else
+    const size_t keys = 503;
+    FILE *csv = fopen("nvs_tests_config.csv", "w");
+    CHECK(csv != NULL);
+    if (!csv)
+        return;
+    fprintf(csv, "key,type,value\n");
+    for (size_t i = 0; i < keys; i++)
+    {
+        switch (i % 4)
+        {
+        case 0:
+            fprintf(csv, "k%u,u32,%u\n", (unsigned)i, (unsigned)i * 3);
+            break;
+        case 1:
+            fprintf(csv, "k%u,i64,-%u\n", (unsigned)i, (unsigned)i * 1000003);
+            break;
+        case 2:
+            fprintf(csv, "k%u,string,value %u\n", (unsigned)i, (unsigned)i);
+            break;
+        default:
+            fprintf(csv, "a_rather_long_config_key_%u,hex,%02x%02x%02x\n", (unsigned)i, (unsigned)(i & 0xff),
+                    (unsigned)(i >> 8), 0xa5);
+            break;
+        }
+    }
+    fclose(csv);
+    CHECK(system(NVS_CFGSTORE_GEN " nvs_tests_config.csv nvs_tests_config.bin --size 0x10000 > /dev/null") == 0);
+
+    NvsConfigStore store;
+    CHECK(store.begin("nvs_tests_config.bin"));
+    if (!store.isValid())
+        return;
+    CHECK(store.count() == keys);
+    size_t wrong = 0;
+    char key[40];
+    for (size_t i = 0; i < keys; i++)
+    {
+        switch (i % 4)
+        {
+        case 0:
+            snprintf(key, sizeof(key), "k%u", (unsigned)i);
+            wrong += store.getInt(key, -1) != (int64_t)i * 3;
+            break;
+        case 1:
+            snprintf(key, sizeof(key), "k%u", (unsigned)i);
+            wrong += store.getInt(key, 1) != -(int64_t)i * 1000003;
+            break;
+        case 2:
+        {
+            snprintf(key, sizeof(key), "k%u", (unsigned)i);
+            const char *value = store.getString(key);
+            wrong += !value || value != "value " + std::to_string(i);
+            break;
+        }
+        default:
+        {
+            snprintf(key, sizeof(key), "a_rather_long_config_key_%u", (unsigned)i);
+            size_t length = 0;
+            const uint8_t *blob = store.getBlob(key, &length);
+            const uint8_t expected[3] = {(uint8_t)i, (uint8_t)(i >> 8), 0xa5};
+            wrong += !blob || length != 3 || memcmp(blob, expected, 3) != 0;
+            break;
+        }
+        }
+    }
+    CHECK(wrong == 0);
+
+    CHECK(!store.contains("k3"));
+    CHECK(!store.contains("k503"));
+    CHECK(!store.contains("k"));
+    CHECK(!store.contains("a_rather_long_config_key_"));
+    CHECK(!store.contains(""));
+    CHECK(store.getInt("missing", -9) == -9);
+    CHECK(store.getString("missing") == NULL);
+    CHECK(store.getBlobSize("k3") == 0);
+    store.end();
+    CHECK(!store.isValid());
+    remove("nvs_tests_config.csv");
+    remove("nvs_tests_config.bin");
+#endif
+}
+
+struct SettingsV1
+{
+    uint16_t port;
+    char host[32];
+    bool tls;
+    int8_t offset;
+};
+
+static const NvsField kSettingsV1[] = {
+    NVS_FIELD(SettingsV1, port, 1),
+    NVS_FIELD(SettingsV1, host, 2),
+    NVS_FIELD(SettingsV1, tls, 3),
+    NVS_FIELD(SettingsV1, offset, 4),
+};
+
+/// V1 without `tls` (tag 3 retired), with `port` and `offset` widened, a
+/// shorter `host` and the new `retries`.
+struct SettingsV2
+{
+    uint32_t port;
+    char host[8];
+    int32_t offset;
+    uint8_t retries;
+};
+
+static const NvsField kSettingsV2[] = {
+    NVS_FIELD(SettingsV2, port, 1),
+    NVS_FIELD(SettingsV2, host, 2),
+    NVS_FIELD(SettingsV2, offset, 4),
+    NVS_FIELD(SettingsV2, retries, 5),
+};
+
+/// A record saved by one schema loads into the next and back: dropped
+/// fields are skipped, added ones keep their defaults, integers convert.
+static void test_record_schema()
+{
+    ArduinoNvs nvs("record");
+    NvsRecord v1(nvs, "settings", kSettingsV1, 1);
+    NvsRecord v2(nvs, "settings", kSettingsV2, 2);
+    CHECK(v1.isValid() && v2.isValid());
+
+    SettingsV1 a = {1883, "broker.example.com", true, -5};
+    CHECK(!v1.load(&a));
+    CHECK(v1.save(&a));
+
+    SettingsV2 b = {0, "", 0, 3};
+    CHECK(v2.load(&b));
+    CHECK(v2.storedVersion() == 1);
+    CHECK(b.port == 1883);
+    CHECK(strcmp(b.host, "broker.") == 0);
+    CHECK(b.offset == -5);
+    CHECK(b.retries == 3);
+
+    b.port = 8883;
+    b.offset = -100;
+    b.retries = 7;
+    CHECK(v2.save(&b));
+    SettingsV1 c = {0, "unchanged", true, 0};
+    CHECK(v1.load(&c));
+    CHECK(v1.storedVersion() == 2);
+    CHECK(c.port == 8883);
+    CHECK(strcmp(c.host, "broker.") == 0);
+    CHECK(c.tls);
+    CHECK(c.offset == -100);
+
+    // A truncated blob leaves the struct alone.
+    std::vector<uint8_t> blob;
+    CHECK(nvs.getBlob("settings", blob));
+    blob.pop_back();
+    CHECK(nvs.setBlob("settings", blob));
+    SettingsV2 d = {1, "x", 2, 3};
+    CHECK(!v2.load(&d));
+    CHECK(d.port == 1 && strcmp(d.host, "x") == 0 && d.offset == 2 && d.retries == 3);
+
+    // Hand-built field lists are checked when constructed.
+    static const NvsField kTooLong[] = {{1, NVS_FIELD_RAW, 0, 300}};
+    NvsRecord bad(nvs, "bad", kTooLong, 1);
+    uint8_t raw[300] = {0};
+    CHECK(!bad.isValid());
+    CHECK(!bad.save(raw));
+    CHECK(nvs.getBlobSize("bad") == 0);
+}
+
+struct TestCase
+{
+    const char *name;
+    void (*run)();
+};
+
+static const TestCase cases[] = {
+    {"large_blob_power_cut", test_large_blob_power_cut},
+    {"large_blob_stream", test_large_blob_stream},
+    {"export_import", test_export_import},
+    {"compression", test_compression},
+    {"compression_concurrent", test_compression_concurrent},
+    {"write_back", test_write_back},
+    {"write_back_full", test_write_back_full},
+    {"batch_partial_failure", test_batch_partial_failure},
+    {"rwlock_contention", test_rwlock_contention},
+    {"typed_keys", test_typed_keys},
+    {"config_store", test_config_store},
+    {"record_schema", test_record_schema},
+};
+
+int main(int argc, char **argv)
+{
+    const TestCase *test = NULL;
+    for (size_t i = 0; argc == 2 && i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        if (strcmp(argv[1], cases[i].name) == 0)
+            test = &cases[i];
+    }
+    if (!test)
+    {
+        fprintf(stderr, "usage: %s <case>\n", argv[0]);
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+            fprintf(stderr, "  %s\n", cases[i].name);
+        return 2;
+    }
+
+    nvs_emu_config_t config = nvs_emu_default_config();
+    config.pages = 16;
+    nvs_emu_configure(&config);
+    test->run();
+    printf("%s %s\n", test->name, failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,461 @@
+/*
+ * https_ota_host.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// esp_https_ota for the host: one GET per OTA over a blocking socket,
+/// TLS through OpenSSL when built with HOST_HAVE_OPENSSL. Events, error
+/// codes and the default buffer and timeout follow IDF 4.4 closely enough
+/// for HttpsOTAUpdate; plain http:// is accepted like with
+/// CONFIG_OTA_ALLOW_HTTP.
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifdef HOST_HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "esp_https_ota.h"
+#include "esp_log.h"
+#include "ota_emu.h"
+
+#define DEFAULT_HTTP_BUF_SIZE 512
+#define DEFAULT_TIMEOUT_MS 5000
+
+struct esp_http_client
+{
+    int fd;
+#ifdef HOST_HAVE_OPENSSL
+    SSL_CTX *ctx;
+    SSL *ssl;
+#endif
+};
+
+struct esp_https_ota_ctx
+{
+    esp_http_client_config_t config;
+    esp_http_client client;
+    std::vector<uint8_t> buf;
+    std::vector<uint8_t> pending;   ///< body bytes read along with the headers
+    int content_length;
+    int read;
+    bool complete;
+    bool checked;
+};
+
+static void post(esp_https_ota_ctx *ctx, esp_http_client_event_id_t id, const void *data = NULL, int len = 0,
+                 const char *key = NULL, const char *value = NULL)
+{
+    if (!ctx->config.event_handler)
+        return;
+    esp_http_client_event_t event = {};
+    event.event_id = id;
+    event.client = &ctx->client;
+    event.data = (void *)data;
+    event.data_len = len;
+    event.user_data = ctx->config.user_data;
+    event.header_key = (char *)key;
+    event.header_value = (char *)value;
+    ctx->config.event_handler(&event);
+}
+
+static int timeout_ms(esp_https_ota_ctx *ctx)
+{
+    return ctx->config.timeout_ms > 0 ? ctx->config.timeout_ms : DEFAULT_TIMEOUT_MS;
+}
+
+/// Bytes read, 0 on orderly close, -1 on error or timeout.
+static int conn_read(esp_https_ota_ctx *ctx, void *buf, size_t len)
+{
+    esp_http_client &c = ctx->client;
+#ifdef HOST_HAVE_OPENSSL
+    if (c.ssl && SSL_pending(c.ssl) > 0)
+    {
+        int n = SSL_read(c.ssl, buf, (int)len);
+        return n > 0 ? n : -1;
+    }
+#endif
+    struct pollfd pfd = {c.fd, POLLIN, 0};
+    int rc = poll(&pfd, 1, timeout_ms(ctx));
+    if (rc <= 0)
+        return -1;
+#ifdef HOST_HAVE_OPENSSL
+    if (c.ssl)
+    {
+        int n = SSL_read(c.ssl, buf, (int)len);
+        if (n > 0)
+            return n;
+        int err = SSL_get_error(c.ssl, n);
+        return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+#endif
+    ssize_t n = recv(c.fd, buf, len, 0);
+    return n < 0 ? -1 : (int)n;
+}
+
+static bool conn_write(esp_https_ota_ctx *ctx, const std::string &data)
+{
+    esp_http_client &c = ctx->client;
+#ifdef HOST_HAVE_OPENSSL
+    if (c.ssl)
+        return SSL_write(c.ssl, data.data(), (int)data.size()) == (int)data.size();
+#endif
+    return send(c.fd, data.data(), data.size(), MSG_NOSIGNAL) == (ssize_t)data.size();
+}
+
+static void conn_close(esp_https_ota_ctx *ctx)
+{
+    esp_http_client &c = ctx->client;
+#ifdef HOST_HAVE_OPENSSL
+    if (c.ssl)
+    {
+        SSL_free(c.ssl);
+        c.ssl = NULL;
+    }
+    if (c.ctx)
+    {
+        SSL_CTX_free(c.ctx);
+        c.ctx = NULL;
+    }
+#endif
+    if (c.fd >= 0)
+    {
+        close(c.fd);
+        c.fd = -1;
+        post(ctx, HTTP_EVENT_DISCONNECTED);
+    }
+}
+
+static bool parse_url(const char *url, bool &tls, std::string &host, std::string &port, std::string &path)
+{
+    std::string u(url);
+    size_t at;
+    if (u.compare(0, 8, "https://") == 0)
+    {
+        tls = true;
+        at = 8;
+    }
+    else if (u.compare(0, 7, "http://") == 0)
+    {
+        tls = false;
+        at = 7;
+    }
+    else
+    {
+        return false;
+    }
+    size_t slash = u.find('/', at);
+    std::string authority = u.substr(at, slash == std::string::npos ? std::string::npos : slash - at);
+    path = slash == std::string::npos ? "/" : u.substr(slash);
+    size_t colon = authority.rfind(':');
+    if (colon != std::string::npos)
+    {
+        host = authority.substr(0, colon);
+        port = authority.substr(colon + 1);
+    }
+    else
+    {
+        host = authority;
+        port = tls ? "443" : "80";
+    }
+    return !host.empty();
+}
+
+static int tcp_connect(const std::string &host, const std::string &port, int timeout)
+{
+    struct addrinfo hints = {}, *res = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+#ifdef HOST_HAVE_OPENSSL
+static bool tls_connect(esp_https_ota_ctx *ctx, const std::string &host)
+{
+    esp_http_client &c = ctx->client;
+    c.ctx = SSL_CTX_new(TLS_client_method());
+    if (!c.ctx)
+        return false;
+    BIO *bio = BIO_new_mem_buf(ctx->config.cert_pem, -1);
+    X509 *cert = bio ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+    BIO_free(bio);
+    if (!cert)
+    {
+        ESP_LOGE("https_ota", "bad cert_pem");
+        return false;
+    }
+    X509_STORE_add_cert(SSL_CTX_get_cert_store(c.ctx), cert);
+    X509_free(cert);
+    SSL_CTX_set_verify(c.ctx, SSL_VERIFY_PEER, NULL);
+
+    c.ssl = SSL_new(c.ctx);
+    SSL_set_fd(c.ssl, c.fd);
+    SSL_set_tlsext_host_name(c.ssl, host.c_str());
+    if (!ctx->config.skip_cert_common_name_check)
+        SSL_set1_host(c.ssl, host.c_str());
+    if (SSL_connect(c.ssl) != 1)
+    {
+        ESP_LOGE("https_ota", "TLS handshake failed: %s", ERR_error_string(ERR_get_error(), NULL));
+        return false;
+    }
+    return true;
+}
+#endif
+
+/// Reads the status line and headers, anything after them is kept for
+/// the first `perform()`.
+static esp_err_t read_headers(esp_https_ota_ctx *ctx, int &status)
+{
+    std::string head;
+    char buf[512];
+    size_t end;
+    while ((end = head.find("\r\n\r\n")) == std::string::npos)
+    {
+        int n = conn_read(ctx, buf, sizeof(buf));
+        if (n <= 0 || head.size() > 16384)
+            return ESP_ERR_HTTP_FETCH_HEADER;
+        head.append(buf, n);
+    }
+    ctx->pending.assign(head.begin() + end + 4, head.end());
+    head.resize(end + 2);
+
+    size_t line_end = head.find("\r\n");
+    std::string line = head.substr(0, line_end);
+    if (line.compare(0, 5, "HTTP/") != 0 || line.find(' ') == std::string::npos)
+        return ESP_ERR_HTTP_FETCH_HEADER;
+    status = atoi(line.c_str() + line.find(' ') + 1);
+
+    ctx->content_length = -1;
+    size_t at = line_end + 2;
+    while (at < head.size())
+    {
+        size_t next = head.find("\r\n", at);
+        std::string h = head.substr(at, next - at);
+        at = next + 2;
+        size_t colon = h.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string key = h.substr(0, colon);
+        std::string value = h.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        post(ctx, HTTP_EVENT_ON_HEADER, NULL, 0, key.c_str(), value.c_str());
+        if (strcasecmp(key.c_str(), "Content-Length") == 0)
+            ctx->content_length = atoi(value.c_str());
+    }
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_https_ota_begin(esp_https_ota_config_t *ota_config, esp_https_ota_handle_t *handle)
+{
+    if (!ota_config || !ota_config->http_config || !ota_config->http_config->url || !handle)
+        return ESP_ERR_INVALID_ARG;
+    *handle = NULL;
+    const esp_http_client_config_t *http = ota_config->http_config;
+    bool tls;
+    std::string host, port, path;
+    if (!parse_url(http->url, tls, host, port, path))
+        return ESP_ERR_INVALID_ARG;
+    if (tls && !http->cert_pem)
+    {
+        ESP_LOGE("https_ota", "No option for server verification is enabled");
+        return ESP_ERR_INVALID_ARG;
+    }
+#ifndef HOST_HAVE_OPENSSL
+    if (tls)
+        return ESP_ERR_HTTP_INVALID_TRANSPORT;
+#endif
+
+    esp_https_ota_ctx *ctx = new esp_https_ota_ctx();
+    ctx->config = *http;
+    ctx->client.fd = -1;
+#ifdef HOST_HAVE_OPENSSL
+    ctx->client.ctx = NULL;
+    ctx->client.ssl = NULL;
+#endif
+    ctx->buf.resize(http->buffer_size > 0 ? http->buffer_size : DEFAULT_HTTP_BUF_SIZE);
+    ctx->content_length = -1;
+    ctx->read = 0;
+    ctx->complete = false;
+    ctx->checked = false;
+
+    esp_err_t err = ESP_OK;
+    int status = 0;
+    ctx->client.fd = tcp_connect(host, port, timeout_ms(ctx));
+    if (ctx->client.fd < 0)
+        err = ESP_ERR_HTTP_CONNECT;
+#ifdef HOST_HAVE_OPENSSL
+    else if (tls && !tls_connect(ctx, host))
+        err = ESP_ERR_HTTP_CONNECT;
+#endif
+    if (err == ESP_OK)
+    {
+        post(ctx, HTTP_EVENT_ON_CONNECTED);
+        std::string req = "GET " + path + " HTTP/1.1\r\nHost: " + host +
+                          "\r\nUser-Agent: ESP32 HTTP Client/1.0\r\nConnection: close\r\n\r\n";
+        if (!conn_write(ctx, req))
+            err = ESP_ERR_HTTP_WRITE_DATA;
+    }
+    if (err == ESP_OK)
+    {
+        post(ctx, HTTP_EVENT_HEADERS_SENT);
+        err = read_headers(ctx, status);
+    }
+    if (err == ESP_OK && status != 200)
+    {
+        ESP_LOGE("https_ota", "Server returned status %d", status);
+        err = ESP_FAIL;
+    }
+    if (err == ESP_OK)
+        err = ota_emu_begin(ctx->content_length);
+    if (err != ESP_OK)
+    {
+        post(ctx, HTTP_EVENT_ERROR);
+        conn_close(ctx);
+        delete ctx;
+        return err;
+    }
+    *handle = ctx;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_https_ota_perform(esp_https_ota_handle_t ctx)
+{
+    if (!ctx)
+        return ESP_ERR_INVALID_ARG;
+    if (ctx->complete)
+        return ESP_OK;
+
+    int n;
+    uint8_t *data = ctx->buf.data();
+    if (!ctx->pending.empty())
+    {
+        n = (int)std::min(ctx->pending.size(), ctx->buf.size());
+        memcpy(data, ctx->pending.data(), n);
+        ctx->pending.erase(ctx->pending.begin(), ctx->pending.begin() + n);
+    }
+    else
+    {
+        size_t want = ctx->buf.size();
+        if (ctx->content_length >= 0 && (size_t)(ctx->content_length - ctx->read) < want)
+            want = ctx->content_length - ctx->read;
+        n = want ? conn_read(ctx, data, want) : 0;
+    }
+
+    if (n < 0)
+    {
+        ESP_LOGE("https_ota", "read failed after %d bytes", ctx->read);
+        return ESP_FAIL;
+    }
+    if (n == 0)
+    {
+        if (ctx->content_length >= 0 && ctx->read < ctx->content_length)
+        {
+            ESP_LOGE("https_ota", "Connection closed at %d of %d bytes", ctx->read, ctx->content_length);
+            return ESP_FAIL;
+        }
+        ctx->complete = true;
+        post(ctx, HTTP_EVENT_ON_FINISH);
+        return ESP_OK;
+    }
+    post(ctx, HTTP_EVENT_ON_DATA, data, n);
+
+    if (!ctx->checked)
+    {
+        // esp_https_ota checks the image header before the first write.
+        if (data[0] != OTA_EMU_IMAGE_MAGIC)
+        {
+            ESP_LOGE("https_ota", "Invalid image magic 0x%02x", data[0]);
+            return ESP_ERR_OTA_VALIDATE_FAILED;
+        }
+        ctx->checked = true;
+    }
+    esp_err_t err = ota_emu_write(data, n);
+    if (err != ESP_OK)
+        return err;
+    ctx->read += n;
+    if (ctx->content_length >= 0 && ctx->read >= ctx->content_length)
+    {
+        ctx->complete = true;
+        post(ctx, HTTP_EVENT_ON_FINISH);
+        return ESP_OK;
+    }
+    return ESP_ERR_HTTPS_OTA_IN_PROGRESS;
+}
+
+extern "C" bool esp_https_ota_is_complete_data_received(esp_https_ota_handle_t ctx)
+{
+    return ctx && ctx->complete;
+}
+
+extern "C" esp_err_t esp_https_ota_finish(esp_https_ota_handle_t ctx)
+{
+    if (!ctx)
+        return ESP_ERR_INVALID_ARG;
+    conn_close(ctx);
+    esp_err_t err = ctx->complete ? ota_emu_end() : ESP_FAIL;
+    if (!ctx->complete)
+        ota_emu_abort();
+    delete ctx;
+    return err;
+}
+
+extern "C" esp_err_t esp_https_ota_abort(esp_https_ota_handle_t ctx)
+{
+    if (!ctx)
+        return ESP_ERR_INVALID_ARG;
+    conn_close(ctx);
+    ota_emu_abort();
+    delete ctx;
+    return ESP_OK;
+}
+
+extern "C" int esp_https_ota_get_image_len_read(esp_https_ota_handle_t ctx)
+{
+    return ctx ? ctx->read : -1;
+}
+
+extern "C" int esp_https_ota_get_image_size(esp_https_ota_handle_t ctx)
+{
+    return ctx ? ctx->content_length : -1;
+}
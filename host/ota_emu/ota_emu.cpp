@@ -0,0 +1,199 @@
+/*
+ * ota_emu.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <string.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <vector>
+
+#include "esp_https_ota.h"
+#include "ota_emu.h"
+
+namespace
+{
+
+struct OtaEmu
+{
+    std::mutex lock;
+    ota_emu_config_t config;
+    std::vector<uint8_t> partition;
+    size_t written;
+    bool open;
+    std::vector<uint8_t> boot;
+    bool has_boot;
+    ota_emu_stats_t stats;
+
+    OtaEmu() : written(0), open(false), has_boot(false)
+    {
+        config = ota_emu_default_config();
+        memset(&stats, 0, sizeof(stats));
+    }
+};
+
+OtaEmu &ota()
+{
+    static OtaEmu o;
+    return o;
+}
+
+uint32_t crc32(const uint8_t *p, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+    while (len--)
+    {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+    }
+    return ~crc;
+}
+
+void charge(OtaEmu &o, uint64_t us)
+{
+    o.stats.flash_us += us;
+    if (o.config.realtime && us)
+        usleep(us);
+}
+
+} // namespace
+
+extern "C" ota_emu_config_t ota_emu_default_config(void)
+{
+    ota_emu_config_t config;
+    config.size = 1024 * 1024;
+    config.erase_us = 45000;
+    config.program_us = 700;
+    config.realtime = false;
+    return config;
+}
+
+extern "C" void ota_emu_configure(const ota_emu_config_t *config)
+{
+    OtaEmu &o = ota();
+    std::lock_guard<std::mutex> locker(o.lock);
+    o.config = *config;
+}
+
+extern "C" ota_emu_stats_t ota_emu_stats(void)
+{
+    OtaEmu &o = ota();
+    std::lock_guard<std::mutex> locker(o.lock);
+    return o.stats;
+}
+
+extern "C" void ota_emu_reset_stats(void)
+{
+    OtaEmu &o = ota();
+    std::lock_guard<std::mutex> locker(o.lock);
+    memset(&o.stats, 0, sizeof(o.stats));
+    o.has_boot = false;
+    o.boot.clear();
+}
+
+extern "C" const uint8_t *ota_emu_boot_image(size_t *length)
+{
+    OtaEmu &o = ota();
+    std::lock_guard<std::mutex> locker(o.lock);
+    if (!o.has_boot)
+        return NULL;
+    *length = o.boot.size();
+    return o.boot.data();
+}
+
+extern "C" void ota_emu_make_image(uint8_t *buf, size_t length, uint32_t seed)
+{
+    uint32_t x = seed * 2654435761u + 1;
+    for (size_t i = 0; i < length - 4; i++)
+    {
+        x = x * 1103515245 + 12345;
+        buf[i] = (uint8_t)(x >> 16);
+    }
+    buf[0] = OTA_EMU_IMAGE_MAGIC;
+    uint32_t crc = crc32(buf, length - 4);
+    memcpy(buf + length - 4, &crc, 4);
+}
+
+extern "C" esp_err_t ota_emu_begin(int image_size)
+{
+    OtaEmu &o = ota();
+    std::lock_guard<std::mutex> locker(o.lock);
+    if (o.open)
+        return ESP_ERR_INVALID_STATE;
+    if (image_size > 0 && (size_t)image_size > o.config.size)
+        return ESP_ERR_INVALID_SIZE;
+    o.partition.assign(o.config.size, 0xff);
+    o.written = 0;
+    o.open = true;
+    o.stats.begins++;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t ota_emu_write(const void *data, size_t length)
+{
+    OtaEmu &o = ota();
+    std::lock_guard<std::mutex> locker(o.lock);
+    if (!o.open)
+        return ESP_ERR_INVALID_STATE;
+    if (o.written + length > o.config.size)
+        return ESP_ERR_INVALID_SIZE;
+    // Sectors are erased when the write first reaches them.
+    size_t erased_to = (o.written + OTA_EMU_SECTOR_SIZE - 1) / OTA_EMU_SECTOR_SIZE;
+    size_t end = (o.written + length + OTA_EMU_SECTOR_SIZE - 1) / OTA_EMU_SECTOR_SIZE;
+    if (end > erased_to)
+    {
+        o.stats.sectors_erased += end - erased_to;
+        charge(o, (uint64_t)(end - erased_to) * o.config.erase_us);
+    }
+    memcpy(o.partition.data() + o.written, data, length);
+    size_t pages = (o.written + length + 255) / 256 - o.written / 256;
+    charge(o, (uint64_t)pages * o.config.program_us);
+    o.written += length;
+    o.stats.bytes_written += length;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t ota_emu_end(void)
+{
+    OtaEmu &o = ota();
+    std::lock_guard<std::mutex> locker(o.lock);
+    if (!o.open)
+        return ESP_ERR_INVALID_STATE;
+    o.open = false;
+    const uint8_t *p = o.partition.data();
+    uint32_t crc;
+    if (o.written < 5 || p[0] != OTA_EMU_IMAGE_MAGIC ||
+        (memcpy(&crc, p + o.written - 4, 4), crc != crc32(p, o.written - 4)))
+    {
+        o.stats.validate_failures++;
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    o.boot.assign(p, p + o.written);
+    o.has_boot = true;
+    o.stats.boot_switches++;
+    return ESP_OK;
+}
+
+extern "C" void ota_emu_abort(void)
+{
+    OtaEmu &o = ota();
+    std::lock_guard<std::mutex> locker(o.lock);
+    if (o.open)
+        o.stats.aborts++;
+    o.open = false;
+}
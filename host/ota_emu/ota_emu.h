@@ -0,0 +1,83 @@
+/*
+ * ota_emu.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// Emulated OTA app partition for host builds, written by the
+/// esp_https_ota shim. Sectors are erased on first write like
+/// `esp_ota_begin()` with sequential writes, flash time is modelled.
+///
+/// Image format: the first byte is the app image magic 0xE9 and the last
+/// four bytes are the CRC32 of everything before them, standing in for the
+/// checksum and hash `esp_image_verify()` checks. `ota_emu_make_image()`
+/// builds one.
+#ifndef __OTA_EMU_H__
+#define __OTA_EMU_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OTA_EMU_IMAGE_MAGIC 0xE9
+#define OTA_EMU_SECTOR_SIZE 4096
+
+typedef struct
+{
+    size_t size;            ///< partition size
+    uint32_t erase_us;      ///< per 4 KiB sector
+    uint32_t program_us;    ///< per 256 byte flash page
+    bool realtime;          ///< also sleep the modelled time
+} ota_emu_config_t;
+
+typedef struct
+{
+    uint64_t bytes_written;
+    uint64_t sectors_erased;
+    uint64_t flash_us;      ///< modelled
+    uint32_t begins;
+    uint32_t aborts;
+    uint32_t validate_failures;
+    uint32_t boot_switches; ///< images accepted by `esp_https_ota_finish()`
+} ota_emu_stats_t;
+
+/// Defaults: 1 MiB, 45 ms per sector erase, 700 us per page program.
+ota_emu_config_t ota_emu_default_config(void);
+void ota_emu_configure(const ota_emu_config_t *config);
+ota_emu_stats_t ota_emu_stats(void);
+void ota_emu_reset_stats(void);
+
+/// The image last accepted as the next boot partition, NULL if none.
+const uint8_t *ota_emu_boot_image(size_t *length);
+
+/// Fills `buf` with a valid image of `length` (>= 5) bytes.
+void ota_emu_make_image(uint8_t *buf, size_t length, uint32_t seed);
+
+/// Used by the esp_https_ota shim.
+esp_err_t ota_emu_begin(int image_size);
+esp_err_t ota_emu_write(const void *data, size_t length);
+esp_err_t ota_emu_end(void);
+void ota_emu_abort(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
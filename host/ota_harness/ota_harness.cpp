@@ -0,0 +1,336 @@
+/*
+ * ota_harness.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// OTA harness: HttpsOTAUpdate against a local server that injects
+/// latency, bandwidth caps, disconnects and corrupted bytes, writing into
+/// the emulated OTA partition. Prints throughput and time to complete per
+/// scenario and exits with 1 when a scenario ends other than expected.
+///
+///   ota_harness [--quick] [--size bytes] [--realtime]
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "HttpsOTAUpdate.h"
+#include "freertos/semphr.h"
+#include "ota_emu.h"
+#include "ota_server.h"
+
+static SemaphoreHandle_t s_done;
+static std::vector<HttpsOTAStats_t> s_reports;
+static FEmbed::OSMutex s_reports_lock;
+static int s_failures;
+
+static void on_complete(const HttpsOTAStats_t *stats)
+{
+    {
+        FEmbed::OSMutexLocker locker(s_reports_lock);
+        s_reports.push_back(*stats);
+    }
+    xSemaphoreGive(s_done);
+}
+
+/// Waits for `count` reports, false on timeout.
+static bool wait_reports(size_t count, uint32_t timeout_ms)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (xSemaphoreTake(s_done, pdMS_TO_TICKS(timeout_ms)) != pdTRUE)
+            return false;
+    }
+    return true;
+}
+
+static void header()
+{
+    printf("%-24s %-6s %-6s %8s %8s %8s %10s %9s  %s\n", "scenario", "expect", "result", "bytes", "connect", "done",
+           "B/s", "flash_ms", "verdict");
+}
+
+/// One line of the report. `ok` is whether the outcome matched the
+/// expectation, including the boot partition check.
+static void report(const char *name, bool expect_ok, const HttpsOTAStats_t &s, const ota_emu_stats_t &flash, bool ok)
+{
+    printf("%-24s %-6s %-6s %8u %6ums %6ums %10u %9.1f  %s\n", name, expect_ok ? "ok" : "fail",
+           s.result == ESP_OK ? "ok" : "fail", (unsigned)s.bytes, (unsigned)s.connect_ms, (unsigned)s.elapsed_ms,
+           (unsigned)s.throughput, flash.flash_us / 1000.0, ok ? "PASS" : "FAIL");
+    if (!ok)
+        s_failures++;
+}
+
+struct Scenario
+{
+    const char *name;
+    bool tls;
+    bool expect_ok;
+    OtaFaults faults;
+    uint32_t client_rate;       ///< HttpsOTAUpdate rate limit, 0 none
+    const char *cert;           ///< NULL: the server's own certificate
+    bool bad_magic;
+};
+
+static bool run(OtaServer &server, const Scenario &sc, const std::vector<uint8_t> &image,
+                HttpsOTAStats_t *out = NULL)
+{
+    std::vector<uint8_t> served = image;
+    if (sc.bad_magic)
+        served[0] = 0;
+    server.setImage(served);
+    server.setFaults(sc.faults);
+    ota_emu_reset_stats();
+    s_reports.clear();
+    HttpsOTA.setRateLimit(sc.client_rate);
+
+    std::string url = server.url();
+    const char *cert = sc.tls ? (sc.cert ? sc.cert : server.certPem()) : NULL;
+    HttpsOTA.enqueue(url.c_str(), cert, false);
+    HttpsOTAStats_t s = {};
+    bool done = wait_reports(1, 60000);
+    if (done)
+        s = s_reports[0];
+    ota_emu_stats_t flash = ota_emu_stats();
+
+    bool ok = done && (s.result == ESP_OK) == sc.expect_ok;
+    if (ok && sc.expect_ok)
+    {
+        size_t len;
+        const uint8_t *boot = ota_emu_boot_image(&len);
+        ok = flash.boot_switches == 1 && boot && len == image.size() && memcmp(boot, image.data(), len) == 0 &&
+             HttpsOTA.status() == HTTPS_OTA_SUCCESS;
+    }
+    else if (ok)
+    {
+        ok = flash.boot_switches == 0 && HttpsOTA.status() == HTTPS_OTA_FAIL;
+    }
+    report(sc.name, sc.expect_ok, s, flash, ok);
+    if (out)
+        *out = s;
+    return ok;
+}
+
+static Scenario scenario(const char *name, bool tls, bool expect_ok)
+{
+    Scenario sc;
+    sc.name = name;
+    sc.tls = tls;
+    sc.expect_ok = expect_ok;
+    sc.faults = ota_faults_none();
+    sc.client_rate = 0;
+    sc.cert = NULL;
+    sc.bad_magic = false;
+    return sc;
+}
+
+static void check(const char *name, bool cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("%-24s check failed: %s\n", name, what);
+        s_failures++;
+    }
+}
+
+static void suite(OtaServer &server, bool tls, const std::vector<uint8_t> &image, const char *other_cert,
+                  bool quick)
+{
+    size_t size = image.size();
+    uint32_t cap = quick ? 256 * 1024 : 128 * 1024;
+    const char *p = tls ? "https" : "http";
+    char name[64];
+    HttpsOTAStats_t s;
+
+    snprintf(name, sizeof(name), "%s clean", p);
+    run(server, scenario(name, tls, true), image);
+
+    Scenario sc = scenario(name, tls, true);
+    snprintf(name, sizeof(name), "%s latency 200ms", p);
+    sc.name = name;
+    sc.faults.latency_ms = 200;
+    if (run(server, sc, image, &s))
+        check(name, s.connect_ms >= 200, "connect_ms below injected latency");
+
+    sc = scenario(name, tls, true);
+    snprintf(name, sizeof(name), "%s server cap %uK", p, cap / 1024);
+    sc.name = name;
+    sc.faults.rate_bps = cap;
+    if (run(server, sc, image, &s))
+        check(name, s.throughput <= cap * 11 / 10 && s.throughput >= cap / 2, "throughput not near the cap");
+
+    sc = scenario(name, tls, true);
+    snprintf(name, sizeof(name), "%s client limit %uK", p, cap / 1024);
+    sc.name = name;
+    sc.client_rate = cap;
+    if (run(server, sc, image, &s))
+        check(name, s.throughput <= cap * 11 / 10 && s.throttled_ms > 0, "client rate limit not applied");
+
+    sc = scenario(name, tls, false);
+    snprintf(name, sizeof(name), "%s disconnect 50%%", p);
+    sc.name = name;
+    sc.faults.disconnect_at = size / 2;
+    if (run(server, sc, image, &s))
+        check(name, s.bytes <= size / 2, "read past the disconnect");
+
+    sc = scenario(name, tls, false);
+    snprintf(name, sizeof(name), "%s corrupt byte", p);
+    sc.name = name;
+    sc.faults.corrupt_at = (long)(size / 3);
+    if (run(server, sc, image))
+        check(name, ota_emu_stats().validate_failures == 1, "corruption not caught by validation");
+
+    sc = scenario(name, tls, false);
+    snprintf(name, sizeof(name), "%s bad magic", p);
+    sc.name = name;
+    sc.bad_magic = true;
+    run(server, sc, image);
+
+    sc = scenario(name, tls, false);
+    snprintf(name, sizeof(name), "%s 404", p);
+    sc.name = name;
+    sc.faults.status = 404;
+    run(server, sc, image);
+
+    if (tls)
+    {
+        sc = scenario("https wrong cert", tls, false);
+        sc.cert = other_cert;
+        run(server, sc, image);
+    }
+}
+
+/// Cancel a running download, then a queued one, and run a queue of
+/// three back to back.
+static void queue_tests(OtaServer &server, const std::vector<uint8_t> &image)
+{
+    HttpsOTA.setRateLimit(0);
+    std::string url = server.url();
+
+    OtaFaults f = ota_faults_none();
+    f.rate_bps = 64 * 1024;
+    server.setImage(image);
+    server.setFaults(f);
+    ota_emu_reset_stats();
+    s_reports.clear();
+    uint32_t running = HttpsOTA.enqueue(url.c_str(), NULL);
+    uint32_t queued = HttpsOTA.enqueue(url.c_str(), NULL);
+    vTaskDelay(pdMS_TO_TICKS(200));
+    bool dropped = HttpsOTA.cancelRequest(queued);
+    bool cancelled = HttpsOTA.cancelRequest(running);
+    bool done = wait_reports(1, 10000);
+    vTaskDelay(pdMS_TO_TICKS(100));
+    HttpsOTAStats_t s = done ? s_reports[0] : HttpsOTAStats_t();
+    bool ok = dropped && cancelled && done && s_reports.size() == 1 && s.request_id == running &&
+              s.result != ESP_OK && HttpsOTA.status() == HTTPS_OTA_CANCELLED && ota_emu_stats().boot_switches == 0;
+    report("http cancel", false, s, ota_emu_stats(), ok);
+
+    server.setFaults(ota_faults_none());
+    ota_emu_reset_stats();
+    s_reports.clear();
+    uint32_t ids[3];
+    for (int i = 0; i < 3; i++)
+        ids[i] = HttpsOTA.enqueue(url.c_str(), NULL);
+    done = wait_reports(3, 60000);
+    ok = done && ota_emu_stats().boot_switches == 3;
+    for (size_t i = 0; ok && i < 3; i++)
+        ok = s_reports[i].request_id == ids[i] && s_reports[i].result == ESP_OK;
+    s = done ? s_reports[2] : HttpsOTAStats_t();
+    report("http queue x3", true, s, ota_emu_stats(), ok);
+
+    // Larger than the partition, rejected before anything is written.
+    std::vector<uint8_t> big(ota_emu_default_config().size + OTA_EMU_SECTOR_SIZE);
+    ota_emu_make_image(big.data(), big.size(), 7);
+    Scenario sc = scenario("http oversize", false, false);
+    run(server, sc, big);
+    check("http oversize", ota_emu_stats().bytes_written == 0, "oversize image written");
+}
+
+int main(int argc, char **argv)
+{
+    bool quick = false;
+    bool realtime = false;
+    size_t size = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--quick"))
+            quick = true;
+        else if (!strcmp(argv[i], "--realtime"))
+            realtime = true;
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc)
+            size = strtoul(argv[++i], NULL, 0);
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick] [--size bytes] [--realtime]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (!size)
+        size = quick ? 64 * 1024 : 512 * 1024;
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);    // keep the report in order with the logs
+
+    ota_emu_config_t flash = ota_emu_default_config();
+    flash.realtime = realtime;
+    if (size > flash.size)
+    {
+        fprintf(stderr, "--size larger than the %u byte partition\n", (unsigned)flash.size);
+        return 2;
+    }
+    ota_emu_configure(&flash);
+
+    std::vector<uint8_t> image(size);
+    ota_emu_make_image(image.data(), size, 1);
+
+    s_done = xSemaphoreCreateCounting(8, 0);
+    HttpsOTA.onComplete(on_complete);
+
+    printf("image %u bytes, partition %u bytes%s\n", (unsigned)size, (unsigned)flash.size,
+           realtime ? ", realtime flash" : "");
+    header();
+
+    OtaServer http;
+    if (!http.start(false))
+    {
+        fprintf(stderr, "http server start failed\n");
+        return 1;
+    }
+    suite(http, false, image, NULL, quick);
+    queue_tests(http, image);
+    http.stop();
+
+#ifdef HOST_HAVE_OPENSSL
+    OtaServer other;
+    OtaServer https;
+    if (!other.start(true) || !https.start(true))
+    {
+        fprintf(stderr, "https server start failed\n");
+        return 1;
+    }
+    other.stop();
+    suite(https, true, image, other.certPem(), quick);
+    https.stop();
+#else
+    printf("https scenarios skipped, built without OpenSSL\n");
+#endif
+
+    HttpsOTA.end();
+    printf("%s\n", s_failures ? "FAILED" : "OK");
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * ota_server.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#ifdef HOST_HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "ota_server.h"
+
+OtaFaults ota_faults_none()
+{
+    OtaFaults f;
+    f.latency_ms = 0;
+    f.rate_bps = 0;
+    f.disconnect_at = 0;
+    f.corrupt_at = -1;
+    f.status = 200;
+    return f;
+}
+
+OtaServer::OtaServer()
+    : _tls(false), _listen(-1), _port(0), _stop(false), _connections(0), _faults(ota_faults_none()),
+      _ssl_ctx(NULL)
+{
+}
+
+OtaServer::~OtaServer()
+{
+    stop();
+}
+
+bool OtaServer::start(bool tls)
+{
+    _tls = tls;
+#ifdef HOST_HAVE_OPENSSL
+    if (tls && !makeCert())
+        return false;
+#else
+    if (tls)
+        return false;
+#endif
+    _listen = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(_listen, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(_listen, 4) != 0)
+        return false;
+    socklen_t len = sizeof(addr);
+    getsockname(_listen, (struct sockaddr *)&addr, &len);
+    _port = ntohs(addr.sin_port);
+    _stop = false;
+    _thread = std::thread(&OtaServer::serve, this);
+    return true;
+}
+
+void OtaServer::stop()
+{
+    if (_thread.joinable())
+    {
+        _stop = true;
+        _thread.join();
+    }
+    if (_listen >= 0)
+    {
+        close(_listen);
+        _listen = -1;
+    }
+#ifdef HOST_HAVE_OPENSSL
+    SSL_CTX_free((SSL_CTX *)_ssl_ctx);
+    _ssl_ctx = NULL;
+#endif
+}
+
+std::string OtaServer::url() const
+{
+    return std::string(_tls ? "https" : "http") + "://localhost:" + std::to_string(_port) + "/firmware.bin";
+}
+
+void OtaServer::setImage(const std::vector<uint8_t> &image)
+{
+    std::lock_guard<std::mutex> locker(_lock);
+    _image = image;
+}
+
+void OtaServer::setFaults(const OtaFaults &faults)
+{
+    std::lock_guard<std::mutex> locker(_lock);
+    _faults = faults;
+}
+
+#ifdef HOST_HAVE_OPENSSL
+/// P-256 key and a self-signed certificate for CN and SAN "localhost".
+bool OtaServer::makeCert()
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    if (!key || !cert)
+        return false;
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), (long)time(NULL));
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509V3_CTX v3;
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+    X509_EXTENSION *ext = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name, "DNS:localhost");
+    X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+    X509_sign(cert, key, EVP_sha256());
+
+    BIO *bio = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509(bio, cert);
+    char *pem;
+    long len = BIO_get_mem_data(bio, &pem);
+    _cert_pem.assign(pem, len);
+    BIO_free(bio);
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    bool ok = ctx && SSL_CTX_use_certificate(ctx, cert) == 1 && SSL_CTX_use_PrivateKey(ctx, key) == 1;
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    _ssl_ctx = ctx;
+    return ok;
+}
+#else
+bool OtaServer::makeCert()
+{
+    return false;
+}
+#endif
+
+void OtaServer::serve()
+{
+    while (!_stop)
+    {
+        struct pollfd pfd = {_listen, POLLIN, 0};
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+        int fd = accept(_listen, NULL, NULL);
+        if (fd < 0)
+            continue;
+        _connections++;
+        handle(fd);
+        close(fd);
+    }
+}
+
+/// One request per connection, answered with Connection: close.
+void OtaServer::handle(int fd)
+{
+    std::vector<uint8_t> image;
+    OtaFaults f;
+    {
+        std::lock_guard<std::mutex> locker(_lock);
+        image = _image;
+        f = _faults;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+#ifdef HOST_HAVE_OPENSSL
+    SSL *ssl = NULL;
+    if (_tls)
+    {
+        ssl = SSL_new((SSL_CTX *)_ssl_ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) != 1)
+        {
+            SSL_free(ssl);
+            return;
+        }
+    }
+    auto io_read = [&](char *buf, size_t len) -> int {
+        return ssl ? SSL_read(ssl, buf, (int)len) : (int)recv(fd, buf, len, 0);
+    };
+    auto io_write = [&](const void *buf, size_t len) -> bool {
+        return ssl ? SSL_write(ssl, buf, (int)len) == (int)len
+                   : send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t)len;
+    };
+#else
+    auto io_read = [&](char *buf, size_t len) -> int { return (int)recv(fd, buf, len, 0); };
+    auto io_write = [&](const void *buf, size_t len) -> bool {
+        return send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t)len;
+    };
+#endif
+
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos)
+    {
+        int n = io_read(buf, sizeof(buf));
+        if (n <= 0)
+            goto done;
+        request.append(buf, n);
+    }
+
+    if (f.latency_ms)
+        std::this_thread::sleep_for(std::chrono::milliseconds(f.latency_ms));
+    {
+        std::string head;
+        if (f.status != 200)
+            head = "HTTP/1.1 " + std::to_string(f.status) + " Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        else
+            head = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " +
+                   std::to_string(image.size()) + "\r\nConnection: close\r\n\r\n";
+        if (!io_write(head.data(), head.size()) || f.status != 200)
+            goto done;
+    }
+
+    {
+        const size_t chunk = 1460;
+        size_t limit = f.disconnect_at && f.disconnect_at < image.size() ? f.disconnect_at : image.size();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t sent = 0; sent < limit && !_stop;)
+        {
+            size_t n = std::min(chunk, limit - sent);
+            uint8_t out[chunk];
+            memcpy(out, image.data() + sent, n);
+            if (f.corrupt_at >= (long)sent && f.corrupt_at < (long)(sent + n))
+                out[f.corrupt_at - sent] ^= 0x5a;
+            if (f.rate_bps)
+            {
+                std::chrono::steady_clock::time_point due =
+                    start + std::chrono::microseconds((uint64_t)sent * 1000000 / f.rate_bps);
+                std::this_thread::sleep_until(due);
+            }
+            if (!io_write(out, n))
+                break;
+            sent += n;
+        }
+    }
+
+done:
+#ifdef HOST_HAVE_OPENSSL
+    if (ssl)
+    {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+#endif
+    shutdown(fd, SHUT_RDWR);
+}
@@ -0,0 +1,78 @@
+/*
+ * ota_server.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// Local firmware server for the OTA harness. Serves one image over HTTP
+/// or HTTPS (self-signed certificate for "localhost", made at start) and
+/// injects faults into every response.
+#ifndef __OTA_SERVER_H__
+#define __OTA_SERVER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct OtaFaults
+{
+    uint32_t latency_ms;    ///< delay before the response headers
+    uint32_t rate_bps;      ///< body bandwidth cap, 0 unlimited
+    size_t disconnect_at;   ///< close after this many body bytes, 0 never
+    long corrupt_at;        ///< body offset of a flipped byte, -1 none
+    int status;             ///< HTTP status, non 200 sends no body
+};
+
+OtaFaults ota_faults_none();
+
+class OtaServer
+{
+public:
+    OtaServer();
+    ~OtaServer();
+
+    bool start(bool tls);
+    void stop();
+
+    std::string url() const;
+    const char *certPem() const { return _cert_pem.c_str(); }
+    void setImage(const std::vector<uint8_t> &image);
+    void setFaults(const OtaFaults &faults);
+    uint32_t connections() const { return _connections; }
+
+private:
+    void serve();
+    void handle(int fd);
+    bool makeCert();
+
+    bool _tls;
+    int _listen;
+    uint16_t _port;
+    std::atomic<bool> _stop;
+    std::atomic<uint32_t> _connections;
+    std::thread _thread;
+    std::mutex _lock;       ///< image and faults
+    std::vector<uint8_t> _image;
+    OtaFaults _faults;
+    std::string _cert_pem;
+    void *_ssl_ctx;
+};
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Arduino.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// Host build: the slice of the Arduino core the sources use. `String`
+/// sits on std::string, `log_*` go to stderr.
+#ifndef __HOST_ARDUINO_H__
+#define __HOST_ARDUINO_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "hal-misc.h"
+
+#ifndef HOST_LOG_LEVEL
+#define HOST_LOG_LEVEL 2
+#endif
+
+#define HOST_LOG(level, tag, format, ...)                                                     \
+    do                                                                                        \
+    {                                                                                         \
+        if (HOST_LOG_LEVEL >= level)                                                          \
+            fprintf(stderr, "[%s] %s(): " format "\n", tag, __FUNCTION__, ##__VA_ARGS__);     \
+    } while (0)
+
+#define log_e(format, ...) HOST_LOG(1, "E", format, ##__VA_ARGS__)
+#define log_w(format, ...) HOST_LOG(2, "W", format, ##__VA_ARGS__)
+#define log_i(format, ...) HOST_LOG(3, "I", format, ##__VA_ARGS__)
+#define log_d(format, ...) HOST_LOG(4, "D", format, ##__VA_ARGS__)
+#define log_v(format, ...) HOST_LOG(5, "V", format, ##__VA_ARGS__)
+
+static inline unsigned long millis() { return (unsigned long)(esp_timer_get_time() / 1000); }
+static inline unsigned long micros() { return (unsigned long)esp_timer_get_time(); }
+static inline void delay(uint32_t ms) { vTaskDelay(pdMS_TO_TICKS(ms)); }
+static inline void yield() { taskYIELD(); }
+
+class String
+{
+public:
+    String() {}
+    String(const char *s) : _s(s ? s : "") {}
+    String(const std::string &s) : _s(s) {}
+    String(char c) : _s(1, c) {}
+    explicit String(int v) : _s(std::to_string(v)) {}
+    explicit String(unsigned int v) : _s(std::to_string(v)) {}
+    explicit String(long v) : _s(std::to_string(v)) {}
+    explicit String(unsigned long v) : _s(std::to_string(v)) {}
+
+    const char *c_str() const { return _s.c_str(); }
+    unsigned int length() const { return _s.length(); }
+    bool isEmpty() const { return _s.empty(); }
+    void clear() { _s.clear(); }
+    bool reserve(unsigned int size)
+    {
+        _s.reserve(size);
+        return true;
+    }
+    char operator[](unsigned int i) const { return i < _s.length() ? _s[i] : 0; }
+    char charAt(unsigned int i) const { return (*this)[i]; }
+
+    void toLowerCase()
+    {
+        for (size_t i = 0; i < _s.length(); i++)
+            if (_s[i] >= 'A' && _s[i] <= 'Z')
+                _s[i] += 'a' - 'A';
+    }
+    int indexOf(char c, unsigned int from = 0) const
+    {
+        size_t at = _s.find(c, from);
+        return at == std::string::npos ? -1 : (int)at;
+    }
+    int indexOf(const String &s, unsigned int from = 0) const
+    {
+        size_t at = _s.find(s._s, from);
+        return at == std::string::npos ? -1 : (int)at;
+    }
+    String substring(unsigned int from) const { return from < _s.length() ? String(_s.substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const
+    {
+        if (from > to)
+            std::swap(from, to);
+        if (from >= _s.length())
+            return String();
+        return String(_s.substr(from, to - from));
+    }
+    bool startsWith(const String &s) const { return _s.compare(0, s._s.length(), s._s) == 0; }
+    bool equals(const String &s) const { return _s == s._s; }
+
+    String &operator=(const char *s)
+    {
+        _s = s ? s : "";
+        return *this;
+    }
+    String &operator+=(const String &s)
+    {
+        _s += s._s;
+        return *this;
+    }
+    String &operator+=(const char *s)
+    {
+        _s += s;
+        return *this;
+    }
+    String &operator+=(char c)
+    {
+        _s += c;
+        return *this;
+    }
+    bool concat(const char *s, unsigned int len)
+    {
+        _s.append(s, len);
+        return true;
+    }
+
+    friend String operator+(const String &a, const String &b) { return String(a._s + b._s); }
+    friend bool operator==(const String &a, const String &b) { return a._s == b._s; }
+    friend bool operator!=(const String &a, const String &b) { return a._s != b._s; }
+    friend bool operator<(const String &a, const String &b) { return a._s < b._s; }
+
+private:
+    std::string _s;
+};
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+        size_t n = 0;
+        while (size-- && write(*buffer++))
+            n++;
+        return n;
+    }
+    size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+    size_t print(const char *str) { return write(str); }
+    size_t print(const String &s) { return write((const uint8_t *)s.c_str(), s.length()); }
+};
+
+class Stream : public Print
+{
+public:
+    Stream() : _timeout(1000) {}
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {}
+
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+
+    /// Blocks up to the timeout for each byte, like the Arduino core.
+    size_t readBytes(uint8_t *buffer, size_t length)
+    {
+        size_t n = 0;
+        while (n < length)
+        {
+            int c = timedRead();
+            if (c < 0)
+                break;
+            buffer[n++] = (uint8_t)c;
+        }
+        return n;
+    }
+    size_t readBytes(char *buffer, size_t length) { return readBytes((uint8_t *)buffer, length); }
+
+protected:
+    int timedRead()
+    {
+        unsigned long start = millis();
+        do
+        {
+            int c = read();
+            if (c >= 0)
+                return c;
+            yield();
+        } while (millis() - start < _timeout);
+        return -1;
+    }
+
+    unsigned long _timeout;
+};
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * esp_https_ota.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// Host build: the IDF 4.4 esp_https_ota API, implemented by host/ota_emu
+/// over plain sockets (http://) or OpenSSL (https://), writing into an
+/// emulated OTA partition.
+#ifndef __HOST_ESP_HTTPS_OTA_H__
+#define __HOST_ESP_HTTPS_OTA_H__
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ESP_ERR_HTTPS_OTA_BASE 0x9000
+#define ESP_ERR_HTTPS_OTA_IN_PROGRESS (ESP_ERR_HTTPS_OTA_BASE + 1)
+#define ESP_ERR_OTA_BASE 0x1500
+#define ESP_ERR_OTA_VALIDATE_FAILED (ESP_ERR_OTA_BASE + 3)
+
+typedef struct esp_https_ota_ctx *esp_https_ota_handle_t;
+
+typedef struct
+{
+    const esp_http_client_config_t *http_config;
+} esp_https_ota_config_t;
+
+esp_err_t esp_https_ota_begin(esp_https_ota_config_t *ota_config, esp_https_ota_handle_t *handle);
+esp_err_t esp_https_ota_perform(esp_https_ota_handle_t handle);
+bool esp_https_ota_is_complete_data_received(esp_https_ota_handle_t handle);
+esp_err_t esp_https_ota_finish(esp_https_ota_handle_t handle);
+esp_err_t esp_https_ota_abort(esp_https_ota_handle_t handle);
+int esp_https_ota_get_image_len_read(esp_https_ota_handle_t handle);
+int esp_https_ota_get_image_size(esp_https_ota_handle_t handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
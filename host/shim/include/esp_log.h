@@ -0,0 +1,41 @@
+/*
+ * esp_log.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// Host build: ESP_LOGx to stderr, filtered by HOST_LOG_LEVEL like log_x.
+#ifndef __HOST_ESP_LOG_H__
+#define __HOST_ESP_LOG_H__
+
+#include <stdio.h>
+
+#ifndef HOST_LOG_LEVEL
+#define HOST_LOG_LEVEL 2
+#endif
+
+#define HOST_ESP_LOG(level, letter, tag, format, ...)                          \
+    do                                                                         \
+    {                                                                          \
+        if (HOST_LOG_LEVEL >= level)                                           \
+            fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__);  \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) HOST_ESP_LOG(1, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_ESP_LOG(2, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) HOST_ESP_LOG(3, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) HOST_ESP_LOG(4, "D", tag, format, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * osMutex.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// Host build of the FEmbed-OS mutex. Not recursive, so a nested lock that
+/// would deadlock on target deadlocks here too.
+#ifndef __HOST_OS_MUTEX_H__
+#define __HOST_OS_MUTEX_H__
+
+#include <mutex>
+
+namespace FEmbed {
+
+class OSMutex
+{
+public:
+    void lock() { _mutex.lock(); }
+    void unlock() { _mutex.unlock(); }
+
+private:
+    std::mutex _mutex;
+};
+
+class OSMutexLocker
+{
+public:
+    explicit OSMutexLocker(OSMutex &mutex) : _mutex(mutex) { _mutex.lock(); }
+    ~OSMutexLocker() { _mutex.unlock(); }
+
+private:
+    OSMutex &_mutex;
+};
+
+} // namespace FEmbed
+
+#endif
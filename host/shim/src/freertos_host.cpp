@@ -0,0 +1,504 @@
+/*
+ * freertos_host.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/// FreeRTOS on POSIX threads, enough of it for the host build. Tasks are
+/// detached pthreads, queues and semaphores share one implementation like
+/// on target, timers run on one service thread. Task and timer objects are
+/// reclaimed lazily, a stale handle stays safe to notify.
+#include <pthread.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "esp_timer.h"
+
+typedef std::chrono::steady_clock host_clock;
+
+static const host_clock::time_point host_epoch = host_clock::now();
+
+static host_clock::duration ticks_to_duration(TickType_t ticks)
+{
+    return std::chrono::microseconds((int64_t)ticks * 1000000 / configTICK_RATE_HZ);
+}
+
+struct HostTask
+{
+    TaskFunction_t code;
+    void *param;
+    std::mutex lock;
+    std::condition_variable cond;
+    uint32_t notify;
+};
+
+static thread_local HostTask *current_task = NULL;
+
+/// Threads not created through `xTaskCreate()` (main, timer service) get a
+/// handle on first use so they can wait for notifications too.
+static HostTask *self_task()
+{
+    if (!current_task)
+    {
+        current_task = new HostTask();
+        current_task->code = NULL;
+        current_task->param = NULL;
+        current_task->notify = 0;
+    }
+    return current_task;
+}
+
+static void *task_entry(void *arg)
+{
+    HostTask *task = (HostTask *)arg;
+    current_task = task;
+    task->code(task->param);
+    return NULL;
+}
+
+extern "C" BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stackDepth, void *param,
+                                  UBaseType_t priority, TaskHandle_t *created)
+{
+    (void)name;
+    (void)stackDepth;
+    (void)priority;
+    HostTask *task = new HostTask();
+    task->code = code;
+    task->param = param;
+    task->notify = 0;
+    if (created)
+        *created = task;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int rc = pthread_create(&thread, &attr, task_entry, task);
+    pthread_attr_destroy(&attr);
+    if (rc != 0)
+    {
+        if (created)
+            *created = NULL;
+        delete task;
+        return pdFAIL;
+    }
+    return pdPASS;
+}
+
+extern "C" BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t stackDepth, void *param,
+                                              UBaseType_t priority, TaskHandle_t *created, BaseType_t core)
+{
+    (void)core;
+    return xTaskCreate(code, name, stackDepth, param, priority, created);
+}
+
+extern "C" void vTaskDelete(TaskHandle_t task)
+{
+    // Only self deletion is used, other threads cannot be stopped safely.
+    if (task == NULL || task == current_task)
+        pthread_exit(NULL);
+}
+
+extern "C" void vTaskDelay(TickType_t ticks)
+{
+    if (ticks == 0)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(ticks_to_duration(ticks));
+}
+
+extern "C" TickType_t xTaskGetTickCount(void)
+{
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(host_clock::now() - host_epoch).count();
+    return (TickType_t)(us * configTICK_RATE_HZ / 1000000);
+}
+
+extern "C" TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return self_task();
+}
+
+extern "C" BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    std::lock_guard<std::mutex> locker(task->lock);
+    task->notify++;
+    task->cond.notify_all();
+    return pdPASS;
+}
+
+extern "C" uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks)
+{
+    HostTask *task = self_task();
+    std::unique_lock<std::mutex> locker(task->lock);
+    if (ticks == portMAX_DELAY)
+        task->cond.wait(locker, [task] { return task->notify != 0; });
+    else
+        task->cond.wait_for(locker, ticks_to_duration(ticks), [task] { return task->notify != 0; });
+    uint32_t value = task->notify;
+    if (value)
+        task->notify = clearOnExit ? 0 : value - 1;
+    return value;
+}
+
+extern "C" void taskYIELD(void)
+{
+    std::this_thread::yield();
+}
+
+extern "C" int64_t esp_timer_get_time(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(host_clock::now() - host_epoch).count();
+}
+
+/// One type for queues and all semaphore kinds, semaphores are queues of
+/// zero sized items like on target.
+struct HostQueue
+{
+    std::mutex lock;
+    std::condition_variable cond;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t count;
+    std::deque<std::vector<uint8_t> > items;
+    bool is_mutex;
+    HostTask *holder;
+};
+
+static HostQueue *queue_new(UBaseType_t length, UBaseType_t itemSize)
+{
+    HostQueue *q = new HostQueue();
+    q->length = length;
+    q->item_size = itemSize;
+    q->count = 0;
+    q->is_mutex = false;
+    q->holder = NULL;
+    return q;
+}
+
+template <typename Pred>
+static bool queue_wait(HostQueue *q, std::unique_lock<std::mutex> &locker, TickType_t ticks, Pred pred)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        q->cond.wait(locker, pred);
+        return true;
+    }
+    return q->cond.wait_for(locker, ticks_to_duration(ticks), pred);
+}
+
+extern "C" QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+    return queue_new(length, itemSize);
+}
+
+extern "C" BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> locker(q->lock);
+    if (!queue_wait(q, locker, ticks, [q] { return q->count < q->length; }))
+        return pdFALSE;
+    if (q->item_size)
+    {
+        const uint8_t *p = (const uint8_t *)item;
+        q->items.push_back(std::vector<uint8_t>(p, p + q->item_size));
+    }
+    q->count++;
+    q->cond.notify_all();
+    return pdTRUE;
+}
+
+static BaseType_t queue_take(HostQueue *q, void *item, TickType_t ticks, bool peek)
+{
+    std::unique_lock<std::mutex> locker(q->lock);
+    if (!queue_wait(q, locker, ticks, [q] { return q->count > 0; }))
+        return pdFALSE;
+    if (q->item_size && item)
+        memcpy(item, q->items.front().data(), q->item_size);
+    if (!peek)
+    {
+        if (q->item_size)
+            q->items.pop_front();
+        q->count--;
+        if (q->is_mutex)
+            q->holder = self_task();
+        q->cond.notify_all();
+    }
+    return pdTRUE;
+}
+
+extern "C" BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+    return queue_take(q, item, ticks, false);
+}
+
+extern "C" BaseType_t xQueuePeek(QueueHandle_t q, void *item, TickType_t ticks)
+{
+    return queue_take(q, item, ticks, true);
+}
+
+extern "C" BaseType_t xQueueReset(QueueHandle_t q)
+{
+    std::lock_guard<std::mutex> locker(q->lock);
+    q->items.clear();
+    q->count = 0;
+    q->cond.notify_all();
+    return pdPASS;
+}
+
+extern "C" UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    std::lock_guard<std::mutex> locker(q->lock);
+    return q->count;
+}
+
+extern "C" void vQueueDelete(QueueHandle_t q)
+{
+    delete q;
+}
+
+extern "C" SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    HostQueue *q = queue_new(1, 0);
+    q->count = 1;
+    q->is_mutex = true;
+    return q;
+}
+
+extern "C" SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return queue_new(1, 0);
+}
+
+extern "C" SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount)
+{
+    HostQueue *q = queue_new(maxCount, 0);
+    q->count = initialCount;
+    return q;
+}
+
+extern "C" BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    return queue_take(sem, NULL, ticks, false);
+}
+
+extern "C" BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    {
+        std::lock_guard<std::mutex> locker(sem->lock);
+        if (sem->is_mutex)
+        {
+            if (sem->holder != current_task)
+                return pdFALSE;
+            sem->holder = NULL;
+        }
+    }
+    return xQueueSend(sem, NULL, 0);
+}
+
+extern "C" TaskHandle_t xSemaphoreGetMutexHolder(SemaphoreHandle_t sem)
+{
+    std::lock_guard<std::mutex> locker(sem->lock);
+    return sem->holder;
+}
+
+extern "C" void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    delete sem;
+}
+
+/// Timer commands are applied under `timer_lock`, callbacks run on the
+/// service thread without it. Deletion is deferred to the service thread,
+/// so like on target a callback may still be running when
+/// `xTimerDelete()` returns.
+struct HostTimer
+{
+    TickType_t period;
+    bool auto_reload;
+    void *id;
+    TimerCallbackFunction_t callback;
+    bool active;
+    bool deleted;
+    host_clock::time_point expiry;
+};
+
+// Never destroyed, the service thread keeps using them during exit.
+static std::mutex &timer_lock = *new std::mutex;
+static std::condition_variable &timer_cond = *new std::condition_variable;
+static std::list<HostTimer *> &timers = *new std::list<HostTimer *>;
+static std::list<std::pair<PendedFunction_t, std::pair<void *, uint32_t> > > &timer_pended =
+    *new std::list<std::pair<PendedFunction_t, std::pair<void *, uint32_t> > >;
+static bool timer_service_started = false;
+
+static void timer_service()
+{
+    std::unique_lock<std::mutex> locker(timer_lock);
+    for (;;)
+    {
+        if (!timer_pended.empty())
+        {
+            std::pair<PendedFunction_t, std::pair<void *, uint32_t> > call = timer_pended.front();
+            timer_pended.pop_front();
+            locker.unlock();
+            call.first(call.second.first, call.second.second);
+            locker.lock();
+            continue;
+        }
+        host_clock::time_point next = host_clock::time_point::max();
+        HostTimer *due = NULL;
+        for (std::list<HostTimer *>::iterator it = timers.begin(); it != timers.end();)
+        {
+            HostTimer *t = *it;
+            if (t->deleted)
+            {
+                it = timers.erase(it);
+                delete t;
+                continue;
+            }
+            if (t->active && t->expiry < next)
+            {
+                next = t->expiry;
+                due = t;
+            }
+            ++it;
+        }
+        if (!due || next > host_clock::now())
+        {
+            if (due)
+                timer_cond.wait_until(locker, next);
+            else
+                timer_cond.wait(locker);
+            continue;
+        }
+        if (due->auto_reload)
+            due->expiry += ticks_to_duration(due->period);
+        else
+            due->active = false;
+        TimerCallbackFunction_t cb = due->callback;
+        locker.unlock();
+        cb(due);
+        locker.lock();
+    }
+}
+
+static void timer_service_start()
+{
+    if (!timer_service_started)
+    {
+        timer_service_started = true;
+        std::thread(timer_service).detach();
+    }
+}
+
+extern "C" TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t autoReload, void *id,
+                                      TimerCallbackFunction_t callback)
+{
+    (void)name;
+    HostTimer *t = new HostTimer();
+    t->period = period;
+    t->auto_reload = autoReload != 0;
+    t->id = id;
+    t->callback = callback;
+    t->active = false;
+    t->deleted = false;
+    std::lock_guard<std::mutex> locker(timer_lock);
+    timers.push_back(t);
+    timer_service_start();
+    return t;
+}
+
+extern "C" BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks)
+{
+    (void)ticks;
+    std::lock_guard<std::mutex> locker(timer_lock);
+    timer->active = true;
+    timer->expiry = host_clock::now() + ticks_to_duration(timer->period);
+    timer_cond.notify_all();
+    return pdPASS;
+}
+
+extern "C" BaseType_t xTimerReset(TimerHandle_t timer, TickType_t ticks)
+{
+    return xTimerStart(timer, ticks);
+}
+
+extern "C" BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks)
+{
+    (void)ticks;
+    std::lock_guard<std::mutex> locker(timer_lock);
+    timer->active = false;
+    timer_cond.notify_all();
+    return pdPASS;
+}
+
+extern "C" BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks)
+{
+    (void)ticks;
+    std::lock_guard<std::mutex> locker(timer_lock);
+    timer->period = period;
+    timer->active = true;
+    timer->expiry = host_clock::now() + ticks_to_duration(period);
+    timer_cond.notify_all();
+    return pdPASS;
+}
+
+extern "C" BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t ticks)
+{
+    (void)ticks;
+    std::lock_guard<std::mutex> locker(timer_lock);
+    timer->active = false;
+    timer->deleted = true;
+    timer_cond.notify_all();
+    return pdPASS;
+}
+
+extern "C" BaseType_t xTimerIsTimerActive(TimerHandle_t timer)
+{
+    std::lock_guard<std::mutex> locker(timer_lock);
+    return timer->active ? pdTRUE : pdFALSE;
+}
+
+extern "C" void *pvTimerGetTimerID(TimerHandle_t timer)
+{
+    return timer->id;
+}
+
+extern "C" BaseType_t xTimerPendFunctionCall(PendedFunction_t fn, void *param1, uint32_t param2, TickType_t ticks)
+{
+    (void)ticks;
+    std::lock_guard<std::mutex> locker(timer_lock);
+    timer_pended.push_back(std::make_pair(fn, std::make_pair(param1, param2)));
+    timer_service_start();
+    timer_cond.notify_all();
+    return pdPASS;
+}
+
+/// From hal-misc.c, which is not part of the host build.
+extern "C" BaseType_t xTaskCreateUniversal(TaskFunction_t code, const char *const name, const uint32_t stackDepth,
+                                           void *const param, UBaseType_t priority, TaskHandle_t *const created,
+                                           const BaseType_t core)
+{
+    return xTaskCreatePinnedToCore(code, name, stackDepth, param, priority, created, core);
+}
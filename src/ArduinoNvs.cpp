@@ -22,16 +22,159 @@
 // SOFTWARE.
 
 #include "ArduinoNvs.h"
+#include "esp_idf_version.h"
+#include "esp_timer.h"
+#include "hal-misc.h"
+#include <algorithm>
+#include <string>
 
 #ifdef LOG_TAG
 #undef LOG_TAG
 #endif
 #define LOG_TAG "ArdNVS"
 
-ArduinoNvs::ArduinoNvs(String namespaceNvs, bool auto_reinit)
+static_assert((ARDUINONVS_TYPE_CACHE_SIZE & (ARDUINONVS_TYPE_CACHE_SIZE - 1)) == 0,
+              "ARDUINONVS_TYPE_CACHE_SIZE must be a power of two");
+
+/// FNV-1a, indexes the type cache and names large blob shards.
+static uint32_t key_hash(const char *key)
 {
-    FEmbed::OSMutexLocker locker(nvs_global_lock);
-    _nvs_valid = false;
+    uint32_t h = 2166136261u;
+    while (*key)
+    {
+        h ^= (uint8_t)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/// zlib compatible CRC-32, nibble table to keep it small. Checks exports
+/// and large blobs.
+static uint32_t nvs_crc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+    crc = ~crc;
+    while (length--)
+    {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+    }
+    return ~crc;
+}
+
+/// Compressed values carry their packed flag out of band: a u64 marker
+/// under `__z<key hash>` holds the unpacked length in the low 32 bits, the
+/// kind above it and 24 bits of the key's CRC on top, which tell apart keys
+/// sharing the hash. Data is read as packed only when the marker and the
+/// in-band header agree, so a plain blob that happens to start with the
+/// header is returned as stored.
+static void marker_key(char *out, const char *key)
+{
+    snprintf(out, NVS_KEY_NAME_MAX_SIZE, "__z%08x", (unsigned)key_hash(key));
+}
+
+static uint32_t marker_owner(const char *key)
+{
+    return nvs_crc32(0, (const uint8_t *)key, strlen(key)) & 0xffffff;
+}
+
+static uint64_t marker_value(const char *key, uint8_t kind, size_t length)
+{
+    return (uint64_t)marker_owner(key) << 40 | (uint64_t)kind << 32 | (uint32_t)length;
+}
+
+struct NvsSnapshotEntry
+{
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    nvs_type_t type; ///< NVS_TYPE_ANY once invalidated by a write
+    bool loaded;     ///< value held in RAM, else read from flash
+    uint16_t length; ///< string with terminator, or blob
+    uint32_t offset; ///< into NvsSnapshot::data
+    uint64_t num;    ///< integer value, raw bytes as stored
+};
+
+/// One allocation: this header, the sorted entries, then string and blob
+/// values.
+struct NvsSnapshot
+{
+    size_t count;
+    size_t bytes;
+    bool complete; ///< no key was added since preload, misses are final
+    uint32_t preload_us;
+    uint32_t read_us;
+    NvsSnapshotEntry *entries;
+    uint8_t *data;
+};
+
+/// Records the caller visible latency of one public operation.
+class NvsOpTimer
+{
+public:
+    NvsOpTimer(ArduinoNvs *nvs, ArduinoNvs::MetricOp op) : _nvs(nvs), _op(op), _start(esp_timer_get_time()) {}
+    ~NvsOpTimer() { _nvs->countOp(_op, _start); }
+
+private:
+    ArduinoNvs *_nvs;
+    ArduinoNvs::MetricOp _op;
+    int64_t _start;
+};
+
+struct NamespaceSlot
+{
+    char name[NVS_NS_NAME_MAX_SIZE];
+    NvsRWLock *lock;
+    nvs_handle handle;
+    uint32_t users;         ///< instances sharing the open handle
+    NvsSnapshot *snapshot;  ///< guarded by `lock`, every write path invalidates it
+    std::atomic<uint32_t> snapshot_hits;
+    std::atomic<uint32_t> snapshot_misses;
+};
+
+/// One lock, one pooled handle and one snapshot per namespace, shared by
+/// every instance using it. Guarded by `nvs_global_lock`, entries live for
+/// the whole program and never move. Function local so global ArduinoNvs
+/// objects in other units can use it during static init.
+static std::vector<NamespaceSlot *> &namespace_slots_get()
+{
+    static std::vector<NamespaceSlot *> slots;
+    return slots;
+}
+
+static NamespaceSlot &namespace_slot(const char *name)
+{
+    std::vector<NamespaceSlot *> &slots = namespace_slots_get();
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        if (strncmp(slots[i]->name, name, NVS_NS_NAME_MAX_SIZE) == 0)
+            return *slots[i];
+    }
+    NamespaceSlot *slot = new NamespaceSlot();
+    strncpy(slot->name, name, NVS_NS_NAME_MAX_SIZE - 1);
+    slot->name[NVS_NS_NAME_MAX_SIZE - 1] = 0;
+    slot->lock = new NvsRWLock();
+    slot->handle = 0;
+    slot->users = 0;
+    slot->snapshot = NULL;
+    slot->snapshot_hits = 0;
+    slot->snapshot_misses = 0;
+    slots.push_back(slot);
+    return *slot;
+}
+
+static ArduinoNvs::InitStats init_stats;
+static bool flash_ready;
+
+/// Caller holds `nvs_global_lock`. Runs `nvs_flash_init()` for the first
+/// instance put to use, later ones only check the result.
+static bool flash_init(bool auto_reinit)
+{
+    if (flash_ready)
+        return true;
+
+    int64_t start = esp_timer_get_time();
     esp_err_t err = nvs_flash_init();
     if (err != ESP_OK)
     {
@@ -39,52 +182,153 @@ ArduinoNvs::ArduinoNvs(String namespaceNvs, bool auto_reinit)
         if (err != ESP_ERR_NVS_NO_FREE_PAGES)
         {
             log_w("flash init failed");
-            return;
+            return false;
         }
 
         if (!auto_reinit)
-            return;
+            return false;
         // erase and reinit
         log_w("Try reinit the partition");
         const esp_partition_t *nvs_partition = esp_partition_find_first(
             ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, NULL);
         if (nvs_partition == NULL)
-            return;
+            return false;
         err = esp_partition_erase_range(nvs_partition, 0, nvs_partition->size);
-        esp_err_t err = nvs_flash_init();
+        if (err == ESP_OK)
+            err = nvs_flash_init();
         if (err)
-            return;
+            return false;
+        init_stats.reformatted = true;
         log_w("Partition re-formatted");
     }
+    init_stats.flash_init_us = esp_timer_get_time() - start;
+    flash_ready = true;
+    return true;
+}
 
-    err = nvs_open(namespaceNvs.c_str(), NVS_READWRITE, &_nvs_handle);
-    if (err != ESP_OK)
+ArduinoNvs::ArduinoNvs(String namespaceNvs, bool auto_reinit)
+{
+    int64_t start = esp_timer_get_time();
+    FEmbed::OSMutexLocker locker(nvs_global_lock);
+    _nvs_valid = false;
+    _open_retry_us = 0;
+    _auto_reinit = auto_reinit;
+    _nvs_handle = 0;
+    strncpy(_namespace, namespaceNvs.c_str(), NVS_NS_NAME_MAX_SIZE - 1);
+    _namespace[NVS_NS_NAME_MAX_SIZE - 1] = 0;
+    _slot = &namespace_slot(_namespace);
+    _lock = _slot->lock;
+    _write_back = false;
+    _dirty_threshold = 0;
+    _dirty_count = 0;
+    _flush_timer = NULL;
+    _cache_seq = 0;
+    _async = false;
+    _writer_stop = false;
+    _writer = NULL;
+    _writer_exit = NULL;
+    _async_sem = NULL;
+    _async_requested = 0;
+    _async_done = 0;
+    _async_waiters = 0;
+    _async_error = ESP_OK;
+    _async_cb = NULL;
+    memset(&_write_stats, 0, sizeof(_write_stats));
+    memset(&_gc_stats, 0, sizeof(_gc_stats));
+    _compress = false;
+    _compress_min = 0;
+    memset(&_compress_stats, 0, sizeof(_compress_stats));
+    memset(_hot, 0, sizeof(_hot));
+    for (size_t op = 0; op < METRIC_OPS; op++)
+        for (size_t i = 0; i < ARDUINONVS_HIST_BUCKETS; i++)
+            _latency[op][i] = 0;
+    clearTypeCache();
+    init_stats.instances++;
+    init_stats.construct_us += esp_timer_get_time() - start;
+}
+
+/// Flash init and `nvs_open()` are deferred to the first operation, the
+/// handle is shared with other instances of the same namespace. After a
+/// failure, operations fail fast until ARDUINONVS_OPEN_RETRY_MS passed and
+/// the next one tries again.
+bool ArduinoNvs::open()
+{
+    FEmbed::OSMutexLocker locker(nvs_global_lock);
+    if (_nvs_valid)
+        return true;
+    int64_t start = esp_timer_get_time();
+    if (start < _open_retry_us)
+        return false;
+
+    _open_retry_us = start + (int64_t)ARDUINONVS_OPEN_RETRY_MS * 1000;
+    if (!flash_init(_auto_reinit))
+        return false;
+
+    NamespaceSlot &slot = namespace_slot(_namespace);
+    if (slot.users == 0)
     {
-        log_w("nvs open failed %s.", namespaceNvs.c_str());
-        return;
+        int64_t open_start = esp_timer_get_time();
+        esp_err_t err = nvs_open(_namespace, NVS_READWRITE, &slot.handle);
+        init_stats.opens++;
+        init_stats.open_us += esp_timer_get_time() - open_start;
+        if (err != ESP_OK)
+        {
+            log_w("nvs open failed %s.", _namespace);
+            return false;
+        }
     }
+    slot.users++;
+    _nvs_handle = slot.handle;
+    _open_retry_us = 0;
+    _nvs_valid.store(true, std::memory_order_release);
+    init_stats.first_use_us += esp_timer_get_time() - start;
+    log_i("nvs %s init successful.", _namespace);
+    return true;
+}
 
-    log_i("nvs %s init successful.", namespaceNvs.c_str());
-    _nvs_valid = true;
+ArduinoNvs::InitStats ArduinoNvs::initStats()
+{
+    FEmbed::OSMutexLocker locker(nvs_global_lock);
+    return init_stats;
 }
 
 ArduinoNvs::~ArduinoNvs()
 {
+    deleteFlushTimer();
+    if (_async)
+        setAsync(false);
+    stopWriter();
+    if (_dirty_count)
+        commit();
     if (_nvs_valid)
     {
-        nvs_global_lock.lock();
-        nvs_close(_nvs_handle);
-        nvs_global_lock.unlock();
+        FEmbed::OSMutexLocker locker(nvs_global_lock);
+        NamespaceSlot &slot = namespace_slot(_namespace);
+        if (--slot.users == 0)
+        {
+            nvs_close(slot.handle);
+            NvsWriteLocker ns_locker(*_lock);
+            free(slot.snapshot);
+            slot.snapshot = NULL;
+        }
     }
 }
 
 bool ArduinoNvs::eraseAll(bool forceCommit)
 {
-    if (!_nvs_valid)
+    NvsOpTimer timer(this, METRIC_ERASE);
+    if (!ensureOpen())
         return false;
-    nvs_global_lock.lock();
+    _flush_lock.lock();
+    _lock->lock();
     esp_err_t err = nvs_erase_all(_nvs_handle);
-    nvs_global_lock.unlock();
+    clearTypeCache();
+    free(_slot->snapshot);
+    _slot->snapshot = NULL;
+    _cache.clear();
+    _dirty_count = 0;
+    _lock->unlock();
+    _flush_lock.unlock();
     if (err != ESP_OK)
     {
         log_w("eraseAll failed(%d).", err);
@@ -93,28 +337,50 @@ bool ArduinoNvs::eraseAll(bool forceCommit)
     return forceCommit ? commit() : true;
 }
 
-bool ArduinoNvs::erase(String key, bool forceCommit)
+bool ArduinoNvs::erase(const char *key, bool forceCommit)
 {
-    if (!_nvs_valid)
+    NvsOpTimer timer(this, METRIC_ERASE);
+    if (!ensureOpen())
         return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_erase_key(_nvs_handle, key.c_str());
-    nvs_global_lock.unlock();
-    if (err != ESP_OK)
+    char mkey[NVS_KEY_NAME_MAX_SIZE];
+    marker_key(mkey, key);
+    for (;;)
     {
-        log_w("erase `%s` failed(%d).", key.c_str(), err);
-        return false;
+        {
+            NvsWriteLocker locker(*_lock);
+            if (!_write_back || cacheRoom(key, mkey))
+            {
+                esp_err_t err = putLocked(key, NVS_TYPE_ANY, NULL, 0);
+                if (err == ESP_OK && packedKind(key, NULL))
+                    err = putLocked(mkey, NVS_TYPE_ANY, NULL, 0);
+                if (err != ESP_OK)
+                {
+                    log_w("erase `%s` failed(%d).", key, err);
+                    return false;
+                }
+                break;
+            }
+        }
+        if (!makeCacheRoom())
+            return false;
     }
+    if (_write_back)
+        return cacheCommit();
     return forceCommit ? commit() : true;
 }
 
 bool ArduinoNvs::commit()
 {
-    if (!_nvs_valid)
+    NvsOpTimer timer(this, METRIC_COMMIT);
+    if (!ensureOpen())
         return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_commit(_nvs_handle);
-    nvs_global_lock.unlock();
+    if (_async)
+    {
+        Ticket ticket = commitAsync();
+        if (ticket)
+            return waitFor(ticket) && _async_error == ESP_OK;
+    }
+    esp_err_t err = commitNow();
     if (err != ESP_OK)
     {
         log_w("commit failed(%d).", err);
@@ -123,325 +389,2728 @@ bool ArduinoNvs::commit()
     return true;
 }
 
-bool ArduinoNvs::setInt(String key, uint8_t value, bool forceCommit)
+/// Flushes the write-back cache and commits on the calling task.
+esp_err_t ArduinoNvs::commitNow()
 {
-    if (!_nvs_valid)
-        return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_set_u8(_nvs_handle, (char *)key.c_str(), value);
-    nvs_global_lock.unlock();
-    if (err != ESP_OK)
+    if (_write_back)
+        return flushCache();
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = nvs_commit(_nvs_handle);
+    NvsWriteLocker locker(*_lock);
+    _write_stats.commits++;
+    _write_stats.commit_us += esp_timer_get_time() - start;
+    return err;
+}
+
+/// Size in bytes of an integer `nvs_type_t`, encoded in its low nibble.
+static inline size_t int_size(nvs_type_t type)
+{
+    return type & 0x0f;
+}
+
+static inline bool is_int_type(nvs_type_t type)
+{
+    return type != NVS_TYPE_STR && type != NVS_TYPE_BLOB && type != NVS_TYPE_ANY;
+}
+
+/// Integer value from its raw little-endian bytes, sign extended per type.
+static int64_t int_from_raw(nvs_type_t type, uint64_t raw)
+{
+    switch (type)
     {
-        log_w("setInt %s failed(%d).", key.c_str(), err);
-        return false;
+    case NVS_TYPE_U8:
+        return (uint8_t)raw;
+    case NVS_TYPE_I8:
+        return (int8_t)raw;
+    case NVS_TYPE_U16:
+        return (uint16_t)raw;
+    case NVS_TYPE_I16:
+        return (int16_t)raw;
+    case NVS_TYPE_U32:
+        return (uint32_t)raw;
+    case NVS_TYPE_I32:
+        return (int32_t)raw;
+    default:
+        return (int64_t)raw;
     }
-    return forceCommit ? commit() : true;
 }
 
-bool ArduinoNvs::setInt(String key, int16_t value, bool forceCommit)
+static esp_err_t write_raw(nvs_handle handle, const char *key, nvs_type_t type, const void *data, size_t length)
 {
-    if (!_nvs_valid)
-        return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_set_i16(_nvs_handle, (char *)key.c_str(), value);
-    nvs_global_lock.unlock();
-    if (err != ESP_OK)
+    esp_err_t err;
+    uint64_t raw = 0;
+    if (is_int_type(type))
+        memcpy(&raw, data, int_size(type));
+
+    switch (type)
     {
-        log_w("setInt %s failed(%d).", key.c_str(), err);
-        return false;
+    case NVS_TYPE_U8:
+        err = nvs_set_u8(handle, key, (uint8_t)raw);
+        break;
+    case NVS_TYPE_I8:
+        err = nvs_set_i8(handle, key, (int8_t)raw);
+        break;
+    case NVS_TYPE_U16:
+        err = nvs_set_u16(handle, key, (uint16_t)raw);
+        break;
+    case NVS_TYPE_I16:
+        err = nvs_set_i16(handle, key, (int16_t)raw);
+        break;
+    case NVS_TYPE_U32:
+        err = nvs_set_u32(handle, key, (uint32_t)raw);
+        break;
+    case NVS_TYPE_I32:
+        err = nvs_set_i32(handle, key, (int32_t)raw);
+        break;
+    case NVS_TYPE_U64:
+        err = nvs_set_u64(handle, key, raw);
+        break;
+    case NVS_TYPE_I64:
+        err = nvs_set_i64(handle, key, (int64_t)raw);
+        break;
+    case NVS_TYPE_STR:
+        err = nvs_set_str(handle, key, (const char *)data);
+        break;
+    case NVS_TYPE_BLOB:
+        err = nvs_set_blob(handle, key, data, length);
+        break;
+    default:
+        err = ESP_ERR_NVS_TYPE_MISMATCH;
+        break;
     }
-    return forceCommit ? commit() : true;
+    return err;
 }
 
-bool ArduinoNvs::setInt(String key, uint16_t value, bool forceCommit)
+/// Caller holds `_lock`.
+esp_err_t ArduinoNvs::writeEntry(const char *key, nvs_type_t type, const void *data, size_t length)
 {
-    if (!_nvs_valid)
-        return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_set_u16(_nvs_handle, (char *)key.c_str(), value);
-    nvs_global_lock.unlock();
-    if (err != ESP_OK)
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = write_raw(_nvs_handle, key, type, data, length);
+    if (err == ESP_OK && is_int_type(type))
+        cacheType(key, type);
+    if (err == ESP_OK)
+        countSet(key, type, type == NVS_TYPE_STR ? strlen((const char *)data) + 1 : length,
+                 esp_timer_get_time() - start);
+    snapshotInvalidate(key, false);
+    return err;
+}
+
+/// Caller holds `_lock` exclusively.
+void ArduinoNvs::countSet(const char *key, nvs_type_t type, size_t length, int64_t us)
+{
+    size_t entries = 1;
+    if (type == NVS_TYPE_STR || type == NVS_TYPE_BLOB)
+        entries += (length + 31) / 32;
+    if (type == NVS_TYPE_BLOB)
+        entries++;
+    _write_stats.sets++;
+    _write_stats.entries += entries;
+    _write_stats.bytes += entries * 32;
+    _write_stats.set_us += us;
+    if (us >= ARDUINONVS_GC_SPIKE_US)
     {
-        log_w("setInt %s failed(%d).", key.c_str(), err);
-        return false;
+        _gc_stats.inline_gc++;
+        _gc_stats.inline_gc_us += us;
+        if (us > _gc_stats.inline_gc_max_us)
+            _gc_stats.inline_gc_max_us = us;
     }
-    return forceCommit ? commit() : true;
+
+    // Space-Saving: an untracked key takes over the least written slot and
+    // its count.
+    HotKey *least = &_hot[0];
+    for (size_t i = 0; i < ARDUINONVS_HOT_KEYS; i++)
+    {
+        if (strncmp(_hot[i].key, key, NVS_KEY_NAME_MAX_SIZE) == 0)
+        {
+            _hot[i].writes++;
+            return;
+        }
+        if (_hot[i].writes < least->writes)
+            least = &_hot[i];
+    }
+    strncpy(least->key, key, NVS_KEY_NAME_MAX_SIZE - 1);
+    least->key[NVS_KEY_NAME_MAX_SIZE - 1] = 0;
+    least->writes++;
 }
 
-bool ArduinoNvs::setInt(String key, int32_t value, bool forceCommit)
+void ArduinoNvs::countOp(MetricOp op, int64_t start_us)
 {
-    if (!_nvs_valid)
-        return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_set_i32(_nvs_handle, (char *)key.c_str(), value);
-    nvs_global_lock.unlock();
-    if (err != ESP_OK)
+    uint64_t us = esp_timer_get_time() - start_us;
+    size_t bucket = 0;
+    while (us > 1 && bucket < ARDUINONVS_HIST_BUCKETS - 1)
     {
-        log_w("setInt %s failed(%d).", key.c_str(), err);
-        return false;
+        us >>= 1;
+        bucket++;
     }
-    return forceCommit ? commit() : true;
+    _latency[op][bucket].fetch_add(1, std::memory_order_relaxed);
 }
 
-bool ArduinoNvs::setInt(String key, uint32_t value, bool forceCommit)
+static bool hot_key_more(const ArduinoNvs::HotKey &a, const ArduinoNvs::HotKey &b)
 {
-    if (!_nvs_valid)
-        return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_set_u32(_nvs_handle, (char *)key.c_str(), value);
-    nvs_global_lock.unlock();
-    if (err != ESP_OK)
+    return a.writes > b.writes;
+}
+
+ArduinoNvs::Metrics ArduinoNvs::metrics()
+{
+    Metrics m;
+    memset(&m, 0, sizeof(m));
+    for (size_t op = 0; op < METRIC_OPS; op++)
     {
-        log_w("setInt %s failed(%d).", key.c_str(), err);
-        return false;
+        for (size_t i = 0; i < ARDUINONVS_HIST_BUCKETS; i++)
+        {
+            m.latency[op][i] = _latency[op][i].load(std::memory_order_relaxed);
+            m.ops[op] += m.latency[op][i];
+        }
     }
-    return forceCommit ? commit() : true;
+    m.lock_waits = _lock->contention();
+    m.lock_wait_us = _lock->waitUs();
+    nvs_get_stats(NULL, &m.partition);
+    if (ensureOpen())
+        nvs_get_used_entry_count(_nvs_handle, &m.namespace_entries);
+    {
+        NvsReadLocker locker(*_lock);
+        m.writes = _write_stats;
+        memcpy(m.hot, _hot, sizeof(m.hot));
+    }
+    std::sort(m.hot, m.hot + ARDUINONVS_HOT_KEYS, hot_key_more);
+    return m;
+}
+
+void ArduinoNvs::resetMetrics()
+{
+    for (size_t op = 0; op < METRIC_OPS; op++)
+        for (size_t i = 0; i < ARDUINONVS_HIST_BUCKETS; i++)
+            _latency[op][i].store(0, std::memory_order_relaxed);
+    NvsWriteLocker locker(*_lock);
+    memset(&_write_stats, 0, sizeof(_write_stats));
+    memset(_hot, 0, sizeof(_hot));
 }
-bool ArduinoNvs::setInt(String key, int64_t value, bool forceCommit)
+
+/// Entries per 4 KB NVS page, the first two of 128 hold the state bitmap.
+#define NVS_PAGE_ENTRIES 126
+#define NVS_PAGE_SIZE 4096
+#define NVS_PAGE_ACTIVE 0xfffffffe
+#define NVS_BITMAP_OFFSET 32
+#define NVS_ENTRY_EMPTY 3
+/// Scratch blob of maintain(), erased again right away.
+#define NVS_MAINT_KEY "__nvs_maint"
+
+/// Empty entries left in the ACTIVE page of the default partition, read from
+/// the page header and the entry state bitmap. `nvs_get_stats()` cannot tell
+/// this: its free count includes erased entries on full pages. False when no
+/// page is active, e.g. right after a page switch.
+static bool read_active_page_free(size_t &free)
 {
-    if (!_nvs_valid)
+    const esp_partition_t *part = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, NVS_DEFAULT_PART_NAME);
+    if (part == NULL)
         return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_set_i64(_nvs_handle, (char *)key.c_str(), value);
-    nvs_global_lock.unlock();
-    if (err != ESP_OK)
+    for (size_t offset = 0; offset + NVS_PAGE_SIZE <= part->size; offset += NVS_PAGE_SIZE)
     {
-        log_w("setInt %s failed(%d).", key.c_str(), err);
-        return false;
+        uint32_t state;
+        if (esp_partition_read(part, offset, &state, sizeof(state)) != ESP_OK)
+            return false;
+        if (state != NVS_PAGE_ACTIVE)
+            continue;
+        uint8_t bitmap[32];
+        if (esp_partition_read(part, offset + NVS_BITMAP_OFFSET, bitmap, sizeof(bitmap)) != ESP_OK)
+            return false;
+        free = 0;
+        for (size_t i = 0; i < NVS_PAGE_ENTRIES; i++)
+            if (((bitmap[i / 4] >> (i % 4 * 2)) & 3) == NVS_ENTRY_EMPTY)
+                free++;
+        return true;
     }
-    return forceCommit ? commit() : true;
+    return false;
+}
+
+/// The raw reads bypass the NVS lock, a write from another namespace may
+/// land in between. Two equal reads give a count that was current at the
+/// second one; a later write only makes the page fuller.
+static bool active_page_free(size_t &free)
+{
+    size_t again;
+    return read_active_page_free(free) && read_active_page_free(again) && free == again;
 }
 
-bool ArduinoNvs::setInt(String key, uint64_t value, bool forceCommit)
+bool ArduinoNvs::maintain(size_t minPageFree)
 {
-    if (!_nvs_valid)
+    if (!ensureOpen())
         return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_set_u64(_nvs_handle, (char *)key.c_str(), value);
-    nvs_global_lock.unlock();
+
+    nvs_stats_t stats;
+    esp_err_t err = nvs_get_stats(NULL, &stats);
     if (err != ESP_OK)
     {
-        log_w("setInt %s failed(%d).", key.c_str(), err);
+        log_w("get stats failed(%d).", err);
         return false;
     }
-    return forceCommit ? commit() : true;
-}
+    if (minPageFree > NVS_PAGE_ENTRIES / 2)
+        minPageFree = NVS_PAGE_ENTRIES / 2;
 
-bool ArduinoNvs::setString(String key, String value, bool forceCommit)
-{
-    if (!_nvs_valid)
-        return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_set_str(_nvs_handle, (char *)key.c_str(),
-                                value.c_str());
-    nvs_global_lock.unlock();
+    NvsWriteLocker locker(*_lock);
+    _gc_stats.runs++;
+    _gc_stats.free_entries = stats.free_entries;
+    // The forced switch is opt-in. With less than a page of free entries,
+    // erased ones included, there is no headroom to spend on scratch.
+    if (minPageFree == 0 || stats.free_entries < NVS_PAGE_ENTRIES + minPageFree)
+        return true;
+    size_t in_page;
+    if (!active_page_free(in_page) || in_page == 0 || in_page > minPageFree)
+        return true;
+
+    // One entry more than the page holds, the blob spills into a new page.
+    std::vector<uint8_t> scratch(in_page * 32, 0xff);
+    int64_t start = esp_timer_get_time();
+    err = nvs_set_blob(_nvs_handle, NVS_MAINT_KEY, scratch.data(), scratch.size());
+    if (err == ESP_OK)
+        err = nvs_erase_key(_nvs_handle, NVS_MAINT_KEY);
+    if (err == ESP_OK)
+        err = nvs_commit(_nvs_handle);
     if (err != ESP_OK)
     {
-        log_w("setString %s failed(%d).", key.c_str(), err);
+        log_w("maintain failed(%d).", err);
         return false;
     }
-    return forceCommit ? commit() : true;
+    _gc_stats.compactions++;
+    _gc_stats.compact_us += esp_timer_get_time() - start;
+    return true;
 }
 
-bool ArduinoNvs::setBlob(String key, uint8_t *blob, size_t length,
-                         bool forceCommit)
+ArduinoNvs::GcStats ArduinoNvs::gcStats()
 {
-    if (!_nvs_valid)
-        return false;
-    log_d("ArduinoNvs::setObjct(): set obj addr = [0x%X], length = [%d]\n",
-          (int32_t)blob, length);
-    if (length == 0)
+    NvsReadLocker locker(*_lock);
+    return _gc_stats;
+}
+
+ArduinoNvs::WriteStats ArduinoNvs::writeStats()
+{
+    NvsReadLocker locker(*_lock);
+    return _write_stats;
+}
+
+void ArduinoNvs::resetWriteStats()
+{
+    NvsWriteLocker locker(*_lock);
+    memset(&_write_stats, 0, sizeof(_write_stats));
+}
+
+bool ArduinoNvs::setValue(const char *key, nvs_type_t type, const void *data, size_t length,
+                          bool forceCommit)
+{
+    NvsOpTimer timer(this, METRIC_SET);
+    if (!ensureOpen())
         return false;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_set_blob(_nvs_handle, (char *)key.c_str(), blob,
-                                 length);
-    nvs_global_lock.unlock();
-    if (err)
+    if (_write_back)
+        return cacheWrite(key, type, data, length);
+    _lock->lock();
+    esp_err_t err = writeEntry(key, type, data, length);
+    _lock->unlock();
+    if (err != ESP_OK)
     {
-        log_d("ArduinoNvs::setObjct(): err = [0x%X]\n", err);
+        log_w("set %s failed(%d).", key, err);
         return false;
     }
     return forceCommit ? commit() : true;
 }
 
-bool ArduinoNvs::setBlob(String key, std::vector<uint8_t> &blob,
-                         bool forceCommit)
+bool ArduinoNvs::setInt(const char *key, uint8_t value, bool forceCommit)
 {
-    return setBlob(key, &blob[0], blob.size(), forceCommit);
+    return setValue(key, NVS_TYPE_U8, &value, sizeof(value), forceCommit);
 }
 
-int64_t ArduinoNvs::getInt(String key, int64_t default_value)
+bool ArduinoNvs::setInt(const char *key, int16_t value, bool forceCommit)
 {
-    uint8_t v_u8;
-    int16_t v_i16;
-    uint16_t v_u16;
-    int32_t v_i32;
-    uint32_t v_u32;
-    int64_t v_i64;
-    uint64_t v_u64;
-
-    esp_err_t err;
-    if (!_nvs_valid)
-        return false;
-    nvs_global_lock.lock();
-    err = nvs_get_u8(_nvs_handle, (char *)key.c_str(), &v_u8);
-    nvs_global_lock.unlock();
-    if (err == ESP_OK)
-        return (int64_t)v_u8;
-
-    nvs_global_lock.lock();
-    err = nvs_get_i16(_nvs_handle, (char *)key.c_str(), &v_i16);
-    nvs_global_lock.unlock();
-    if (err == ESP_OK)
-        return (int64_t)v_i16;
-
-    nvs_global_lock.lock();
-    err = nvs_get_u16(_nvs_handle, (char *)key.c_str(), &v_u16);
-    nvs_global_lock.unlock();
-    if (err == ESP_OK)
-        return (int64_t)v_u16;
+    return setValue(key, NVS_TYPE_I16, &value, sizeof(value), forceCommit);
+}
 
-    nvs_global_lock.lock();
-    err = nvs_get_i32(_nvs_handle, (char *)key.c_str(), &v_i32);
-    nvs_global_lock.unlock();
-    if (err == ESP_OK)
-        return (int64_t)v_i32;
+bool ArduinoNvs::setInt(const char *key, uint16_t value, bool forceCommit)
+{
+    return setValue(key, NVS_TYPE_U16, &value, sizeof(value), forceCommit);
+}
 
-    nvs_global_lock.lock();
-    err = nvs_get_u32(_nvs_handle, (char *)key.c_str(), &v_u32);
-    nvs_global_lock.unlock();
-    if (err == ESP_OK)
-        return (int64_t)v_u32;
+bool ArduinoNvs::setInt(const char *key, int32_t value, bool forceCommit)
+{
+    return setValue(key, NVS_TYPE_I32, &value, sizeof(value), forceCommit);
+}
 
-    nvs_global_lock.lock();
-    err = nvs_get_i64(_nvs_handle, (char *)key.c_str(), &v_i64);
-    nvs_global_lock.unlock();
-    if (err == ESP_OK)
-        return (int64_t)v_i64;
+bool ArduinoNvs::setInt(const char *key, uint32_t value, bool forceCommit)
+{
+    return setValue(key, NVS_TYPE_U32, &value, sizeof(value), forceCommit);
+}
 
-    nvs_global_lock.lock();
-    err = nvs_get_u64(_nvs_handle, (char *)key.c_str(), &v_u64);
-    nvs_global_lock.unlock();
-    if (err == ESP_OK)
-        return (int64_t)v_u64;
+bool ArduinoNvs::setInt(const char *key, int64_t value, bool forceCommit)
+{
+    return setValue(key, NVS_TYPE_I64, &value, sizeof(value), forceCommit);
+}
 
-    return default_value;
+bool ArduinoNvs::setInt(const char *key, uint64_t value, bool forceCommit)
+{
+    return setValue(key, NVS_TYPE_U64, &value, sizeof(value), forceCommit);
 }
 
-bool ArduinoNvs::getString(String key, String &res)
+/// Packed values: an NvsLzHeader followed by LZSS data. Each flag byte
+/// covers the next 8 items, a set bit is a literal byte, a clear bit a
+/// little endian u16 match: distance - 1 in the low 10 bits, length - 3 in
+/// the high 6.
+#define NVS_LZ_WINDOW 1024
+#define NVS_LZ_MIN_MATCH 3
+#define NVS_LZ_MAX_MATCH 66
+#define NVS_LZ_BLOB 'b'
+#define NVS_LZ_STRING 's'
+
+struct NvsLzHeader
 {
-    size_t required_size;
-    esp_err_t err;
+    uint8_t magic[3]; ///< "NVZ"
+    uint8_t kind;     ///< NVS_LZ_BLOB or NVS_LZ_STRING
+    uint32_t length;  ///< unpacked size, string terminator included
+};
 
-    if (!_nvs_valid)
-        return false;
-    nvs_global_lock.lock();
-    err = nvs_get_str(_nvs_handle, key.c_str(), NULL, &required_size);
-    nvs_global_lock.unlock();
-    if (err)
-        return false;
+static const uint8_t NVS_LZ_MAGIC[3] = {'N', 'V', 'Z'};
 
-    char value[required_size];
-    nvs_global_lock.lock();
-    err = nvs_get_str(_nvs_handle, key.c_str(), value, &required_size);
-    nvs_global_lock.unlock();
-    if (err)
-        return false;
-    res = value;
-    return true;
+/// Packs `length` bytes into `out`. Returns the packed size, 0 if it would
+/// exceed `limit`.
+static size_t lz_pack(const uint8_t *in, size_t length, uint8_t *out, size_t limit)
+{
+    size_t pos = 0, n = 0, flag_at = 0;
+    int bit = 8;
+    while (pos < length)
+    {
+        if (bit == 8)
+        {
+            if (n >= limit)
+                return 0;
+            flag_at = n++;
+            out[flag_at] = 0;
+            bit = 0;
+        }
+        // Brute force search, values are small and only packed on write.
+        size_t best_len = 0, best_dist = 0;
+        size_t start = pos > NVS_LZ_WINDOW ? pos - NVS_LZ_WINDOW : 0;
+        size_t max = length - pos < NVS_LZ_MAX_MATCH ? length - pos : NVS_LZ_MAX_MATCH;
+        for (size_t i = start; i < pos && best_len < max; i++)
+        {
+            size_t l = 0;
+            while (l < max && in[i + l] == in[pos + l])
+                l++;
+            if (l > best_len)
+            {
+                best_len = l;
+                best_dist = pos - i;
+            }
+        }
+        if (best_len >= NVS_LZ_MIN_MATCH)
+        {
+            if (n + 2 > limit)
+                return 0;
+            uint16_t token = (best_dist - 1) | ((best_len - NVS_LZ_MIN_MATCH) << 10);
+            out[n++] = token & 0xff;
+            out[n++] = token >> 8;
+            pos += best_len;
+        }
+        else
+        {
+            if (n + 1 > limit)
+                return 0;
+            out[flag_at] |= 1 << bit;
+            out[n++] = in[pos++];
+        }
+        bit++;
+    }
+    return n;
 }
 
-String ArduinoNvs::getString(String key)
+/// Unpacked size of a packed value of `kind`, 0 if `data` is not one.
+static size_t lz_length(const uint8_t *data, size_t size, uint8_t kind)
 {
-    static String res;
-    bool ok = getString(key, res);
-    if (!ok)
-        return String();
-    return res;
+    NvsLzHeader hdr;
+    if (size < sizeof(hdr))
+        return 0;
+    memcpy(&hdr, data, sizeof(hdr));
+    if (memcmp(hdr.magic, NVS_LZ_MAGIC, sizeof(hdr.magic)) != 0 || hdr.kind != kind)
+        return 0;
+    return hdr.length;
 }
 
-size_t ArduinoNvs::getBlobSize(String key)
+/// Unpacks a value checked by lz_length() into `out`, which holds at least
+/// that many bytes. Fails unless the data decodes to exactly that size.
+static bool lz_unpack(const uint8_t *data, size_t size, uint8_t *out)
 {
-    size_t required_size;
-    if (!_nvs_valid)
-        return 0;
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_get_blob(_nvs_handle, key.c_str(), NULL,
-                                 &required_size);
-    nvs_global_lock.unlock();
-    if (err)
+    NvsLzHeader hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    const uint8_t *p = data + sizeof(hdr), *end = data + size;
+    size_t n = 0;
+    while (p < end)
     {
-        if (err != ESP_ERR_NVS_NOT_FOUND) // key_not_found is not an error, just return size 0
-            log_d("ArduinoNvs::getBlobSize(): err = [0x%X]\n", err);
-        return 0;
+        uint8_t flags = *p++;
+        for (int bit = 0; bit < 8 && p < end; bit++)
+        {
+            if (flags & (1 << bit))
+            {
+                if (n >= hdr.length)
+                    return false;
+                out[n++] = *p++;
+                continue;
+            }
+            if (end - p < 2)
+                return false;
+            uint16_t token = p[0] | (p[1] << 8);
+            p += 2;
+            size_t dist = (token & (NVS_LZ_WINDOW - 1)) + 1;
+            size_t len = (token >> 10) + NVS_LZ_MIN_MATCH;
+            if (dist > n || len > hdr.length - n)
+                return false;
+            // Byte by byte, matches may overlap what they produce.
+            for (size_t i = 0; i < len; i++, n++)
+                out[n] = out[n - dist];
+        }
     }
-    return required_size;
+    return n == hdr.length;
 }
 
-bool ArduinoNvs::getBlob(String key, uint8_t *blob, size_t length)
+static bool read_blob(nvs_handle handle, const char *key, std::vector<uint8_t> &out)
 {
-    if (length == 0)
-        return false;
-    if (!_nvs_valid)
+    size_t size = 0;
+    if (nvs_get_blob(handle, key, NULL, &size) != ESP_OK || size == 0)
         return false;
+    out.resize(size);
+    return nvs_get_blob(handle, key, out.data(), &size) == ESP_OK;
+}
 
-    size_t required_size = getBlobSize(key);
-    if (required_size == 0)
-        return false;
-    if (length < required_size)
+/// getString() of a packed string of `n` bytes, `length` is set to the
+/// size needed. False when `n` is 0, i.e. the value is not one.
+static bool unpack_str(const uint8_t *data, size_t size, size_t n, char *value, size_t &length)
+{
+    if (n == 0)
         return false;
+    bool fits = n <= length;
+    length = n;
+    return fits && lz_unpack(data, size, (uint8_t *)value) && value[n - 1] == 0;
+}
 
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_get_blob(_nvs_handle, key.c_str(), blob,
-                                 &required_size);
-    nvs_global_lock.unlock();
-    if (err)
-    {
-        log_d("ArduinoNvs::getBlob(): get object err = [0x%X]\n", err);
+static bool unpack_str(const uint8_t *data, size_t size, size_t n, String &res)
+{
+    if (n == 0)
         return false;
-    }
+    std::vector<uint8_t> out(n);
+    if (!lz_unpack(data, size, out.data()) || out[n - 1] != 0)
+        return false;
+    res = (const char *)out.data();
     return true;
 }
 
-bool ArduinoNvs::getBlob(String key, std::vector<uint8_t> &blob)
+/// Stored blob bytes to the caller's buffer, unpacked to `n` bytes when
+/// that is not 0.
+static bool copy_blob(const uint8_t *data, size_t size, size_t n, uint8_t *blob, size_t length)
 {
-    size_t required_size = getBlobSize(key);
-    if (required_size == 0)
+    if (n)
+        return n <= length && lz_unpack(data, size, blob);
+    if (size > length)
         return false;
+    memcpy(blob, data, size);
+    return true;
+}
 
-    blob.resize(required_size);
-    nvs_global_lock.lock();
-    esp_err_t err = nvs_get_blob(_nvs_handle, key.c_str(), &blob[0],
-                                 &required_size);
-    nvs_global_lock.unlock();
-    if (err)
+static bool assign_blob(const uint8_t *data, size_t size, size_t n, std::vector<uint8_t> &blob)
+{
+    if (n == 0)
     {
-        log_d("ArduinoNvs::getBlob(): get object err = [0x%X]\n", err);
-        return false;
+        blob.assign(data, data + size);
+        return true;
     }
-    return true;
+    blob.resize(n);
+    return lz_unpack(data, size, blob.data());
 }
 
-std::vector<uint8_t> ArduinoNvs::getBlob(String key)
+void ArduinoNvs::setCompression(bool enable, size_t minLength)
 {
-    std::vector<uint8_t> res;
-    bool ok = getBlob(key, res);
-    if (!ok)
-        res.clear();
-    return res;
+    _compress = enable;
+    _compress_min = minLength;
 }
 
-bool ArduinoNvs::setFloat(String key, float value, bool forceCommit)
+ArduinoNvs::CompressStats ArduinoNvs::compressStats()
 {
-    return setBlob(key, (uint8_t *)&value, sizeof(float), forceCommit);
+    NvsReadLocker locker(*_lock);
+    return _compress_stats;
 }
 
-float ArduinoNvs::getFloat(String key, float default_value)
+/// Fills `out` with the packed form of a value. Unless `force`d, false when
+/// compression is off, the value is short or packing does not save space.
+/// Touches no member state, runs without `_lock`.
+bool ArduinoNvs::pack(uint8_t kind, const void *data, size_t length, bool force, std::vector<uint8_t> &out)
 {
-    std::vector<uint8_t> res(sizeof(float));
-    if (!getBlob(key, res))
-        return default_value;
-    return *(float *)(&res[0]);
+    if (!force && (!_compress || length < _compress_min || length <= sizeof(NvsLzHeader)))
+        return false;
+    NvsLzHeader hdr;
+    memcpy(hdr.magic, NVS_LZ_MAGIC, sizeof(hdr.magic));
+    hdr.kind = kind;
+    hdr.length = length;
+    // Forced, the worst case is all literals plus a flag byte per 8.
+    size_t limit = force ? length + (length + 7) / 8 : length - sizeof(hdr) - 1;
+    out.resize(sizeof(hdr) + limit);
+    memcpy(out.data(), &hdr, sizeof(hdr));
+    size_t n = lz_pack((const uint8_t *)data, length, out.data() + sizeof(hdr), limit);
+    if (n == 0)
+        return false;
+    out.resize(sizeof(hdr) + n);
+    return true;
+}
+
+/// Caller holds `_lock`. Marker stored under `key`'s marker name, which
+/// may belong to another key.
+bool ArduinoNvs::readMarker(const char *key, uint64_t &marker)
+{
+    char mkey[NVS_KEY_NAME_MAX_SIZE];
+    marker_key(mkey, key);
+    CacheEntry *e = _write_back ? findCached(mkey) : NULL;
+    if (e)
+    {
+        marker = e->num;
+        return e->type == NVS_TYPE_U64;
+    }
+    const NvsSnapshotEntry *s;
+    switch (snapshotLookup(mkey, &s))
+    {
+    case SNAPSHOT_HIT:
+        marker = s->num;
+        return s->type == NVS_TYPE_U64;
+    case SNAPSHOT_ABSENT:
+        return false;
+    default:
+        return nvs_get_u64(_nvs_handle, mkey, &marker) == ESP_OK;
+    }
+}
+
+/// Caller holds `_lock`. Kind `key` was last stored packed as, with its
+/// unpacked size in `length`, or 0 for a plain value.
+uint8_t ArduinoNvs::packedKind(const char *key, uint32_t *length)
+{
+    uint64_t marker;
+    if (!readMarker(key, marker) || (marker >> 40) != marker_owner(key))
+        return 0;
+    if (length)
+        *length = (uint32_t)marker;
+    return (uint8_t)(marker >> 32);
+}
+
+/// Caller holds `_lock`. Unpacked size of `key` stored as `type` and
+/// `data`, 0 unless it is packed as `kind`.
+size_t ArduinoNvs::packedLength(const char *key, nvs_type_t type, const uint8_t *data, size_t size, uint8_t kind)
+{
+    if (type != NVS_TYPE_BLOB)
+        return 0;
+    size_t n = lz_length(data, size, kind);
+    return n && packedKind(key, NULL) == kind ? n : 0;
+}
+
+/// Caller holds `_lock`.
+bool ArduinoNvs::storedAsString(const char *key)
+{
+    CacheEntry *e = _write_back ? findCached(key) : NULL;
+    if (e)
+        return e->type == NVS_TYPE_STR;
+    const NvsSnapshotEntry *s;
+    switch (snapshotLookup(key, &s))
+    {
+    case SNAPSHOT_HIT:
+        return s->type == NVS_TYPE_STR;
+    case SNAPSHOT_ABSENT:
+        return false;
+    default:
+    {
+        size_t length = 0;
+        return nvs_get_str(_nvs_handle, key, NULL, &length) == ESP_OK;
+    }
+    }
+}
+
+/// Stores a string or blob, packed when that saves space. A key keeps its
+/// NVS type, which NVS cannot change in place: a plain string is not packed
+/// and a packed string stays in its blob, framed without compression once
+/// it no longer packs. The marker is written before a packed value and a
+/// stale one erased after a plain value, all under one lock so concurrent
+/// setters of the key cannot mix up value and marker.
+bool ArduinoNvs::setVar(const char *key, nvs_type_t type, uint8_t kind, const void *data, size_t length,
+                        bool forceCommit)
+{
+    NvsOpTimer timer(this, METRIC_SET);
+    if (!ensureOpen())
+        return false;
+    char mkey[NVS_KEY_NAME_MAX_SIZE];
+    marker_key(mkey, key);
+    // Packed without the lock, only the rare forced framing is done under it.
+    std::vector<uint8_t> packed;
+    bool packs = pack(kind, data, length, false, packed);
+    for (;;)
+    {
+        {
+            NvsWriteLocker locker(*_lock);
+            if (!_write_back || cacheRoom(key, mkey))
+            {
+                uint64_t marker = 0;
+                bool has_marker = readMarker(key, marker);
+                bool plain_str = _compress && length >= _compress_min && storedAsString(key);
+                bool owned = has_marker && (marker >> 40) == marker_owner(key);
+                bool force = owned && type == NVS_TYPE_STR && (uint8_t)(marker >> 32) == kind;
+                esp_err_t err;
+                if ((owned || !has_marker) && !plain_str && (packs || (force && pack(kind, data, length, true, packed))))
+                {
+                    uint64_t value = marker_value(key, kind, length);
+                    err = owned && value == marker ? ESP_OK : putLocked(mkey, NVS_TYPE_U64, &value, sizeof(value));
+                    if (err == ESP_OK)
+                        err = putLocked(key, NVS_TYPE_BLOB, packed.data(), packed.size());
+                    if (err == ESP_OK)
+                    {
+                        _compress_stats.values++;
+                        _compress_stats.raw_bytes += length;
+                        _compress_stats.stored_bytes += packed.size();
+                    }
+                }
+                else
+                {
+                    err = putLocked(key, type, data, length);
+                    if (err == ESP_OK && owned)
+                        err = putLocked(mkey, NVS_TYPE_ANY, NULL, 0);
+                }
+                if (err != ESP_OK)
+                {
+                    log_w("set %s failed(%d).", key, err);
+                    return false;
+                }
+                break;
+            }
+        }
+        if (!makeCacheRoom())
+            return false;
+    }
+    if (_write_back)
+        return cacheCommit();
+    return forceCommit ? commit() : true;
+}
+
+/// Caller holds `_lock` exclusively. Stores `key`, or erases it for
+/// NVS_TYPE_ANY, on flash or in the cache while write-back is on; the
+/// caller made room there.
+esp_err_t ArduinoNvs::putLocked(const char *key, nvs_type_t type, const void *data, size_t length)
+{
+    if (_write_back)
+    {
+        cachePut(key, type, data, length);
+        return ESP_OK;
+    }
+    if (type != NVS_TYPE_ANY)
+        return writeEntry(key, type, data, length);
+    esp_err_t err = nvs_erase_key(_nvs_handle, key);
+    cacheType(key, NVS_TYPE_ANY);
+    snapshotInvalidate(key, true);
+    _write_stats.erases++;
+    return err;
+}
+
+bool ArduinoNvs::setString(const char *key, const char *value, bool forceCommit)
+{
+    return setVar(key, NVS_TYPE_STR, NVS_LZ_STRING, value, strlen(value) + 1, forceCommit);
+}
+
+bool ArduinoNvs::setBlob(const char *key, const uint8_t *blob, size_t length,
+                         bool forceCommit)
+{
+    log_d("ArduinoNvs::setObjct(): set obj addr = [%p], length = [%u]\n",
+          blob, (unsigned)length);
+    if (length == 0)
+        return false;
+    return setVar(key, NVS_TYPE_BLOB, NVS_LZ_BLOB, blob, length, forceCommit);
+}
+
+bool ArduinoNvs::setBlob(const char *key, const std::vector<uint8_t> &blob,
+                         bool forceCommit)
+{
+    return setBlob(key, blob.data(), blob.size(), forceCommit);
+}
+
+/// Runs on the timer service task, which must not block on flash. The
+/// flush itself is done by the writer task.
+void ArduinoNvs::flushTimerCb(TimerHandle_t timer)
+{
+    ArduinoNvs *nvs = (ArduinoNvs *)pvTimerGetTimerID(timer);
+    nvs->requestFlush();
+}
+
+static void timer_sync_cb(void *sem, uint32_t)
+{
+    xSemaphoreGive((SemaphoreHandle_t)sem);
+}
+
+/// `xTimerDelete()` only queues the command, the callback may still be
+/// running. The timer task handles pended calls in order, so once ours
+/// ran the callback has returned and the timer is gone.
+void ArduinoNvs::deleteFlushTimer()
+{
+    _lock->lock();
+    TimerHandle_t timer = _flush_timer;
+    _flush_timer = NULL;
+    _lock->unlock();
+    if (!timer)
+        return;
+    xTimerDelete(timer, portMAX_DELAY);
+    SemaphoreHandle_t done = xSemaphoreCreateBinary();
+    if (done && xTimerPendFunctionCall(timer_sync_cb, done, 0, portMAX_DELAY) == pdPASS)
+        xSemaphoreTake(done, portMAX_DELAY);
+    else
+        log_w("flush timer delete not confirmed.");
+    if (done)
+        vSemaphoreDelete(done);
+}
+
+bool ArduinoNvs::setWriteBack(bool enable, size_t dirtyThreshold, uint32_t flushIntervalMs)
+{
+    if (!enable)
+    {
+        if (_async)
+            setAsync(false);
+        if (_write_back && !commit())
+            return false;
+        deleteFlushTimer();
+        stopWriter();
+        _lock->lock();
+        _write_back = false;
+        _cache.clear();
+        _dirty_count = 0;
+        _lock->unlock();
+        return true;
+    }
+
+    if (flushIntervalMs && !_writer && !startWriter(-1, 1, 4096))
+        return false;
+    if (flushIntervalMs && !_flush_timer)
+    {
+        TimerHandle_t timer = xTimerCreate("nvs_flush", pdMS_TO_TICKS(flushIntervalMs), pdFALSE,
+                                           this, flushTimerCb);
+        if (!timer)
+            log_w("flush timer create failed.");
+        _lock->lock();
+        _flush_timer = timer;
+        _lock->unlock();
+    }
+    else if (flushIntervalMs)
+        xTimerChangePeriod(_flush_timer, pdMS_TO_TICKS(flushIntervalMs), portMAX_DELAY);
+    else
+    {
+        deleteFlushTimer();
+        if (!_async)
+            stopWriter();
+    }
+
+    _lock->lock();
+    _dirty_threshold = dirtyThreshold;
+    _write_back = true;
+    _lock->unlock();
+    return true;
+}
+
+bool ArduinoNvs::setAsync(bool enable, BaseType_t core, UBaseType_t priority, uint32_t stackSize)
+{
+    if (!enable)
+    {
+        if (!_async)
+            return true;
+        // Setters fall back to synchronous commits before the writer goes
+        // away. The flush timer keeps a writer with default placement.
+        _async = false;
+        stopWriter();
+        if (_flush_timer && !startWriter(-1, 1, 4096))
+            log_w("flush timer has no writer.");
+        return _dirty_count ? commit() : true;
+    }
+
+    if (_async)
+        return true;
+    if (!ensureOpen() || (!_write_back && !setWriteBack(true)))
+        return false;
+    // Restarted with the requested placement if the flush timer made one.
+    stopWriter();
+    if (!startWriter(core, priority, stackSize))
+        return false;
+    _async = true;
+    return true;
+}
+
+/// The writer flushes through `commitNow()`, which only takes the namespace
+/// lock to copy the dirty keys out and to mark them clean.
+bool ArduinoNvs::startWriter(BaseType_t core, UBaseType_t priority, uint32_t stackSize)
+{
+    _async_sem = xSemaphoreCreateBinary();
+    _writer_exit = xSemaphoreCreateBinary();
+    _writer_stop = false;
+    if (!_async_sem || !_writer_exit
+        || xTaskCreateUniversal(writerTask, "nvs_writer", stackSize, this, priority, &_writer, core) != pdPASS)
+    {
+        log_e("nvs writer task create failed.");
+        if (_async_sem)
+            vSemaphoreDelete(_async_sem);
+        if (_writer_exit)
+            vSemaphoreDelete(_writer_exit);
+        _async_sem = NULL;
+        _writer_exit = NULL;
+        _writer = NULL;
+        return false;
+    }
+    return true;
+}
+
+void ArduinoNvs::stopWriter()
+{
+    if (!_writer)
+        return;
+    _writer_stop = true;
+    xTaskNotifyGive(_writer);
+    xSemaphoreTake(_writer_exit, portMAX_DELAY);
+    vSemaphoreDelete(_writer_exit);
+    _writer_exit = NULL;
+    // Woken waiters find no writer and leave, the last one out lets the
+    // semaphore go.
+    while (_async_waiters.load())
+    {
+        xSemaphoreGive(_async_sem);
+        vTaskDelay(1);
+    }
+    vSemaphoreDelete(_async_sem);
+    _async_sem = NULL;
+}
+
+ArduinoNvs::Ticket ArduinoNvs::commitAsync()
+{
+    return _async ? requestFlush() : 0;
+}
+
+ArduinoNvs::Ticket ArduinoNvs::requestFlush()
+{
+    TaskHandle_t writer = _writer;
+    if (!writer)
+        return 0;
+    Ticket ticket = _async_requested.fetch_add(1) + 1;
+    if (ticket == 0)
+        ticket = _async_requested.fetch_add(1) + 1;
+    xTaskNotifyGive(writer);
+    return ticket;
+}
+
+bool ArduinoNvs::isDone(Ticket ticket)
+{
+    return (int32_t)(_async_done.load() - ticket) >= 0;
+}
+
+bool ArduinoNvs::waitFor(Ticket ticket, uint32_t timeoutMs)
+{
+    // Converted in 64 bit, pdMS_TO_TICKS() overflows for long timeouts.
+    uint64_t limit = (uint64_t)timeoutMs * configTICK_RATE_HZ / 1000;
+    bool forever = timeoutMs == portMAX_DELAY || limit >= portMAX_DELAY;
+    TickType_t start = xTaskGetTickCount();
+    // Counted, stopWriter() keeps `_async_sem` until every waiter left.
+    _async_waiters++;
+    bool done;
+    while (!(done = isDone(ticket)))
+    {
+        if (!_writer)
+            break;
+        if (!forever && xTaskGetTickCount() - start >= limit)
+            break;
+        // Every waiter shares the one semaphore, wake up now and then in
+        // case another waiter took the give.
+        xSemaphoreTake(_async_sem, pdMS_TO_TICKS(10));
+    }
+    _async_waiters--;
+    return done;
+}
+
+void ArduinoNvs::writerTask(void *param)
+{
+    ArduinoNvs *nvs = (ArduinoNvs *)param;
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t target = nvs->_async_requested.load();
+        if (target != nvs->_async_done.load())
+        {
+            esp_err_t err = nvs->commitNow();
+            nvs->_async_error = err;
+            nvs->_async_done = target;
+            xSemaphoreGive(nvs->_async_sem);
+            AsyncDoneCb cb = nvs->_async_cb;
+            if (cb)
+                cb(nvs, target, err);
+        }
+        if (nvs->_writer_stop)
+            break;
+    }
+    nvs->_writer = NULL;
+    xSemaphoreGive(nvs->_writer_exit);
+    vTaskDelete(NULL);
+}
+
+/// Caller holds `_lock`.
+ArduinoNvs::CacheEntry *ArduinoNvs::findCached(const char *key)
+{
+    for (size_t i = 0; i < _cache.size(); i++)
+    {
+        if (strncmp(_cache[i].key, key, NVS_KEY_NAME_MAX_SIZE) == 0)
+            return &_cache[i];
+    }
+    return NULL;
+}
+
+static bool cache_equal(const ArduinoNvs::CacheEntry &e, nvs_type_t type, const void *data, size_t length)
+{
+    if (e.type != type)
+        return false;
+    if (type == NVS_TYPE_ANY)
+        return true;
+    if (is_int_type(type))
+        return memcmp(&e.num, data, int_size(type)) == 0;
+    return e.data.size() == length && memcmp(e.data.data(), data, length) == 0;
+}
+
+/// Called by the flush without `_lock`, only reads flash. Costs one read,
+/// which is far cheaper than rewriting an unchanged value.
+bool ArduinoNvs::sameAsStored(const char *key, nvs_type_t type, const void *data, size_t length)
+{
+    if (is_int_type(type))
+    {
+        int64_t stored;
+        uint64_t raw = 0;
+        memcpy(&raw, data, int_size(type));
+        return getIntAs(key, type, &stored) == ESP_OK && stored == int_from_raw(type, raw);
+    }
+    if (type != NVS_TYPE_STR && type != NVS_TYPE_BLOB)
+        return false;
+
+    size_t stored_len = 0;
+    esp_err_t err = type == NVS_TYPE_STR
+                        ? nvs_get_str(_nvs_handle, key, NULL, &stored_len)
+                        : nvs_get_blob(_nvs_handle, key, NULL, &stored_len);
+    if (err != ESP_OK || stored_len != length)
+        return false;
+    std::vector<uint8_t> stored(stored_len);
+    err = type == NVS_TYPE_STR
+              ? nvs_get_str(_nvs_handle, key, (char *)stored.data(), &stored_len)
+              : nvs_get_blob(_nvs_handle, key, stored.data(), &stored_len);
+    return err == ESP_OK && memcmp(stored.data(), data, length) == 0;
+}
+
+static void cache_assign(ArduinoNvs::CacheEntry &e, nvs_type_t type, const void *data, size_t length)
+{
+    e.type = type;
+    e.num = 0;
+    if (is_int_type(type))
+    {
+        memcpy(&e.num, data, int_size(type));
+        e.data.clear();
+    }
+    else if (type == NVS_TYPE_ANY)
+        e.data.clear();
+    else
+        e.data.assign((const uint8_t *)data, (const uint8_t *)data + length);
+}
+
+/// Caller holds `_lock` exclusively.
+void ArduinoNvs::evictClean()
+{
+    size_t n = 0;
+    for (size_t i = 0; i < _cache.size(); i++)
+    {
+        if (!_cache[i].dirty)
+            continue;
+        if (n != i)
+            _cache[n] = std::move(_cache[i]);
+        n++;
+    }
+    _cache.resize(n);
+}
+
+bool ArduinoNvs::cacheWrite(const char *key, nvs_type_t type, const void *data, size_t length)
+{
+    if (strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+    {
+        log_w("key `%s` too long.", key);
+        return false;
+    }
+
+    for (;;)
+    {
+        {
+            NvsWriteLocker locker(*_lock);
+            if (cacheRoom(key, NULL))
+            {
+                cachePut(key, type, data, length);
+                break;
+            }
+        }
+        if (!makeCacheRoom())
+            return false;
+    }
+    return cacheCommit();
+}
+
+/// Caller holds `_lock` exclusively. True when `key` and `other` (may be
+/// NULL) fit the cache, clean entries are evicted to make room.
+bool ArduinoNvs::cacheRoom(const char *key, const char *other)
+{
+    size_t need = (findCached(key) ? 0 : 1) + (other && !findCached(other) ? 1 : 0);
+    if (_cache.size() + need > ARDUINONVS_CACHE_MAX_ENTRIES)
+        evictClean();
+    return _cache.size() + need <= ARDUINONVS_CACHE_MAX_ENTRIES;
+}
+
+/// Caller holds `_lock` exclusively and made room with `cacheRoom()`.
+void ArduinoNvs::cachePut(const char *key, nvs_type_t type, const void *data, size_t length)
+{
+    CacheEntry *e = findCached(key);
+    if (e && cache_equal(*e, type, data, length))
+        return;
+    if (!e)
+    {
+        _cache.emplace_back();
+        e = &_cache.back();
+        strncpy(e->key, key, NVS_KEY_NAME_MAX_SIZE - 1);
+        e->key[NVS_KEY_NAME_MAX_SIZE - 1] = '\0';
+        e->dirty = false;
+    }
+    cache_assign(*e, type, data, length);
+    e->seq = ++_cache_seq;
+    if (!e->dirty)
+    {
+        e->dirty = true;
+        if (++_dirty_count == 1 && _flush_timer)
+            xTimerReset(_flush_timer, 0);
+    }
+}
+
+/// The cache is full of dirty keys: writes them out, on the writer task in
+/// async mode, and waits for it.
+bool ArduinoNvs::makeCacheRoom()
+{
+    esp_err_t err = ESP_FAIL;
+    if (_async)
+    {
+        Ticket ticket = requestFlush();
+        if (ticket && waitFor(ticket))
+            err = _async_error;
+    }
+    else
+        err = commitNow();
+    if (err != ESP_OK)
+    {
+        log_w("cache flush failed(%d).", err);
+        return false;
+    }
+    return true;
+}
+
+/// Flushes once `_dirty_threshold` keys are pending, call without `_lock`.
+bool ArduinoNvs::cacheCommit()
+{
+    if (!_dirty_threshold || _dirty_count < _dirty_threshold)
+        return true;
+    return _async ? commitAsync() != 0 : commit();
+}
+
+/// Copies the dirty entries out under `_lock`, writes and commits them with
+/// it released, then marks clean the entries that were not set again
+/// meanwhile. Failed entries stay dirty for the next flush.
+esp_err_t ArduinoNvs::flushCache()
+{
+    FEmbed::OSMutexLocker flush_locker(_flush_lock);
+    std::vector<CacheEntry> ops;
+    {
+        NvsReadLocker locker(*_lock);
+        for (size_t i = 0; i < _cache.size(); i++)
+        {
+            if (_cache[i].dirty)
+                ops.push_back(_cache[i]);
+        }
+    }
+
+    std::vector<esp_err_t> errs(ops.size(), ESP_OK);
+    std::vector<int64_t> times(ops.size(), -1); // -1 when unchanged on flash
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        CacheEntry &op = ops[i];
+        int64_t start = esp_timer_get_time();
+        if (op.type == NVS_TYPE_ANY)
+        {
+            errs[i] = nvs_erase_key(_nvs_handle, op.key);
+            if (errs[i] == ESP_ERR_NVS_NOT_FOUND)
+                errs[i] = ESP_OK;
+        }
+        else
+        {
+            const void *data = is_int_type(op.type) ? (const void *)&op.num : op.data.data();
+            size_t length = is_int_type(op.type) ? int_size(op.type) : op.data.size();
+            if (sameAsStored(op.key, op.type, data, length))
+                continue;
+            errs[i] = write_raw(_nvs_handle, op.key, op.type, data, length);
+        }
+        times[i] = esp_timer_get_time() - start;
+    }
+    int64_t start = esp_timer_get_time();
+    esp_err_t commit_err = nvs_commit(_nvs_handle);
+    int64_t commit_us = esp_timer_get_time() - start;
+
+    NvsWriteLocker locker(*_lock);
+    _write_stats.commits++;
+    _write_stats.commit_us += commit_us;
+    esp_err_t result = ESP_OK;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        CacheEntry &op = ops[i];
+        if (errs[i] != ESP_OK)
+        {
+            log_w("flush %s failed(%d).", op.key, errs[i]);
+            result = errs[i];
+            continue;
+        }
+        if (op.type == NVS_TYPE_ANY)
+        {
+            cacheType(op.key, NVS_TYPE_ANY);
+            snapshotInvalidate(op.key, true);
+            _write_stats.erases++;
+        }
+        else if (times[i] >= 0)
+        {
+            if (is_int_type(op.type))
+                cacheType(op.key, op.type);
+            countSet(op.key, op.type, is_int_type(op.type) ? int_size(op.type) : op.data.size(), times[i]);
+            snapshotInvalidate(op.key, false);
+        }
+        CacheEntry *e = findCached(op.key);
+        if (e && e->dirty && e->seq == op.seq)
+        {
+            e->dirty = false;
+            _dirty_count--;
+        }
+    }
+
+    // Erases are on flash now, reads can go there again.
+    size_t n = 0;
+    for (size_t i = 0; i < _cache.size(); i++)
+    {
+        if (_cache[i].type == NVS_TYPE_ANY && !_cache[i].dirty)
+            continue;
+        if (n != i)
+            _cache[n] = std::move(_cache[i]);
+        n++;
+    }
+    _cache.resize(n);
+    if (_dirty_count == 0 && _flush_timer)
+        xTimerStop(_flush_timer, 0);
+    return result == ESP_OK ? commit_err : result;
+}
+
+/// Caller holds `_flush_lock` and `_lock` exclusively. Writes every dirty
+/// cache entry, the caller commits.
+esp_err_t ArduinoNvs::flushLocked()
+{
+    esp_err_t result = ESP_OK;
+    for (size_t i = 0; i < _cache.size(); i++)
+    {
+        CacheEntry &e = _cache[i];
+        if (!e.dirty)
+            continue;
+        esp_err_t err;
+        if (e.type == NVS_TYPE_ANY)
+        {
+            err = nvs_erase_key(_nvs_handle, e.key);
+            if (err == ESP_ERR_NVS_NOT_FOUND)
+                err = ESP_OK;
+            cacheType(e.key, NVS_TYPE_ANY);
+            snapshotInvalidate(e.key, true);
+            _write_stats.erases++;
+        }
+        else if (is_int_type(e.type))
+            err = writeEntry(e.key, e.type, &e.num, int_size(e.type));
+        else
+            err = writeEntry(e.key, e.type, e.data.data(), e.data.size());
+        if (err != ESP_OK)
+        {
+            log_w("flush %s failed(%d).", e.key, err);
+            result = err;
+            continue;
+        }
+        e.dirty = false;
+        _dirty_count--;
+    }
+
+    // Erases are on flash now, reads can go there again.
+    size_t n = 0;
+    for (size_t i = 0; i < _cache.size(); i++)
+    {
+        if (_cache[i].type == NVS_TYPE_ANY && !_cache[i].dirty)
+            continue;
+        if (n != i)
+            _cache[n] = std::move(_cache[i]);
+        n++;
+    }
+    _cache.resize(n);
+    if (_dirty_count == 0 && _flush_timer)
+        xTimerStop(_flush_timer, 0);
+    return result;
+}
+
+// Type cache slots pack the upper 24 hash bits with the 8 bit nvs_type_t so
+// concurrent readers can update them without tearing. A false hit only
+// costs one failed lookup.
+nvs_type_t ArduinoNvs::cachedType(const char *key)
+{
+    uint32_t h = key_hash(key);
+    uint32_t e = _type_cache[h & (ARDUINONVS_TYPE_CACHE_SIZE - 1)].load(std::memory_order_relaxed);
+    if ((e & 0xff) == 0 || (e >> 8) != (h >> 8))
+        return NVS_TYPE_ANY;
+    return (nvs_type_t)(e & 0xff);
+}
+
+void ArduinoNvs::cacheType(const char *key, nvs_type_t type)
+{
+    uint32_t h = key_hash(key);
+    std::atomic<uint32_t> &e = _type_cache[h & (ARDUINONVS_TYPE_CACHE_SIZE - 1)];
+    if (type == NVS_TYPE_ANY)
+    {
+        if ((e.load(std::memory_order_relaxed) >> 8) == (h >> 8))
+            e.store(0, std::memory_order_relaxed);
+        return;
+    }
+    e.store((h & 0xffffff00) | type, std::memory_order_relaxed);
+}
+
+void ArduinoNvs::clearTypeCache()
+{
+    for (size_t i = 0; i < ARDUINONVS_TYPE_CACHE_SIZE; i++)
+        _type_cache[i].store(0, std::memory_order_relaxed);
+}
+
+/// Only reads flash, the flush calls it without `_lock`.
+esp_err_t ArduinoNvs::getIntAs(const char *key, nvs_type_t type, int64_t *value)
+{
+    esp_err_t err;
+    switch (type)
+    {
+    case NVS_TYPE_U8:
+    {
+        uint8_t v;
+        err = nvs_get_u8(_nvs_handle, key, &v);
+        *value = v;
+        break;
+    }
+    case NVS_TYPE_I8:
+    {
+        int8_t v;
+        err = nvs_get_i8(_nvs_handle, key, &v);
+        *value = v;
+        break;
+    }
+    case NVS_TYPE_U16:
+    {
+        uint16_t v;
+        err = nvs_get_u16(_nvs_handle, key, &v);
+        *value = v;
+        break;
+    }
+    case NVS_TYPE_I16:
+    {
+        int16_t v;
+        err = nvs_get_i16(_nvs_handle, key, &v);
+        *value = v;
+        break;
+    }
+    case NVS_TYPE_U32:
+    {
+        uint32_t v;
+        err = nvs_get_u32(_nvs_handle, key, &v);
+        *value = v;
+        break;
+    }
+    case NVS_TYPE_I32:
+    {
+        int32_t v;
+        err = nvs_get_i32(_nvs_handle, key, &v);
+        *value = v;
+        break;
+    }
+    case NVS_TYPE_U64:
+    {
+        uint64_t v;
+        err = nvs_get_u64(_nvs_handle, key, &v);
+        *value = (int64_t)v;
+        break;
+    }
+    case NVS_TYPE_I64:
+        err = nvs_get_i64(_nvs_handle, key, value);
+        break;
+    default:
+        err = ESP_ERR_NVS_TYPE_MISMATCH;
+        break;
+    }
+    return err;
+}
+
+/// Reads an integer entry of exactly `type` into `raw`, which is
+/// `int_size(type)` bytes.
+bool ArduinoNvs::getTyped(const char *key, nvs_type_t type, void *raw)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    int64_t value;
+
+    if (!ensureOpen())
+        return false;
+    NvsReadLocker locker(*_lock);
+    CacheEntry *e = _write_back ? findCached(key) : NULL;
+    if (e)
+    {
+        if (e->type != type)
+            return false;
+        memcpy(raw, &e->num, int_size(type));
+        return true;
+    }
+    const NvsSnapshotEntry *s;
+    switch (snapshotLookup(key, &s))
+    {
+    case SNAPSHOT_HIT:
+        if (s->type != type)
+            return false;
+        memcpy(raw, &s->num, int_size(type));
+        return true;
+    case SNAPSHOT_ABSENT:
+        return false;
+    default:
+        break;
+    }
+    if (getIntAs(key, type, &value) != ESP_OK)
+        return false;
+    // Little endian, the low bytes hold the value for any signedness.
+    memcpy(raw, &value, int_size(type));
+    return true;
+}
+
+int64_t ArduinoNvs::getInt(const char *key, int64_t default_value)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    if (!ensureOpen())
+        return false;
+    NvsReadLocker locker(*_lock);
+    nvs_type_t type;
+    int64_t value;
+    return findInt(key, type, value) ? value : default_value;
+}
+
+nvs_type_t ArduinoNvs::getIntType(const char *key)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    if (!ensureOpen())
+        return NVS_TYPE_ANY;
+    NvsReadLocker locker(*_lock);
+    nvs_type_t type;
+    int64_t value;
+    return findInt(key, type, value) ? type : NVS_TYPE_ANY;
+}
+
+/// Caller holds `_lock`. Looks `key` up in the cache, the snapshot, then
+/// on flash, and gives the integer type it is stored as.
+bool ArduinoNvs::findInt(const char *key, nvs_type_t &type, int64_t &value)
+{
+    if (_write_back)
+    {
+        CacheEntry *e = findCached(key);
+        if (e)
+        {
+            type = e->type;
+            value = is_int_type(e->type) ? int_from_raw(e->type, e->num) : 0;
+            return is_int_type(e->type);
+        }
+    }
+    const NvsSnapshotEntry *s;
+    switch (snapshotLookup(key, &s))
+    {
+    case SNAPSHOT_HIT:
+        type = s->type;
+        value = is_int_type(s->type) ? int_from_raw(s->type, s->num) : 0;
+        return is_int_type(s->type);
+    case SNAPSHOT_ABSENT:
+        return false;
+    default:
+        break;
+    }
+    type = cachedType(key);
+    if (type != NVS_TYPE_ANY && getIntAs(key, type, &value) == ESP_OK)
+        return true;
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+    // The entry metadata gives the stored type in one lookup.
+    if (nvs_find_key(_nvs_handle, key, &type) != ESP_OK)
+        return false;
+    if (getIntAs(key, type, &value) != ESP_OK)
+        return false;
+    cacheType(key, type);
+    return true;
+#else
+    // Type cache miss, probe in the order of the original implementation.
+    static const nvs_type_t probe[] = {
+        NVS_TYPE_U8, NVS_TYPE_I16, NVS_TYPE_U16, NVS_TYPE_I32,
+        NVS_TYPE_U32, NVS_TYPE_I64, NVS_TYPE_U64};
+    for (size_t i = 0; i < sizeof(probe) / sizeof(probe[0]); i++)
+    {
+        if (probe[i] == type)
+            continue;
+        if (getIntAs(key, probe[i], &value) == ESP_OK)
+        {
+            type = probe[i];
+            cacheType(key, type);
+            return true;
+        }
+    }
+    return false;
+#endif
+}
+
+bool ArduinoNvs::getString(const char *key, char *value, size_t &length)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    if (!ensureOpen())
+        return false;
+    NvsReadLocker locker(*_lock);
+    CacheEntry *e = _write_back ? findCached(key) : NULL;
+    if (e)
+    {
+        if (e->type != NVS_TYPE_STR)
+            return unpack_str(e->data.data(), e->data.size(),
+                              packedLength(key, e->type, e->data.data(), e->data.size(), NVS_LZ_STRING), value,
+                              length);
+        bool fits = e->data.size() <= length;
+        if (fits)
+            memcpy(value, e->data.data(), e->data.size());
+        length = e->data.size();
+        return fits;
+    }
+    const NvsSnapshotEntry *s;
+    switch (snapshotLookup(key, &s))
+    {
+    case SNAPSHOT_HIT:
+    {
+        if (s->type != NVS_TYPE_STR)
+            return unpack_str(snapshotData(s), s->length,
+                              packedLength(key, s->type, snapshotData(s), s->length, NVS_LZ_STRING), value, length);
+        bool fits = s->length <= length;
+        if (fits)
+            memcpy(value, snapshotData(s), s->length);
+        length = s->length;
+        return fits;
+    }
+    case SNAPSHOT_ABSENT:
+        return false;
+    default:
+        break;
+    }
+    esp_err_t err = nvs_get_str(_nvs_handle, key, value, &length);
+    if (err == ESP_ERR_NVS_TYPE_MISMATCH)
+    {
+        std::vector<uint8_t> packed;
+        return read_blob(_nvs_handle, key, packed) &&
+               unpack_str(packed.data(), packed.size(),
+                          packedLength(key, NVS_TYPE_BLOB, packed.data(), packed.size(), NVS_LZ_STRING), value,
+                          length);
+    }
+    return err == ESP_OK;
+}
+
+bool ArduinoNvs::getString(const char *key, String &res)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    size_t required_size;
+    esp_err_t err;
+
+    if (!ensureOpen())
+        return false;
+    NvsReadLocker locker(*_lock);
+    if (_write_back)
+    {
+        CacheEntry *e = findCached(key);
+        if (e)
+        {
+            if (e->type != NVS_TYPE_STR)
+                return unpack_str(e->data.data(), e->data.size(),
+                                  packedLength(key, e->type, e->data.data(), e->data.size(), NVS_LZ_STRING), res);
+            res = (const char *)e->data.data();
+            return true;
+        }
+    }
+    const NvsSnapshotEntry *s;
+    switch (snapshotLookup(key, &s))
+    {
+    case SNAPSHOT_HIT:
+        if (s->type != NVS_TYPE_STR)
+            return unpack_str(snapshotData(s), s->length,
+                              packedLength(key, s->type, snapshotData(s), s->length, NVS_LZ_STRING), res);
+        res = (const char *)snapshotData(s);
+        return true;
+    case SNAPSHOT_ABSENT:
+        return false;
+    default:
+        break;
+    }
+    err = nvs_get_str(_nvs_handle, key, NULL, &required_size);
+    if (err == ESP_ERR_NVS_TYPE_MISMATCH)
+    {
+        std::vector<uint8_t> packed;
+        return read_blob(_nvs_handle, key, packed) &&
+               unpack_str(packed.data(), packed.size(),
+                          packedLength(key, NVS_TYPE_BLOB, packed.data(), packed.size(), NVS_LZ_STRING), res);
+    }
+    if (err)
+        return false;
+
+    char value[required_size];
+    err = nvs_get_str(_nvs_handle, key, value, &required_size);
+    if (err)
+        return false;
+    res = value;
+    return true;
+}
+
+String ArduinoNvs::getString(const char *key)
+{
+    String res;
+    bool ok = getString(key, res);
+    if (!ok)
+        return String();
+    return res;
+}
+
+size_t ArduinoNvs::getBlobSize(const char *key)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    size_t required_size;
+    if (!ensureOpen())
+        return 0;
+    _lock->lockShared();
+    CacheEntry *e = _write_back ? findCached(key) : NULL;
+    if (e)
+    {
+        size_t n = packedLength(key, e->type, e->data.data(), e->data.size(), NVS_LZ_BLOB);
+        required_size = n ? n : e->type == NVS_TYPE_BLOB ? e->data.size() : 0;
+        _lock->unlockShared();
+        return required_size;
+    }
+    const NvsSnapshotEntry *s;
+    SnapshotResult snap = snapshotLookup(key, &s);
+    if (snap != SNAPSHOT_MISS)
+    {
+        size_t n = snap == SNAPSHOT_HIT ? packedLength(key, s->type, snapshotData(s), s->length, NVS_LZ_BLOB) : 0;
+        required_size = n ? n : snap == SNAPSHOT_HIT && s->type == NVS_TYPE_BLOB ? s->length : 0;
+        _lock->unlockShared();
+        return required_size;
+    }
+    esp_err_t err = nvs_get_blob(_nvs_handle, key, NULL,
+                                 &required_size);
+    // The marker has the unpacked size, the data itself is not read.
+    uint32_t unpacked;
+    if (err == ESP_OK && required_size > sizeof(NvsLzHeader) && packedKind(key, &unpacked) == NVS_LZ_BLOB)
+        required_size = unpacked;
+    _lock->unlockShared();
+    if (err)
+    {
+        if (err != ESP_ERR_NVS_NOT_FOUND) // key_not_found is not an error, just return size 0
+            log_d("ArduinoNvs::getBlobSize(): err = [0x%X]\n", err);
+        return 0;
+    }
+    return required_size;
+}
+
+bool ArduinoNvs::getBlob(const char *key, uint8_t *blob, size_t length)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    if (length == 0)
+        return false;
+    if (!ensureOpen())
+        return false;
+
+    NvsReadLocker locker(*_lock);
+    CacheEntry *e = _write_back ? findCached(key) : NULL;
+    if (e)
+    {
+        if (e->type != NVS_TYPE_BLOB)
+            return false;
+        return copy_blob(e->data.data(), e->data.size(),
+                         packedLength(key, e->type, e->data.data(), e->data.size(), NVS_LZ_BLOB), blob, length);
+    }
+    const NvsSnapshotEntry *s;
+    switch (snapshotLookup(key, &s))
+    {
+    case SNAPSHOT_HIT:
+        if (s->type != NVS_TYPE_BLOB)
+            return false;
+        return copy_blob(snapshotData(s), s->length,
+                         packedLength(key, s->type, snapshotData(s), s->length, NVS_LZ_BLOB), blob, length);
+    case SNAPSHOT_ABSENT:
+        return false;
+    default:
+        break;
+    }
+    // nvs_get_blob() fails by itself when `length` is too small, no need
+    // for a separate size lookup.
+    size_t required_size = length;
+    esp_err_t err = nvs_get_blob(_nvs_handle, key, blob, &required_size);
+    if (err)
+    {
+        if (err != ESP_ERR_NVS_NOT_FOUND)
+            log_d("ArduinoNvs::getBlob(): get object err = [0x%X]\n", err);
+        return false;
+    }
+    // A packed value is never larger than its unpacked size, so it fit.
+    size_t n = packedLength(key, NVS_TYPE_BLOB, blob, required_size, NVS_LZ_BLOB);
+    if (n)
+    {
+        std::vector<uint8_t> packed(blob, blob + required_size);
+        return copy_blob(packed.data(), packed.size(), n, blob, length);
+    }
+    return true;
+}
+
+bool ArduinoNvs::getBlob(const char *key, std::vector<uint8_t> &blob)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    if (!ensureOpen())
+        return false;
+
+    NvsReadLocker locker(*_lock);
+    CacheEntry *e = _write_back ? findCached(key) : NULL;
+    if (e)
+    {
+        if (e->type != NVS_TYPE_BLOB)
+            return false;
+        return assign_blob(e->data.data(), e->data.size(),
+                           packedLength(key, e->type, e->data.data(), e->data.size(), NVS_LZ_BLOB), blob);
+    }
+    const NvsSnapshotEntry *s;
+    switch (snapshotLookup(key, &s))
+    {
+    case SNAPSHOT_HIT:
+        if (s->type != NVS_TYPE_BLOB || s->length == 0)
+            return false;
+        return assign_blob(snapshotData(s), s->length,
+                           packedLength(key, s->type, snapshotData(s), s->length, NVS_LZ_BLOB), blob);
+    case SNAPSHOT_ABSENT:
+        return false;
+    default:
+        break;
+    }
+    size_t required_size = 0;
+    esp_err_t err = nvs_get_blob(_nvs_handle, key, NULL, &required_size);
+    if (err || required_size == 0)
+        return false;
+    blob.resize(required_size);
+    err = nvs_get_blob(_nvs_handle, key, blob.data(), &required_size);
+    if (err)
+    {
+        log_d("ArduinoNvs::getBlob(): get object err = [0x%X]\n", err);
+        return false;
+    }
+    size_t n = packedLength(key, NVS_TYPE_BLOB, blob.data(), blob.size(), NVS_LZ_BLOB);
+    if (n)
+    {
+        std::vector<uint8_t> packed;
+        packed.swap(blob);
+        return assign_blob(packed.data(), packed.size(), n, blob);
+    }
+    return true;
+}
+
+std::vector<uint8_t> ArduinoNvs::getBlob(const char *key)
+{
+    std::vector<uint8_t> res;
+    bool ok = getBlob(key, res);
+    if (!ok)
+        res.clear();
+    return res;
+}
+
+bool ArduinoNvs::setFloat(const char *key, float value, bool forceCommit)
+{
+    return setBlob(key, (const uint8_t *)&value, sizeof(float), forceCommit);
+}
+
+float ArduinoNvs::getFloat(const char *key, float default_value)
+{
+    float value;
+    if (!getBlob(key, (uint8_t *)&value, sizeof(value)))
+        return default_value;
+    return value;
+}
+
+static bool snapshot_less(const NvsSnapshotEntry &a, const NvsSnapshotEntry &b)
+{
+    return strncmp(a.key, b.key, NVS_KEY_NAME_MAX_SIZE) < 0;
+}
+
+static NvsSnapshotEntry *snapshot_find(NvsSnapshot *snap, const char *key)
+{
+    size_t lo = 0, hi = snap->count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        int c = strncmp(snap->entries[mid].key, key, NVS_KEY_NAME_MAX_SIZE);
+        if (c == 0)
+            return &snap->entries[mid];
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+static void snapshot_keys(const char *ns, std::vector<NvsSnapshotEntry> &keys)
+{
+    nvs_entry_info_t info;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    nvs_iterator_t it = NULL;
+    esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns, NVS_TYPE_ANY, &it);
+    for (; res == ESP_OK; res = nvs_entry_next(&it))
+#else
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns, NVS_TYPE_ANY);
+    for (; it; it = nvs_entry_next(it))
+#endif
+    {
+        nvs_entry_info(it, &info);
+        NvsSnapshotEntry e;
+        memset(&e, 0, sizeof(e));
+        memcpy(e.key, info.key, NVS_KEY_NAME_MAX_SIZE);
+        e.key[NVS_KEY_NAME_MAX_SIZE - 1] = 0;
+        e.type = info.type;
+        keys.push_back(e);
+    }
+    nvs_release_iterator(it);
+}
+
+bool ArduinoNvs::preload()
+{
+    if (!ensureOpen())
+        return false;
+
+    int64_t start = esp_timer_get_time();
+    NvsWriteLocker locker(*_lock);
+    std::vector<NvsSnapshotEntry> keys;
+    snapshot_keys(_namespace, keys);
+
+    // Size pass, values go to one arena behind the index.
+    size_t data_len = 0;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        NvsSnapshotEntry &e = keys[i];
+        size_t len = 0;
+        esp_err_t err;
+        if (e.type == NVS_TYPE_STR)
+            err = nvs_get_str(_nvs_handle, e.key, NULL, &len);
+        else if (e.type == NVS_TYPE_BLOB)
+            err = nvs_get_blob(_nvs_handle, e.key, NULL, &len);
+        else
+            continue;
+        if (err != ESP_OK || len > ARDUINONVS_SNAPSHOT_MAX_VALUE)
+            continue;
+        e.length = len;
+        e.offset = data_len;
+        data_len += len;
+    }
+    std::sort(keys.begin(), keys.end(), snapshot_less);
+
+    size_t head = (sizeof(NvsSnapshot) + 7) & ~(size_t)7;
+    size_t bytes = head + keys.size() * sizeof(NvsSnapshotEntry) + data_len;
+    NvsSnapshot *snap = (NvsSnapshot *)malloc(bytes);
+    if (!snap)
+    {
+        log_w("preload %s: no memory for %u bytes.", _namespace, (unsigned)bytes);
+        return false;
+    }
+    snap->count = keys.size();
+    snap->bytes = bytes;
+    snap->complete = true;
+    snap->entries = (NvsSnapshotEntry *)((uint8_t *)snap + head);
+    snap->data = (uint8_t *)(snap->entries + snap->count);
+    if (snap->count)
+        memcpy(snap->entries, keys.data(), snap->count * sizeof(NvsSnapshotEntry));
+
+    int64_t read_start = esp_timer_get_time();
+    for (size_t i = 0; i < snap->count; i++)
+    {
+        NvsSnapshotEntry &e = snap->entries[i];
+        size_t len = e.length;
+        if (is_int_type(e.type))
+        {
+            int64_t value;
+            e.loaded = getIntAs(e.key, e.type, &value) == ESP_OK;
+            e.num = (uint64_t)value;
+        }
+        else if (e.type == NVS_TYPE_STR && len)
+            e.loaded = nvs_get_str(_nvs_handle, e.key, (char *)snap->data + e.offset, &len) == ESP_OK;
+        else if (e.type == NVS_TYPE_BLOB && len)
+            e.loaded = nvs_get_blob(_nvs_handle, e.key, snap->data + e.offset, &len) == ESP_OK;
+    }
+    int64_t now = esp_timer_get_time();
+    snap->read_us = snap->count ? (now - read_start) / snap->count : 0;
+    snap->preload_us = now - start;
+
+    free(_slot->snapshot);
+    _slot->snapshot = snap;
+    _slot->snapshot_hits = 0;
+    _slot->snapshot_misses = 0;
+    log_i("preload %s: %u entries, %u bytes, %u us.", _namespace, (unsigned)snap->count,
+          (unsigned)bytes, (unsigned)snap->preload_us);
+    return true;
+}
+
+bool ArduinoNvs::hasSnapshot()
+{
+    NvsReadLocker locker(*_lock);
+    return _slot->snapshot != NULL;
+}
+
+void ArduinoNvs::dropSnapshot()
+{
+    NvsWriteLocker locker(*_lock);
+    free(_slot->snapshot);
+    _slot->snapshot = NULL;
+}
+
+ArduinoNvs::SnapshotStats ArduinoNvs::snapshotStats()
+{
+    SnapshotStats stats;
+    memset(&stats, 0, sizeof(stats));
+    NvsReadLocker locker(*_lock);
+    stats.hits = _slot->snapshot_hits.load(std::memory_order_relaxed);
+    stats.misses = _slot->snapshot_misses.load(std::memory_order_relaxed);
+    if (_slot->snapshot)
+    {
+        stats.entries = _slot->snapshot->count;
+        stats.bytes = _slot->snapshot->bytes;
+        stats.preload_us = _slot->snapshot->preload_us;
+        stats.read_us = _slot->snapshot->read_us;
+        stats.saved_us = (int64_t)stats.hits * stats.read_us - stats.preload_us;
+    }
+    return stats;
+}
+
+/// Caller holds `_lock`.
+ArduinoNvs::SnapshotResult ArduinoNvs::snapshotLookup(const char *key, const NvsSnapshotEntry **entry)
+{
+    if (!_slot->snapshot)
+        return SNAPSHOT_MISS;
+    NvsSnapshotEntry *e = snapshot_find(_slot->snapshot, key);
+    SnapshotResult res;
+    if (!e)
+        res = _slot->snapshot->complete ? SNAPSHOT_ABSENT : SNAPSHOT_MISS;
+    else if (e->type == NVS_TYPE_ANY || !e->loaded)
+        res = SNAPSHOT_MISS;
+    else
+    {
+        *entry = e;
+        res = SNAPSHOT_HIT;
+    }
+    if (res == SNAPSHOT_MISS)
+        _slot->snapshot_misses.fetch_add(1, std::memory_order_relaxed);
+    else
+        _slot->snapshot_hits.fetch_add(1, std::memory_order_relaxed);
+    return res;
+}
+
+const uint8_t *ArduinoNvs::snapshotData(const NvsSnapshotEntry *entry)
+{
+    return _slot->snapshot->data + entry->offset;
+}
+
+/// Caller holds `_lock` exclusively. Written keys fall back to flash, a
+/// new key makes misses inconclusive.
+void ArduinoNvs::snapshotInvalidate(const char *key, bool erased)
+{
+    if (!_slot->snapshot)
+        return;
+    NvsSnapshotEntry *e = snapshot_find(_slot->snapshot, key);
+    if (e)
+        e->type = NVS_TYPE_ANY;
+    else if (!erased)
+        _slot->snapshot->complete = false;
+}
+
+/// Stored under the user key. Shards are named after `base` and written
+/// to the generation the header does not point at.
+struct LargeBlobHeader
+{
+    uint32_t magic;
+    uint32_t length;
+    uint16_t chunk;
+    uint16_t count;
+    uint32_t base;                    ///< shard name prefix, hash of `key` unless it collided
+    uint32_t crc;                     ///< CRC-32 of the whole value
+    uint8_t gen;                      ///< 0 or 1, generation of the current shards
+    uint8_t reserved[3];
+    char key[NVS_KEY_NAME_MAX_SIZE]; ///< owner, tells colliding keys apart
+};
+
+static const uint32_t LARGE_BLOB_MAGIC = 0x324b564e; // "NVK2"
+#define LARGE_BLOB_PROBES 4
+static FEmbed::OSMutex large_blob_lock; ///< taken before the flush and namespace locks
+
+/// Shard keys are "<base>_<generation><index>", 13 characters. The claim
+/// key "<base>" holds the name of the key owning the shards.
+static void chunk_key(char *out, uint32_t base, uint8_t gen, size_t index)
+{
+    snprintf(out, NVS_KEY_NAME_MAX_SIZE, "%08x_%x%03x", (unsigned)base, (unsigned)gen, (unsigned)index);
+}
+
+static void claim_key(char *out, uint32_t base)
+{
+    snprintf(out, NVS_KEY_NAME_MAX_SIZE, "%08x", (unsigned)base);
+}
+
+static bool read_large_header(nvs_handle handle, const char *key, LargeBlobHeader &hdr)
+{
+    size_t length = sizeof(hdr);
+    if (nvs_get_blob(handle, key, &hdr, &length) != ESP_OK)
+        return false;
+    return length == sizeof(hdr) && hdr.magic == LARGE_BLOB_MAGIC && hdr.chunk && hdr.gen < 2 &&
+           strncmp(hdr.key, key, NVS_KEY_NAME_MAX_SIZE) == 0;
+}
+
+/// First shard base whose claim is free or already `key`'s, claimed.
+static esp_err_t claim_base(nvs_handle handle, const char *key, uint32_t &base)
+{
+    char name[NVS_KEY_NAME_MAX_SIZE];
+    char owner[NVS_KEY_NAME_MAX_SIZE];
+    for (uint32_t probe = 0; probe < LARGE_BLOB_PROBES; probe++)
+    {
+        base = key_hash(key) + probe * 0x9e3779b9u;
+        claim_key(name, base);
+        size_t length = sizeof(owner);
+        esp_err_t err = nvs_get_str(handle, name, owner, &length);
+        if (err == ESP_OK && strcmp(owner, key) == 0)
+            return ESP_OK;
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+            return nvs_set_str(handle, name, key);
+        log_w("large blob %s: shard name %s taken by %s.", key, name, err == ESP_OK ? owner : "?");
+    }
+    // Every shard name probed is taken, no room for this key.
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+}
+
+/// Shards named after `base` that are not among the first `keep_count`
+/// of generation `keep_gen` (-1 keeps none).
+static void stale_shards(const char *ns, uint32_t base, int keep_gen, size_t keep_count,
+                         std::vector<std::string> &names)
+{
+    char prefix[NVS_KEY_NAME_MAX_SIZE];
+    snprintf(prefix, sizeof(prefix), "%08x_", (unsigned)base);
+    nvs_entry_info_t info;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    nvs_iterator_t it = NULL;
+    esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns, NVS_TYPE_BLOB, &it);
+    for (; res == ESP_OK; res = nvs_entry_next(&it))
+#else
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns, NVS_TYPE_BLOB);
+    for (; it; it = nvs_entry_next(it))
+#endif
+    {
+        nvs_entry_info(it, &info);
+        if (strncmp(info.key, prefix, 9) != 0 || strlen(info.key) != 13)
+            continue;
+        unsigned gen = info.key[9] - '0';
+        size_t index = strtoul(info.key + 10, NULL, 16);
+        if ((int)gen != keep_gen || index >= keep_count)
+            names.push_back(info.key);
+    }
+    nvs_release_iterator(it);
+}
+
+/// Caller holds `_lock` exclusively. Shards are found by listing the
+/// namespace, so those left behind by an interrupted write or erase, gaps
+/// included, go too.
+void ArduinoNvs::eraseShards(uint32_t base, int keep_gen, size_t keep_count)
+{
+    std::vector<std::string> names;
+    stale_shards(_namespace, base, keep_gen, keep_count, names);
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        nvs_erase_key(_nvs_handle, names[i].c_str());
+        snapshotInvalidate(names[i].c_str(), true);
+        _write_stats.erases++;
+    }
+}
+
+bool ArduinoNvs::writeLargeBlob(const char *key, const uint8_t *data, Stream *src, size_t length,
+                                bool forceCommit)
+{
+    NvsOpTimer timer(this, METRIC_SET);
+    if (!ensureOpen() || length == 0 || strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+        return false;
+    size_t count = (length + ARDUINONVS_CHUNK_SIZE - 1) / ARDUINONVS_CHUNK_SIZE;
+    if (count > 0xfff)
+        return false;
+
+    uint8_t *buf = NULL;
+    if (!data)
+    {
+        buf = (uint8_t *)malloc(ARDUINONVS_CHUNK_SIZE);
+        if (!buf)
+            return false;
+    }
+
+    esp_err_t err = ESP_OK;
+    {
+        // The namespace lock is only held for the NVS operations, the
+        // source is read without it. Large blob writes and erases are
+        // serialized among themselves instead.
+        FEmbed::OSMutexLocker blob_locker(large_blob_lock);
+        char name[NVS_KEY_NAME_MAX_SIZE];
+        LargeBlobHeader old;
+        LargeBlobHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = LARGE_BLOB_MAGIC;
+        hdr.length = (uint32_t)length;
+        hdr.chunk = ARDUINONVS_CHUNK_SIZE;
+        hdr.count = (uint16_t)count;
+        strncpy(hdr.key, key, NVS_KEY_NAME_MAX_SIZE - 1);
+        bool had_old;
+        bool claimed = false;
+        {
+            NvsWriteLocker locker(*_lock);
+            had_old = read_large_header(_nvs_handle, key, old);
+            hdr.gen = had_old ? !old.gen : 0;
+            if (had_old)
+                hdr.base = old.base;
+            else
+            {
+                err = claim_base(_nvs_handle, key, hdr.base);
+                claimed = err == ESP_OK;
+                claim_key(name, hdr.base);
+                snapshotInvalidate(name, false);
+            }
+        }
+
+        for (size_t i = 0; i < count && err == ESP_OK; i++)
+        {
+            size_t off = i * ARDUINONVS_CHUNK_SIZE;
+            size_t n = length - off < ARDUINONVS_CHUNK_SIZE ? length - off : ARDUINONVS_CHUNK_SIZE;
+            const uint8_t *chunk = data ? data + off : buf;
+            if (!data && src->readBytes(buf, n) != n)
+            {
+                err = ESP_ERR_INVALID_SIZE;
+                break;
+            }
+            hdr.crc = nvs_crc32(hdr.crc, chunk, n);
+            chunk_key(name, hdr.base, hdr.gen, i);
+            NvsWriteLocker locker(*_lock);
+            int64_t start = esp_timer_get_time();
+            err = nvs_set_blob(_nvs_handle, name, chunk, n);
+            if (err == ESP_OK)
+                countSet(key, NVS_TYPE_BLOB, n, esp_timer_get_time() - start);
+            snapshotInvalidate(name, false);
+        }
+
+        FEmbed::OSMutexLocker flush_locker(_flush_lock);
+        NvsWriteLocker locker(*_lock);
+        // Rewriting the header is the one step that switches readers, and
+        // after a power cut, over to the new generation: NVS replaces an
+        // item by writing the new one before erasing the old. Until then
+        // the old shards are untouched.
+        if (err == ESP_OK)
+        {
+            int64_t start = esp_timer_get_time();
+            err = nvs_set_blob(_nvs_handle, key, &hdr, sizeof(hdr));
+            if (err == ESP_OK)
+                countSet(key, NVS_TYPE_BLOB, sizeof(hdr), esp_timer_get_time() - start);
+            snapshotInvalidate(key, false);
+        }
+        // Shards not referenced by the header in effect: the old
+        // generation on success, the partial new one on failure.
+        if (err == ESP_OK)
+            eraseShards(hdr.base, hdr.gen, count);
+        else if (had_old)
+            eraseShards(hdr.base, old.gen, old.count);
+        else if (claimed)
+            eraseShards(hdr.base, -1, 0);
+        if (_write_back)
+            dropCached(key);
+    }
+    free(buf);
+
+    if (err != ESP_OK)
+    {
+        log_w("setLargeBlob %s failed(%d).", key, err);
+        return false;
+    }
+    return forceCommit ? commit() : true;
+}
+
+bool ArduinoNvs::setLargeBlob(const char *key, const uint8_t *data, size_t length, bool forceCommit)
+{
+    if (!data)
+        return false;
+    return writeLargeBlob(key, data, NULL, length, forceCommit);
+}
+
+bool ArduinoNvs::setLargeBlob(const char *key, Stream &src, size_t length, bool forceCommit)
+{
+    return writeLargeBlob(key, NULL, &src, length, forceCommit);
+}
+
+size_t ArduinoNvs::getLargeBlobSize(const char *key)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    LargeBlobHeader hdr;
+    if (!ensureOpen())
+        return 0;
+    NvsReadLocker locker(*_lock);
+    return read_large_header(_nvs_handle, key, hdr) ? hdr.length : 0;
+}
+
+size_t ArduinoNvs::readLargeBlob(const char *key, size_t offset, uint8_t *buf, size_t length)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    LargeBlobHeader hdr;
+    if (!ensureOpen())
+        return 0;
+    NvsReadLocker locker(*_lock);
+    if (!read_large_header(_nvs_handle, key, hdr) || offset >= hdr.length)
+        return 0;
+    if (length > hdr.length - offset)
+        length = hdr.length - offset;
+
+    char name[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t *tmp = NULL;
+    size_t done = 0;
+    while (done < length)
+    {
+        size_t pos = offset + done;
+        size_t index = pos / hdr.chunk;
+        size_t skip = pos % hdr.chunk;
+        size_t chunk_len = hdr.length - index * hdr.chunk;
+        if (chunk_len > hdr.chunk)
+            chunk_len = hdr.chunk;
+        size_t n = chunk_len - skip < length - done ? chunk_len - skip : length - done;
+
+        chunk_key(name, hdr.base, hdr.gen, index);
+        size_t got = chunk_len;
+        esp_err_t err;
+        if (skip == 0 && n == chunk_len)
+            err = nvs_get_blob(_nvs_handle, name, buf + done, &got); // whole shard, no copy
+        else
+        {
+            if (!tmp && !(tmp = (uint8_t *)malloc(hdr.chunk)))
+                break;
+            err = nvs_get_blob(_nvs_handle, name, tmp, &got);
+            if (err == ESP_OK)
+                memcpy(buf + done, tmp + skip, n);
+        }
+        if (err != ESP_OK || got != chunk_len)
+        {
+            log_w("readLargeBlob %s shard %u failed(%d).", key, (unsigned)index, err);
+            break;
+        }
+        done += n;
+    }
+    free(tmp);
+    return done;
+}
+
+size_t ArduinoNvs::readLargeBlob(const char *key, Print &out)
+{
+    NvsOpTimer timer(this, METRIC_GET);
+    LargeBlobHeader hdr;
+    if (!ensureOpen())
+        return 0;
+    NvsReadLocker locker(*_lock);
+    if (!read_large_header(_nvs_handle, key, hdr))
+        return 0;
+    uint8_t *buf = (uint8_t *)malloc(hdr.chunk);
+    if (!buf)
+        return 0;
+
+    char name[NVS_KEY_NAME_MAX_SIZE];
+    size_t done = 0;
+    uint32_t crc = 0;
+    for (size_t i = 0; i < hdr.count; i++)
+    {
+        size_t got = hdr.chunk;
+        chunk_key(name, hdr.base, hdr.gen, i);
+        if (nvs_get_blob(_nvs_handle, name, buf, &got) != ESP_OK)
+            break;
+        crc = nvs_crc32(crc, buf, got);
+        if (out.write(buf, got) != got)
+            break;
+        done += got;
+    }
+    free(buf);
+    if (done == hdr.length && crc != hdr.crc)
+    {
+        log_w("readLargeBlob %s CRC mismatch.", key);
+        return 0;
+    }
+    return done;
+}
+
+bool ArduinoNvs::eraseLargeBlob(const char *key, bool forceCommit)
+{
+    NvsOpTimer timer(this, METRIC_ERASE);
+    LargeBlobHeader hdr;
+    if (!ensureOpen())
+        return false;
+    {
+        FEmbed::OSMutexLocker blob_locker(large_blob_lock);
+        FEmbed::OSMutexLocker flush_locker(_flush_lock);
+        NvsWriteLocker locker(*_lock);
+        if (!read_large_header(_nvs_handle, key, hdr))
+            return false;
+        // Header first, a power cut after it leaves only orphaned shards.
+        nvs_erase_key(_nvs_handle, key);
+        snapshotInvalidate(key, true);
+        _write_stats.erases++;
+        eraseShards(hdr.base, -1, 0);
+        char name[NVS_KEY_NAME_MAX_SIZE];
+        claim_key(name, hdr.base);
+        nvs_erase_key(_nvs_handle, name);
+        snapshotInvalidate(name, true);
+        if (_write_back)
+            dropCached(key);
+    }
+    return forceCommit ? commit() : true;
+}
+
+/// Caller holds `_lock` exclusively.
+void ArduinoNvs::dropCached(const char *key)
+{
+    CacheEntry *e = findCached(key);
+    if (!e)
+        return;
+    if (e->dirty)
+        _dirty_count--;
+    _cache.erase(_cache.begin() + (e - &_cache[0]));
+}
+
+#define NVS_EXPORT_MAGIC 0x5853564e // "NVSX"
+#define NVS_EXPORT_VERSION 1
+
+static void export_put(std::vector<uint8_t> &out, const void *data, size_t length)
+{
+    out.insert(out.end(), (const uint8_t *)data, (const uint8_t *)data + length);
+}
+
+/// Keys of this class's own bookkeeping that stay out of snapshots:
+/// compression markers and the maintain() scratch blob.
+static bool internal_key(const NvsSnapshotEntry &e)
+{
+    if (strcmp(e.key, NVS_MAINT_KEY) == 0)
+        return true;
+    return e.type == NVS_TYPE_U64 && strncmp(e.key, "__z", 3) == 0 && strlen(e.key) == 11;
+}
+
+// Snapshot layout, little endian:
+//   u32 magic, u16 version, u16 reserved, u32 count
+//   count * { u8 nvs_type_t, u8 key length, u32 value length, key, value }
+//   u32 CRC-32 of everything before it
+// Integers are stored in their own size, strings with their terminator.
+// Compressed values are exported unpacked, as the type they were set as.
+bool ArduinoNvs::exportTo(std::vector<uint8_t> &out)
+{
+    if (!ensureOpen())
+        return false;
+    if (_dirty_count && !commit())
+        return false;
+
+    NvsReadLocker locker(*_lock);
+    std::vector<NvsSnapshotEntry> keys;
+    snapshot_keys(_namespace, keys);
+
+    out.clear();
+    uint32_t magic = NVS_EXPORT_MAGIC;
+    uint16_t version = NVS_EXPORT_VERSION, reserved = 0;
+    uint32_t count = 0;
+    export_put(out, &magic, sizeof(magic));
+    export_put(out, &version, sizeof(version));
+    export_put(out, &reserved, sizeof(reserved));
+    export_put(out, &count, sizeof(count));
+
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        NvsSnapshotEntry &e = keys[i];
+        if (internal_key(e))
+            continue;
+        uint8_t head[6];
+        uint32_t length;
+        head[0] = e.type;
+        head[1] = strlen(e.key);
+        if (is_int_type(e.type))
+        {
+            int64_t value;
+            if (getIntAs(e.key, e.type, &value) != ESP_OK)
+                continue;
+            length = int_size(e.type);
+            memcpy(head + 2, &length, sizeof(length));
+            export_put(out, head, sizeof(head));
+            export_put(out, e.key, head[1]);
+            export_put(out, &value, length);
+        }
+        else if (e.type == NVS_TYPE_STR || e.type == NVS_TYPE_BLOB)
+        {
+            size_t len = 0;
+            esp_err_t err = e.type == NVS_TYPE_STR ? nvs_get_str(_nvs_handle, e.key, NULL, &len)
+                                                   : nvs_get_blob(_nvs_handle, e.key, NULL, &len);
+            std::vector<uint8_t> value(len);
+            if (err == ESP_OK)
+                err = e.type == NVS_TYPE_STR ? nvs_get_str(_nvs_handle, e.key, (char *)value.data(), &len)
+                                             : nvs_get_blob(_nvs_handle, e.key, value.data(), &len);
+            if (err != ESP_OK)
+            {
+                log_w("export %s failed(%d).", e.key, err);
+                continue;
+            }
+            if (e.type == NVS_TYPE_BLOB)
+            {
+                size_t n = packedLength(e.key, e.type, value.data(), len, NVS_LZ_STRING);
+                if (n)
+                    head[0] = NVS_TYPE_STR;
+                else
+                    n = packedLength(e.key, e.type, value.data(), len, NVS_LZ_BLOB);
+                std::vector<uint8_t> packed;
+                if (n)
+                {
+                    packed.swap(value);
+                    if (!assign_blob(packed.data(), packed.size(), n, value))
+                    {
+                        log_w("export %s: unpack failed.", e.key);
+                        continue;
+                    }
+                }
+            }
+            length = value.size();
+            memcpy(head + 2, &length, sizeof(length));
+            export_put(out, head, sizeof(head));
+            export_put(out, e.key, head[1]);
+            export_put(out, value.data(), value.size());
+        }
+        else
+            continue;
+        count++;
+    }
+    memcpy(&out[8], &count, sizeof(count));
+    uint32_t crc = nvs_crc32(0, out.data(), out.size());
+    export_put(out, &crc, sizeof(crc));
+    return true;
+}
+
+/// Walks the entries of a snapshot, false once the data is malformed.
+static bool import_next(const uint8_t *&p, const uint8_t *end, nvs_type_t &type, char *key,
+                        const uint8_t *&value, uint32_t &length)
+{
+    if (end - p < 6)
+        return false;
+    type = (nvs_type_t)p[0];
+    uint8_t key_len = p[1];
+    memcpy(&length, p + 2, sizeof(length));
+    p += 6;
+    if (key_len == 0 || key_len >= NVS_KEY_NAME_MAX_SIZE || (size_t)(end - p) < key_len)
+        return false;
+    memcpy(key, p, key_len);
+    key[key_len] = 0;
+    p += key_len;
+    if ((size_t)(end - p) < length)
+        return false;
+    value = p;
+    p += length;
+    switch (type)
+    {
+    case NVS_TYPE_U8:
+    case NVS_TYPE_I8:
+    case NVS_TYPE_U16:
+    case NVS_TYPE_I16:
+    case NVS_TYPE_U32:
+    case NVS_TYPE_I32:
+    case NVS_TYPE_U64:
+    case NVS_TYPE_I64:
+        return int_size(type) == length;
+    case NVS_TYPE_STR:
+        return length > 0 && value[length - 1] == 0;
+    case NVS_TYPE_BLOB:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool ArduinoNvs::importFrom(const uint8_t *data, size_t length, bool eraseFirst)
+{
+    if (!ensureOpen() || !data || length < 16)
+        return false;
+
+    uint32_t magic, count, crc;
+    uint16_t version;
+    memcpy(&magic, data, sizeof(magic));
+    memcpy(&version, data + 4, sizeof(version));
+    memcpy(&count, data + 8, sizeof(count));
+    memcpy(&crc, data + length - 4, sizeof(crc));
+    if (magic != NVS_EXPORT_MAGIC || version != NVS_EXPORT_VERSION)
+    {
+        log_w("import: not a snapshot.");
+        return false;
+    }
+    if (nvs_crc32(0, data, length - 4) != crc)
+    {
+        log_w("import: checksum mismatch.");
+        return false;
+    }
+
+    // Validate everything before touching flash.
+    const uint8_t *end = data + length - 4;
+    const uint8_t *p = data + 12;
+    nvs_type_t type;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    const uint8_t *value;
+    uint32_t value_len;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!import_next(p, end, type, key, value, value_len))
+        {
+            log_w("import: entry %u malformed.", (unsigned)i);
+            return false;
+        }
+    }
+    if (p != end)
+        return false;
+
+    bool ok = true;
+    {
+        FEmbed::OSMutexLocker flush_locker(_flush_lock);
+        NvsWriteLocker locker(*_lock);
+        if (eraseFirst)
+        {
+            esp_err_t err = nvs_erase_all(_nvs_handle);
+            if (err != ESP_OK)
+            {
+                log_w("import: erase failed(%d).", err);
+                return false;
+            }
+            clearTypeCache();
+            free(_slot->snapshot);
+            _slot->snapshot = NULL;
+            _cache.clear();
+            _dirty_count = 0;
+        }
+        else if (_write_back && flushLocked() != ESP_OK)
+            ok = false;
+
+        p = data + 12;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!import_next(p, end, type, key, value, value_len))
+            {
+                log_w("import: entry %u malformed.", (unsigned)i);
+                ok = false;
+                break;
+            }
+            esp_err_t err = writeEntry(key, type, value, value_len);
+            if (err == ESP_ERR_NVS_TYPE_MISMATCH)
+            {
+                // NVS keeps the type a key was created with, the snapshot's
+                // type wins.
+                nvs_erase_key(_nvs_handle, key);
+                cacheType(key, NVS_TYPE_ANY);
+                _write_stats.erases++;
+                err = writeEntry(key, type, value, value_len);
+            }
+            // Imported values are plain, a marker left by a packed one goes.
+            if (err == ESP_OK && !is_int_type(type))
+                err = eraseMarker(key);
+            if (_write_back)
+                dropCached(key);
+            if (err != ESP_OK)
+            {
+                log_w("import %s failed(%d).", key, err);
+                ok = false;
+            }
+        }
+        int64_t start = esp_timer_get_time();
+        esp_err_t err = nvs_commit(_nvs_handle);
+        _write_stats.commits++;
+        _write_stats.commit_us += esp_timer_get_time() - start;
+        if (err != ESP_OK)
+        {
+            log_w("commit failed(%d).", err);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool ArduinoNvs::applyBatch(std::vector<CacheEntry> &ops, const std::vector<esp_err_t> &staged,
+                            std::vector<esp_err_t> &results)
+{
+    // Every apply starts over, entries failed by an earlier one are retried.
+    results = staged;
+    if (!ensureOpen())
+    {
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            if (results[i] == ESP_OK)
+                results[i] = ESP_ERR_NVS_INVALID_HANDLE;
+        }
+        return false;
+    }
+
+    bool ok = true;
+    FEmbed::OSMutexLocker flush_locker(_flush_lock);
+    NvsWriteLocker locker(*_lock);
+    // Pending cached writes go first so the batch wins on shared keys.
+    if (_write_back && flushLocked() != ESP_OK)
+        ok = false;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        CacheEntry &op = ops[i];
+        if (results[i] != ESP_OK)
+        {
+            ok = false;
+            continue;
+        }
+        esp_err_t err;
+        if (op.type == NVS_TYPE_ANY)
+        {
+            err = nvs_erase_key(_nvs_handle, op.key);
+            if (err == ESP_ERR_NVS_NOT_FOUND)
+                err = ESP_OK;
+            cacheType(op.key, NVS_TYPE_ANY);
+            snapshotInvalidate(op.key, true);
+            _write_stats.erases++;
+        }
+        else if (is_int_type(op.type))
+            err = writeEntry(op.key, op.type, &op.num, int_size(op.type));
+        else
+            err = writeEntry(op.key, op.type, op.data.data(), op.data.size());
+        if (err == ESP_OK && !is_int_type(op.type))
+            err = eraseMarker(op.key);
+        if (_write_back)
+            dropCached(op.key);
+        if (err != ESP_OK)
+        {
+            log_w("batch %s failed(%d).", op.key, err);
+            ok = false;
+        }
+        results[i] = err;
+    }
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = nvs_commit(_nvs_handle);
+    _write_stats.commits++;
+    _write_stats.commit_us += esp_timer_get_time() - start;
+    if (err != ESP_OK)
+    {
+        log_w("commit failed(%d).", err);
+        ok = false;
+    }
+    return ok;
+}
+
+/// Caller holds `_lock` exclusively. Batch writes are stored plain, the
+/// marker of a value packed before goes.
+esp_err_t ArduinoNvs::eraseMarker(const char *key)
+{
+    if (packedKind(key, NULL) == 0)
+        return ESP_OK;
+    char mkey[NVS_KEY_NAME_MAX_SIZE];
+    marker_key(mkey, key);
+    esp_err_t err = nvs_erase_key(_nvs_handle, mkey);
+    cacheType(mkey, NVS_TYPE_ANY);
+    snapshotInvalidate(mkey, true);
+    if (_write_back)
+        dropCached(mkey);
+    _write_stats.erases++;
+    return err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::stage(const char *key, nvs_type_t type, const void *data, size_t length)
+{
+    _ops.emplace_back();
+    CacheEntry &op = _ops.back();
+    strncpy(op.key, key, NVS_KEY_NAME_MAX_SIZE - 1);
+    op.key[NVS_KEY_NAME_MAX_SIZE - 1] = 0;
+    op.dirty = true;
+    cache_assign(op, type, data, length);
+    _staged.push_back(strlen(key) >= NVS_KEY_NAME_MAX_SIZE ? ESP_ERR_NVS_KEY_TOO_LONG : ESP_OK);
+    return *this;
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::setInt(const char *key, uint8_t value)
+{
+    return stage(key, NVS_TYPE_U8, &value, sizeof(value));
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::setInt(const char *key, int16_t value)
+{
+    return stage(key, NVS_TYPE_I16, &value, sizeof(value));
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::setInt(const char *key, uint16_t value)
+{
+    return stage(key, NVS_TYPE_U16, &value, sizeof(value));
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::setInt(const char *key, int32_t value)
+{
+    return stage(key, NVS_TYPE_I32, &value, sizeof(value));
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::setInt(const char *key, uint32_t value)
+{
+    return stage(key, NVS_TYPE_U32, &value, sizeof(value));
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::setInt(const char *key, int64_t value)
+{
+    return stage(key, NVS_TYPE_I64, &value, sizeof(value));
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::setInt(const char *key, uint64_t value)
+{
+    return stage(key, NVS_TYPE_U64, &value, sizeof(value));
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::setString(const char *key, const char *value)
+{
+    return stage(key, NVS_TYPE_STR, value, strlen(value) + 1);
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::setBlob(const char *key, const uint8_t *blob, size_t length)
+{
+    return stage(key, NVS_TYPE_BLOB, blob, length);
+}
+
+ArduinoNvs::Batch &ArduinoNvs::Batch::erase(const char *key)
+{
+    return stage(key, NVS_TYPE_ANY, NULL, 0);
+}
+
+bool ArduinoNvs::Batch::apply()
+{
+    return _nvs.applyBatch(_ops, _staged, _results);
+}
+
+void ArduinoNvs::Batch::clear()
+{
+    _ops.clear();
+    _staged.clear();
+    _results.clear();
+}
+
+size_t ArduinoNvs::Batch::failures()
+{
+    size_t n = 0;
+    for (size_t i = 0; i < _ops.size(); i++)
+    {
+        if (result(i) != ESP_OK)
+            n++;
+    }
+    return n;
 }
 
 FEmbed::OSMutex ArduinoNvs::nvs_global_lock;
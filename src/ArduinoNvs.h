@@ -26,8 +26,17 @@
 
 #include <Arduino.h>
 #include <osMutex.h>
+#include <atomic>
 #include <vector>
 
+#include "NvsKey.h"
+#include "NvsRWLock.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+
 extern "C"
 {
 #include "esp_partition.h"
@@ -40,6 +49,50 @@ extern "C"
 #define ARDUINONVS_SILENT 0
 #endif
 
+/// Number of key -> integer type slots remembered by `getInt()`, power of two.
+#ifndef ARDUINONVS_TYPE_CACHE_SIZE
+#define ARDUINONVS_TYPE_CACHE_SIZE 16
+#endif
+
+/// Shard size of `setLargeBlob()` values, 62 entries fit one NVS page.
+#ifndef ARDUINONVS_CHUNK_SIZE
+#define ARDUINONVS_CHUNK_SIZE 1984
+#endif
+
+/// Strings and blobs up to this size are copied into the `preload()` snapshot.
+#ifndef ARDUINONVS_SNAPSHOT_MAX_VALUE
+#define ARDUINONVS_SNAPSHOT_MAX_VALUE 256
+#endif
+
+/// A single set slower than this is counted as inline garbage collection.
+#ifndef ARDUINONVS_GC_SPIKE_US
+#define ARDUINONVS_GC_SPIKE_US 10000
+#endif
+
+/// log2 latency buckets kept per operation by `metrics()`.
+#ifndef ARDUINONVS_HIST_BUCKETS
+#define ARDUINONVS_HIST_BUCKETS 16
+#endif
+
+/// Most written keys tracked by `metrics()`.
+#ifndef ARDUINONVS_HOT_KEYS
+#define ARDUINONVS_HOT_KEYS 8
+#endif
+
+/// Keys held by the write-back cache before clean entries are evicted.
+#ifndef ARDUINONVS_CACHE_MAX_ENTRIES
+#define ARDUINONVS_CACHE_MAX_ENTRIES 32
+#endif
+
+/// A failed open is retried by the next operation, at most once per interval.
+#ifndef ARDUINONVS_OPEN_RETRY_MS
+#define ARDUINONVS_OPEN_RETRY_MS 1000
+#endif
+
+struct NvsSnapshot;
+struct NvsSnapshotEntry;
+struct NamespaceSlot;
+
 class ArduinoNvs
 {
 public:
@@ -47,47 +100,433 @@ public:
     ~ArduinoNvs();
 
     bool eraseAll(bool forceCommit = true);
-    bool erase(String key, bool forceCommit = true);
-
-    bool setInt(String key, uint8_t value, bool forceCommit = true);
-    bool setInt(String key, int16_t value, bool forceCommit = true);
-    bool setInt(String key, uint16_t value, bool forceCommit = true);
-    bool setInt(String key, int32_t value, bool forceCommit = true);
-    bool setInt(String key, uint32_t value, bool forceCommit = true);
-    bool setInt(String key, int64_t value, bool forceCommit = true);
-    bool setInt(String key, uint64_t value, bool forceCommit = true);
-    bool setFloat(String key, float value, bool forceCommit = true);
-    bool setString(String key, String value, bool forceCommit = true);
-    bool setBlob(String key, uint8_t *blob, size_t length, bool forceCommit = true);
-    bool setBlob(String key, std::vector<uint8_t> &blob,
-                 bool forceCommit = true);
-
-    int64_t getInt(String key, int64_t default_value = 0); // In case of error, default_value will be returned
-    float getFloat(String key, float default_value = 0);
-
-    bool getString(String key, String &res);
-    String getString(String key);
-
-    size_t getBlobSize(String key);                         /// Returns the size of the stored blob
-    bool getBlob(String key, uint8_t *blob, size_t length); /// User should proivde enought memory to store the loaded blob. If length < than required size to store blob, function fails.
-    bool getBlob(String key, std::vector<uint8_t> &blob);
-    std::vector<uint8_t> getBlob(String key); /// Less eficient but more simple in usage implemetation of `getBlob()`
+    bool erase(const char *key, bool forceCommit = true);
+
+    bool setInt(const char *key, uint8_t value, bool forceCommit = true);
+    bool setInt(const char *key, int16_t value, bool forceCommit = true);
+    bool setInt(const char *key, uint16_t value, bool forceCommit = true);
+    bool setInt(const char *key, int32_t value, bool forceCommit = true);
+    bool setInt(const char *key, uint32_t value, bool forceCommit = true);
+    bool setInt(const char *key, int64_t value, bool forceCommit = true);
+    bool setInt(const char *key, uint64_t value, bool forceCommit = true);
+    bool setFloat(const char *key, float value, bool forceCommit = true);
+    bool setString(const char *key, const char *value, bool forceCommit = true);
+    bool setBlob(const char *key, const uint8_t *blob, size_t length, bool forceCommit = true);
+    bool setBlob(const char *key, const std::vector<uint8_t> &blob, bool forceCommit = true);
+
+    int64_t getInt(const char *key, int64_t default_value = 0); // In case of error, default_value will be returned
+    nvs_type_t getIntType(const char *key); /// Type the integer is stored as, NVS_TYPE_ANY when missing or not an integer
+    float getFloat(const char *key, float default_value = 0);
+
+    /// Copies the string into `value` without heap allocation. `length` is the
+    /// buffer size on input and the stored size including the terminator on
+    /// output, also when the buffer is too small and the call fails.
+    bool getString(const char *key, char *value, size_t &length);
+    bool getString(const char *key, String &res);
+    String getString(const char *key);
+
+    size_t getBlobSize(const char *key);                         /// Returns the size of the stored blob
+    bool getBlob(const char *key, uint8_t *blob, size_t length); /// User should proivde enought memory to store the loaded blob. If length < than required size to store blob, function fails.
+    bool getBlob(const char *key, std::vector<uint8_t> &blob);
+    std::vector<uint8_t> getBlob(const char *key); /// Less eficient but more simple in usage implemetation of `getBlob()`
+
+    /// Values larger than one NVS blob, split over `ARDUINONVS_CHUNK_SIZE`
+    /// shards stored under keys derived from a hash of `key`. `key` itself
+    /// holds a small header with the owner key and a CRC-32 of the value.
+    /// Reads and writes go through at most one shard-sized buffer, the
+    /// whole value is never loaded at once.
+    /// A rewrite puts its shards in a second generation and switches the
+    /// header last, a failed or interrupted one leaves the old value
+    /// readable. `readLargeBlob(key, out)` checks the CRC and returns 0 on
+    /// a mismatch, sub-range reads do not.
+    bool setLargeBlob(const char *key, const uint8_t *data, size_t length, bool forceCommit = true);
+    bool setLargeBlob(const char *key, Stream &src, size_t length, bool forceCommit = true);
+    size_t getLargeBlobSize(const char *key);
+    size_t readLargeBlob(const char *key, size_t offset, uint8_t *buf, size_t length); /// Reads a sub-range, returns bytes read
+    size_t readLargeBlob(const char *key, Print &out);                                /// Streams the whole value to `out`
+    bool eraseLargeBlob(const char *key, bool forceCommit = true);
+
+    // String keyed variants, the `const char *` ones above avoid the copy.
+    bool erase(const String &key, bool forceCommit = true) { return erase(key.c_str(), forceCommit); }
+
+    bool setInt(const String &key, uint8_t value, bool forceCommit = true) { return setInt(key.c_str(), value, forceCommit); }
+    bool setInt(const String &key, int16_t value, bool forceCommit = true) { return setInt(key.c_str(), value, forceCommit); }
+    bool setInt(const String &key, uint16_t value, bool forceCommit = true) { return setInt(key.c_str(), value, forceCommit); }
+    bool setInt(const String &key, int32_t value, bool forceCommit = true) { return setInt(key.c_str(), value, forceCommit); }
+    bool setInt(const String &key, uint32_t value, bool forceCommit = true) { return setInt(key.c_str(), value, forceCommit); }
+    bool setInt(const String &key, int64_t value, bool forceCommit = true) { return setInt(key.c_str(), value, forceCommit); }
+    bool setInt(const String &key, uint64_t value, bool forceCommit = true) { return setInt(key.c_str(), value, forceCommit); }
+    bool setFloat(const String &key, float value, bool forceCommit = true) { return setFloat(key.c_str(), value, forceCommit); }
+    bool setString(const String &key, const String &value, bool forceCommit = true)
+    {
+        return setString(key.c_str(), value.c_str(), forceCommit);
+    }
+    bool setBlob(const String &key, const uint8_t *blob, size_t length, bool forceCommit = true)
+    {
+        return setBlob(key.c_str(), blob, length, forceCommit);
+    }
+    bool setBlob(const String &key, const std::vector<uint8_t> &blob, bool forceCommit = true)
+    {
+        return setBlob(key.c_str(), blob, forceCommit);
+    }
+
+    int64_t getInt(const String &key, int64_t default_value = 0) { return getInt(key.c_str(), default_value); }
+    float getFloat(const String &key, float default_value = 0) { return getFloat(key.c_str(), default_value); }
+    bool getString(const String &key, String &res) { return getString(key.c_str(), res); }
+    String getString(const String &key) { return getString(key.c_str()); }
+    size_t getBlobSize(const String &key) { return getBlobSize(key.c_str()); }
+    bool getBlob(const String &key, uint8_t *blob, size_t length) { return getBlob(key.c_str(), blob, length); }
+    bool getBlob(const String &key, std::vector<uint8_t> &blob) { return getBlob(key.c_str(), blob); }
+    std::vector<uint8_t> getBlob(const String &key) { return getBlob(key.c_str()); }
+
+    /// Typed access through a compile-time checked key, see NvsKey.h.
+    template <typename T>
+    T get(const NvsKey<T> &key);
+    template <typename T>
+    bool set(const NvsKey<T> &key, typename NvsKey<T>::value_type value, bool forceCommit = true);
 
     bool commit();
+
+    /// Write-back cache. While enabled `set*()` and `erase()` only update RAM,
+    /// `forceCommit` is ignored. Dirty keys are written in one batch by
+    /// `commit()`, `flushIntervalMs` after the first pending write, or once
+    /// `dirtyThreshold` keys are pending (0 disables both triggers); values
+    /// equal to the stored ones are skipped. Cached keys are read from RAM.
+    /// The cache holds at most ARDUINONVS_CACHE_MAX_ENTRIES keys, a set that
+    /// finds it full of dirty keys waits for a flush.
+    /// A flush copies the dirty keys out and writes them without holding the
+    /// namespace lock, so reads and sets carry on from the cache meanwhile.
+    /// The interval flush runs on a writer task (see `setAsync()`), which a
+    /// non-zero `flushIntervalMs` starts with default placement.
+    /// Disabling the cache flushes it first.
+    bool setWriteBack(bool enable, size_t dirtyThreshold = 8, uint32_t flushIntervalMs = 5000);
+    bool isWriteBack() { return _write_back; }
+    size_t dirtyCount() { return _dirty_count; }
+
+    /// Asynchronous commits, turns the write-back cache on. `commitAsync()`,
+    /// the dirty threshold and the flush timer hand the flush to a writer
+    /// task, setters only update RAM and do not wait for the flash writes.
+    /// `commit()` queues a flush and waits.
+    /// Every flush completes all tickets issued before it started.
+    typedef uint32_t Ticket;
+    typedef void (*AsyncDoneCb)(ArduinoNvs *nvs, Ticket ticket, esp_err_t err);
+
+    bool setAsync(bool enable, BaseType_t core = -1, UBaseType_t priority = 1, uint32_t stackSize = 4096);
+    bool isAsync() { return _async; }
+    Ticket commitAsync();                                        /// 0 when async mode is off
+    bool isDone(Ticket ticket);
+    bool waitFor(Ticket ticket, uint32_t timeoutMs = portMAX_DELAY); /// false on timeout or when async mode ends
+    esp_err_t lastAsyncError() { return _async_error; }
+    void onAsyncDone(AsyncDoneCb cb) { _async_cb = cb; }         /// runs on the writer task, must not call commit()
+
+    struct CacheEntry
+    {
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        nvs_type_t type;           ///< NVS_TYPE_ANY marks a pending erase
+        bool dirty;
+        uint32_t seq;              ///< bumped by every set, a flush only cleans the value it wrote
+        uint64_t num;              ///< integer value, raw bytes as stored
+        std::vector<uint8_t> data; ///< string with terminator, or blob
+    };
+
+    /// Stages typed sets and erases, then applies them with one lock
+    /// acquisition and a single commit. Keys and values are copied when
+    /// staged, per-key results are available after `apply()`.
+    class Batch
+    {
+    public:
+        explicit Batch(ArduinoNvs &nvs) : _nvs(nvs) {}
+
+        Batch &setInt(const char *key, uint8_t value);
+        Batch &setInt(const char *key, int16_t value);
+        Batch &setInt(const char *key, uint16_t value);
+        Batch &setInt(const char *key, int32_t value);
+        Batch &setInt(const char *key, uint32_t value);
+        Batch &setInt(const char *key, int64_t value);
+        Batch &setInt(const char *key, uint64_t value);
+        Batch &setString(const char *key, const char *value);
+        Batch &setBlob(const char *key, const uint8_t *blob, size_t length);
+        Batch &erase(const char *key);
+
+        bool apply(); /// true when every entry and the commit succeeded, may be retried
+        void clear();
+
+        size_t size() { return _ops.size(); }
+        size_t failures();
+        const char *key(size_t index) { return _ops[index].key; }
+        /// Result of the entry in the last `apply()`, its staging error before that.
+        esp_err_t result(size_t index) { return index < _results.size() ? _results[index] : _staged[index]; }
+
+    private:
+        Batch &stage(const char *key, nvs_type_t type, const void *data, size_t length);
+
+        ArduinoNvs &_nvs;
+        std::vector<CacheEntry> _ops;
+        std::vector<esp_err_t> _staged;  ///< invalid entries, e.g. a too long key
+        std::vector<esp_err_t> _results; ///< of the last `apply()`
+    };
+
+    /// Flash cost of the writes made through this instance. NVS stores data
+    /// in 32 byte entries: integers take one, strings one plus their length
+    /// rounded up, blobs additionally rewrite a one entry index.
+    struct WriteStats
+    {
+        uint32_t sets;
+        uint32_t erases;
+        uint32_t commits;
+        uint32_t entries;   ///< 32 byte flash entries written
+        uint64_t bytes;     ///< entries * 32
+        uint64_t set_us;    ///< time spent in nvs_set_*()
+        uint64_t commit_us; ///< time spent in nvs_commit()
+    };
+    WriteStats writeStats();
+    void resetWriteStats();
+
+    /// Operational metrics of this instance. Latencies are caller visible
+    /// times per public call, bucket `i` counting calls that took
+    /// [2^i, 2^(i+1)) microseconds, the last one everything slower. Hot keys
+    /// count flash writes per key with the Space-Saving algorithm, a key may
+    /// be over-counted by at most the smallest tracked count. Lock figures
+    /// cover every instance of the namespace.
+    enum MetricOp
+    {
+        METRIC_GET,
+        METRIC_SET,
+        METRIC_ERASE,
+        METRIC_COMMIT,
+        METRIC_OPS
+    };
+    struct HotKey
+    {
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        uint32_t writes;
+    };
+    struct Metrics
+    {
+        uint32_t ops[METRIC_OPS];
+        uint32_t latency[METRIC_OPS][ARDUINONVS_HIST_BUCKETS];
+        WriteStats writes;
+        uint32_t lock_waits;
+        uint64_t lock_wait_us;
+        HotKey hot[ARDUINONVS_HOT_KEYS]; ///< most written first, unused slots empty
+        nvs_stats_t partition;           ///< nvs_get_stats() of the default partition
+        size_t namespace_entries;        ///< entries used by this namespace
+    };
+    Metrics metrics();
+    void resetMetrics();
+
+    /// Idle maintenance. NVS switches to a new page when the active one is
+    /// full and reclaims a page of erased entries when free pages run out,
+    /// both inside the set call that crossed the boundary. `maintain()`,
+    /// called from idle time, refreshes `gcStats()`. With a non-zero
+    /// `minPageFree` it also fills the active page with a scratch entry once
+    /// that many entries or less are left, so the switch happens now rather
+    /// than on the hot write path. That is opt-in: each forced switch writes
+    /// up to `minPageFree` entries that only a later GC reclaims, extra flash
+    /// wear. It is skipped while `nvs_get_stats()` reports less than a page
+    /// free. The active page is found by reading the page headers of the
+    /// default partition.
+    struct GcStats
+    {
+        uint32_t runs;             ///< maintain() calls
+        uint32_t compactions;      ///< page switches forced by maintain()
+        uint64_t compact_us;
+        size_t free_entries;       ///< nvs_get_stats() at the last run
+        uint32_t inline_gc;        ///< sets slower than ARDUINONVS_GC_SPIKE_US
+        uint32_t inline_gc_max_us;
+        uint64_t inline_gc_us;
+    };
+    bool maintain(size_t minPageFree = 0);
+    GcStats gcStats();
+
+    /// Boot snapshot. `preload()` reads the whole namespace once into a
+    /// sorted RAM index, later reads are answered from it without a flash
+    /// lookup, including reads of keys that do not exist. Longer strings and
+    /// blobs (see `ARDUINONVS_SNAPSHOT_MAX_VALUE`) are still read from flash.
+    /// The snapshot belongs to the namespace: every instance using it reads
+    /// from it, and writes through any of them invalidate the keys they
+    /// touch. `dropSnapshot()` frees it.
+    struct SnapshotStats
+    {
+        size_t entries;
+        size_t bytes;        ///< RAM held by index and values
+        uint32_t preload_us; ///< time spent in preload()
+        uint32_t read_us;    ///< average flash read per entry, measured by preload()
+        uint32_t hits;       ///< reads answered from RAM
+        uint32_t misses;     ///< reads that went to flash
+        int64_t saved_us;    ///< hits * read_us - preload_us
+    };
+    bool preload();
+    void dropSnapshot();
+    bool hasSnapshot();
+    SnapshotStats snapshotStats();
+
+    /// Namespace snapshots for provisioning, see tools/nvs_snapshot.py for
+    /// the format. `exportTo()` writes pending cached values first, exports
+    /// compressed values unpacked and leaves out compression markers and the
+    /// `maintain()` scratch key. Large blobs are exported as stored, their
+    /// header, shard and claim keys, and come back whole on import.
+    /// `importFrom()` checks the whole snapshot, then writes every entry in
+    /// one locked pass with a single commit, after erasing the namespace
+    /// when `eraseFirst` is set.
+    bool exportTo(std::vector<uint8_t> &out);
+    bool importFrom(const uint8_t *data, size_t length, bool eraseFirst = false);
+
+    /// Compression of large values. While enabled, `setString()` and
+    /// `setBlob()` values of at least `minLength` bytes are LZSS packed with
+    /// a 1 KiB window and stored as a blob behind an 8 byte header, when that
+    /// saves space. A marker key records each packed value and its unpacked
+    /// size, getters unpack only values it names, whether or not compression
+    /// is enabled, and `getBlobSize()` answers from it. Keys keep their NVS
+    /// type: an existing plain string is not packed, and a packed string
+    /// stays a blob. Batches store values plain.
+    struct CompressStats
+    {
+        uint32_t values;       ///< values stored packed
+        uint64_t raw_bytes;    ///< their original size
+        uint64_t stored_bytes; ///< their size on flash, headers included
+    };
+    void setCompression(bool enable, size_t minLength = 64);
+    bool isCompressing() { return _compress; }
+    CompressStats compressStats();
+
+    /// Opens the namespace on first use.
     bool isValid()
     {
-        return _nvs_valid;
+        return ensureOpen();
     }
 
+    /// Startup cost of all instances. Constructors only register the
+    /// namespace, flash init and `nvs_open()` run on first use.
+    struct InitStats
+    {
+        uint32_t instances;     ///< objects constructed
+        uint32_t construct_us;  ///< time spent in constructors
+        uint32_t flash_init_us; ///< the one nvs_flash_init(), including a reformat
+        bool reformatted;
+        uint32_t opens;         ///< nvs_open() calls, one per namespace in use
+        uint32_t open_us;
+        uint32_t first_use_us;  ///< time added to first operations, flash init and opens
+    };
+    static InitStats initStats();
+
+    /// Number of operations on this namespace that waited for its lock.
+    uint32_t lockContention() { return _lock->contention(); }
+
+    /// Serializes flash init and the namespace handle pool, data operations
+    /// use a reader/writer lock per namespace.
     static FEmbed::OSMutex& globalLock() { return nvs_global_lock; }
 protected:
     nvs_handle _nvs_handle;
 
 private:
-    bool _nvs_valid;
+    esp_err_t getIntAs(const char *key, nvs_type_t type, int64_t *value);
+    bool findInt(const char *key, nvs_type_t &type, int64_t &value);
+    bool getTyped(const char *key, nvs_type_t type, void *raw);
+    esp_err_t writeEntry(const char *key, nvs_type_t type, const void *data, size_t length);
+    bool setValue(const char *key, nvs_type_t type, const void *data, size_t length, bool forceCommit);
+    bool cacheWrite(const char *key, nvs_type_t type, const void *data, size_t length);
+    bool cacheRoom(const char *key, const char *other);
+    void cachePut(const char *key, nvs_type_t type, const void *data, size_t length);
+    bool makeCacheRoom();
+    bool cacheCommit();
+    esp_err_t putLocked(const char *key, nvs_type_t type, const void *data, size_t length);
+    CacheEntry *findCached(const char *key);
+    bool sameAsStored(const char *key, nvs_type_t type, const void *data, size_t length);
+    void evictClean();
+    void dropCached(const char *key);
+    esp_err_t flushLocked();
+    esp_err_t flushCache();
+    esp_err_t commitNow();
+    bool writeLargeBlob(const char *key, const uint8_t *data, Stream *src, size_t length, bool forceCommit);
+    void eraseShards(uint32_t base, int keep_gen, size_t keep_count);
+    bool applyBatch(std::vector<CacheEntry> &ops, const std::vector<esp_err_t> &staged,
+                    std::vector<esp_err_t> &results);
+    bool pack(uint8_t kind, const void *data, size_t length, bool force, std::vector<uint8_t> &out);
+    bool setVar(const char *key, nvs_type_t type, uint8_t kind, const void *data, size_t length, bool forceCommit);
+    bool readMarker(const char *key, uint64_t &marker);
+    uint8_t packedKind(const char *key, uint32_t *length);
+    size_t packedLength(const char *key, nvs_type_t type, const uint8_t *data, size_t size, uint8_t kind);
+    bool storedAsString(const char *key);
+    esp_err_t eraseMarker(const char *key);
+    enum SnapshotResult
+    {
+        SNAPSHOT_MISS,
+        SNAPSHOT_HIT,
+        SNAPSHOT_ABSENT
+    };
+    SnapshotResult snapshotLookup(const char *key, const NvsSnapshotEntry **entry);
+    const uint8_t *snapshotData(const NvsSnapshotEntry *entry);
+    void snapshotInvalidate(const char *key, bool erased);
+    void countSet(const char *key, nvs_type_t type, size_t length, int64_t us);
+    void countOp(MetricOp op, int64_t start_us);
+    friend class NvsOpTimer;
+    static void writerTask(void *param);
+    static void flushTimerCb(TimerHandle_t timer);
+    bool startWriter(BaseType_t core, UBaseType_t priority, uint32_t stackSize);
+    void stopWriter();
+    Ticket requestFlush();
+    void deleteFlushTimer();
+    nvs_type_t cachedType(const char *key);
+    void cacheType(const char *key, nvs_type_t type);
+    void clearTypeCache();
+
+    bool ensureOpen() { return _nvs_valid.load(std::memory_order_acquire) || open(); }
+    bool open();
+
+    std::atomic<bool> _nvs_valid; ///< set with release once `_nvs_handle` is usable
+    int64_t _open_retry_us;       ///< no open attempt before this time, under `nvs_global_lock`
+    bool _auto_reinit;
+    char _namespace[NVS_NS_NAME_MAX_SIZE];
+    NamespaceSlot *_slot; ///< shared by the instances of the namespace
+    NvsRWLock *_lock;     ///< `_slot->lock`
+    std::atomic<uint32_t> _type_cache[ARDUINONVS_TYPE_CACHE_SIZE];
+
+    bool _write_back;
+    size_t _dirty_threshold;
+    size_t _dirty_count;
+    TimerHandle_t _flush_timer;
+    std::vector<CacheEntry> _cache;
+    uint32_t _cache_seq;
+    FEmbed::OSMutex _flush_lock; ///< one flush at a time, taken before `_lock`
+
+    volatile bool _async;
+    volatile bool _writer_stop;
+    TaskHandle_t _writer;
+    SemaphoreHandle_t _writer_exit; ///< given by the writer on its way out
+    SemaphoreHandle_t _async_sem;
+    std::atomic<uint32_t> _async_requested;
+    std::atomic<uint32_t> _async_done;
+    std::atomic<uint32_t> _async_waiters; ///< tasks inside `waitFor()`
+    volatile esp_err_t _async_error;
+    AsyncDoneCb _async_cb;
+
+    WriteStats _write_stats;
+    GcStats _gc_stats;
+    bool _compress;
+    size_t _compress_min;
+    CompressStats _compress_stats;
+    std::atomic<uint32_t> _latency[METRIC_OPS][ARDUINONVS_HIST_BUCKETS];
+    HotKey _hot[ARDUINONVS_HOT_KEYS];
     static FEmbed::OSMutex nvs_global_lock;
 };
 
+template <typename T>
+T ArduinoNvs::get(const NvsKey<T> &key)
+{
+    typename NvsKey<T>::traits::raw_type raw;
+    if (!getTyped(key.name(), NvsKey<T>::traits::type, &raw))
+        return key.defaultValue();
+    return NvsKey<T>::traits::decode(raw);
+}
+
+template <typename T>
+bool ArduinoNvs::set(const NvsKey<T> &key, typename NvsKey<T>::value_type value, bool forceCommit)
+{
+    typename NvsKey<T>::traits::raw_type raw = NvsKey<T>::traits::encode(value);
+    return setValue(key.name(), NvsKey<T>::traits::type, &raw, sizeof(raw), forceCommit);
+}
+
 extern ArduinoNvs NVS;
 
 #endif
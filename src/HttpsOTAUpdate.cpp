@@ -8,98 +8,507 @@
 */
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
+#include <new>
 
 #include <osTask.h>
 
 #include "esp_http_client.h"
 #include "esp_https_ota.h"
+#include "esp_timer.h"
 
 #include "HttpsOTAUpdate.h"
 #include "Arduino.h"
-#define OTA_TASK_STACK_SIZE 9216
+#include "hal-misc.h"
 
-typedef void (*HttpEventCb)(HttpEvent_t*);
+#ifndef CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN
+#define CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN 16384
+#endif
+#ifndef CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN
+#define CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN 16384
+#endif
 
-static esp_http_client_config_t config; 
-static HttpEventCb cb;
-static EventGroupHandle_t ota_status = NULL;//check for ota status
-static EventBits_t set_bit;
+typedef struct
+{
+    esp_http_client_event_id_t event_id;
+    int data_len;
+    char header_key[HTTPS_OTA_EVENT_HEADER_LEN];
+    char header_value[HTTPS_OTA_EVENT_HEADER_LEN];
+    uint8_t data[HTTPS_OTA_EVENT_DATA_LEN];
+}HttpsOTAEventSlot_t;
+
+/**
+ * Single producer (OTA task) / single consumer (event task) ring, so the
+ * download path never blocks on a slow callback.
+ */
+struct HttpsOTAEventRing
+{
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    HttpsOTAEventSlot_t slots[HTTPS_OTA_EVENT_QUEUE_LEN];
+};
 
-const int OTA_IDLE_BIT = BIT0;
-const int OTA_UPDATING_BIT = BIT1;
-const int OTA_SUCCESS_BIT = BIT2;
-const int OTA_FAIL_BIT = BIT3;
+static_assert((HTTPS_OTA_EVENT_QUEUE_LEN & (HTTPS_OTA_EVENT_QUEUE_LEN - 1)) == 0,
+              "HTTPS_OTA_EVENT_QUEUE_LEN must be a power of two");
 
-esp_err_t http_event_handler(esp_http_client_event_t *event)
+static void copy_header(char *dst, const char *src)
 {
-    cb(event); 
-    return ESP_OK;
+    if(!src) {
+        dst[0] = 0;
+        return;
+    }
+    strncpy(dst, src, HTTPS_OTA_EVENT_HEADER_LEN - 1);
+    dst[HTTPS_OTA_EVENT_HEADER_LEN - 1] = 0;
+}
+
+HttpsOTAUpdateClass::HttpsOTAUpdateClass()
+    : _config(HTTPS_OTA_CONFIG_DEFAULT()),
+      _cb(NULL),
+      _complete_cb(NULL),
+      _queue(NULL),
+      _task(NULL),
+      _event_task(NULL),
+      _events(NULL),
+      _event_stop(false),
+      _state(HTTPS_OTA_IDLE),
+      _current_id(0),
+      _cancel_id(0),
+      _next_id(0),
+      _rate_limit(0),
+      _rate_burst(0),
+      _idle_rate(0),
+      _idle_quiet_ms(0),
+      _last_activity_ms(0),
+      _tokens(0),
+      _refill_us(0),
+      _throttled_us(0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+    memset(&_last_stats, 0, sizeof(_last_stats));
 }
 
-void https_ota_task(void *param)
+HttpsOTAUpdateClass::~HttpsOTAUpdateClass()
 {
-    if(ota_status) {
-        xEventGroupSetBits(ota_status, OTA_UPDATING_BIT);
-        xEventGroupClearBits(ota_status, OTA_IDLE_BIT);
+    end();
+}
+
+esp_err_t HttpsOTAUpdateClass::httpEventHandler(esp_http_client_event_t *event)
+{
+    HttpsOTAUpdateClass *ota = (HttpsOTAUpdateClass *)event->user_data;
+    if(!ota || !ota->_cb) {
+        return ESP_OK;
     }
-    esp_err_t ret = esp_https_ota((const esp_http_client_config_t *)param);
-    if(ret == ESP_OK) {
-        if(ota_status) {
-            xEventGroupClearBits(ota_status, OTA_UPDATING_BIT);
-            xEventGroupSetBits(ota_status, OTA_SUCCESS_BIT);
-        }
+    if(ota->_event_task) {
+        ota->postEvent(event);
     } else {
-        if(ota_status) {  
-            xEventGroupClearBits(ota_status, OTA_UPDATING_BIT);
-            xEventGroupSetBits(ota_status, OTA_FAIL_BIT);
+        ota->_cb(event);
+    }
+    return ESP_OK;
+}
+
+void HttpsOTAUpdateClass::postEvent(esp_http_client_event_t *event)
+{
+    HttpsOTAEventRing *ring = _events;
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    if(head - ring->tail.load(std::memory_order_acquire) >= HTTPS_OTA_EVENT_QUEUE_LEN) {
+        _stats.events_dropped++;
+        return;
+    }
+
+    HttpsOTAEventSlot_t *slot = &ring->slots[head & (HTTPS_OTA_EVENT_QUEUE_LEN - 1)];
+    slot->event_id = event->event_id;
+    slot->data_len = 0;
+    if(event->data && event->data_len > 0) {
+        slot->data_len = event->data_len < HTTPS_OTA_EVENT_DATA_LEN ? event->data_len : HTTPS_OTA_EVENT_DATA_LEN;
+        memcpy(slot->data, event->data, slot->data_len);
+    }
+    copy_header(slot->header_key, event->header_key);
+    copy_header(slot->header_value, event->header_value);
+
+    ring->head.store(head + 1, std::memory_order_release);
+    _stats.events_posted++;
+    xTaskNotifyGive(_event_task);
+}
+
+void HttpsOTAUpdateClass::eventTask(void *param)
+{
+    HttpsOTAUpdateClass *ota = (HttpsOTAUpdateClass *)param;
+    HttpsOTAEventRing *ring = ota->_events;
+
+    while(!ota->_event_stop) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        while(tail != ring->head.load(std::memory_order_acquire)) {
+            HttpsOTAEventSlot_t *slot = &ring->slots[tail & (HTTPS_OTA_EVENT_QUEUE_LEN - 1)];
+            esp_http_client_event_t event = {};
+            event.event_id = slot->event_id;
+            event.data = slot->data_len ? slot->data : NULL;
+            event.data_len = slot->data_len;
+            event.header_key = slot->header_key[0] ? slot->header_key : NULL;
+            event.header_value = slot->header_value[0] ? slot->header_value : NULL;
+            HttpEventCb cb = ota->_cb;
+            if(cb) {
+                cb(&event);
+            }
+            ring->tail.store(++tail, std::memory_order_release);
         }
     }
+    ota->_event_task = NULL;
     vTaskDelete(NULL);
 }
 
-HttpsOTAStatus_t HttpsOTAUpdateClass::status()
+bool HttpsOTAUpdateClass::startEventTask()
+{
+    if(_event_task || !_config.async_events) {
+        return true;
+    }
+    if(!_events) {
+        _events = new (std::nothrow) HttpsOTAEventRing;
+        if(!_events) {
+            log_e("OTA event ring alloc failed");
+            return false;
+        }
+    }
+    _events->head.store(0);
+    _events->tail.store(0);
+    _event_stop = false;
+    if (xTaskCreateUniversal(&HttpsOTAUpdateClass::eventTask, "https_ota_evt", HTTPS_OTA_EVENT_STACK_SIZE, this,
+                             _config.event_priority, &_event_task, _config.core) != pdPASS) {
+        log_e("Couldn't create ota event task");
+        _event_task = NULL;
+        return false;
+    }
+    return true;
+}
+
+void HttpsOTAUpdateClass::stopEventTask()
+{
+    if(_event_task) {
+        _event_stop = true;
+        xTaskNotifyGive(_event_task);
+        while(_event_task) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+    delete _events;
+    _events = NULL;
+}
+
+void HttpsOTAUpdateClass::throttle(size_t bytes)
+{
+    // Token bucket, refilled with the time since the last chunk. Holding
+    // back perform() lets the TCP window close, which shapes the link.
+    _tokens -= bytes;
+    for(;;) {
+        int64_t now = esp_timer_get_time();
+        uint32_t rate = _rate_limit;
+        uint32_t quiet_ms = _idle_quiet_ms;
+        if(quiet_ms && (uint32_t)(now / 1000) - _last_activity_ms >= quiet_ms) {
+            rate = _idle_rate;
+        }
+        if(rate == 0) {
+            _tokens = 0;
+            _refill_us = now;
+            return;
+        }
+
+        int64_t burst = _rate_burst ? _rate_burst : rate;
+        // Only the time the whole tokens stand for is consumed, the
+        // remainder keeps counting towards the next one.
+        int64_t earned = (now - _refill_us) * rate / 1000000;
+        _tokens += earned;
+        _refill_us += earned * 1000000 / rate;
+        if(_tokens > burst) {
+            _tokens = burst;
+            _refill_us = now;
+        }
+        if(_tokens >= 0 || _cancel_id == _current_id) {
+            return;
+        }
+
+        uint32_t wait_ms = (uint32_t)(-_tokens * 1000 / rate) + 1;
+        if(wait_ms > 100) {
+            wait_ms = 100;      // stay responsive to cancel() and rate changes
+        }
+        TickType_t ticks = pdMS_TO_TICKS(wait_ms);
+        vTaskDelay(ticks ? ticks : 1);  // never just yield, idle must run
+        _throttled_us += esp_timer_get_time() - now;
+        _stats.throttled_ms = (uint32_t)(_throttled_us / 1000);
+    }
+}
+
+void HttpsOTAUpdateClass::setRateLimit(uint32_t bytes_per_sec, uint32_t burst)
+{
+    _rate_burst = burst;
+    _rate_limit = bytes_per_sec;
+}
+
+void HttpsOTAUpdateClass::setIdleRate(uint32_t idle_bytes_per_sec, uint32_t quiet_ms)
+{
+    _idle_rate = idle_bytes_per_sec;
+    _idle_quiet_ms = quiet_ms;
+}
+
+void HttpsOTAUpdateClass::notifyNetworkActivity()
+{
+    _last_activity_ms = (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+esp_err_t HttpsOTAUpdateClass::run(const HttpsOTARequest_t &req)
+{
+    esp_http_client_config_t http_config = {};
+    http_config.url = req.url;
+    http_config.cert_pem = req.cert_pem;
+    http_config.skip_cert_common_name_check = req.skip_cert_common_name_check;
+    http_config.event_handler = httpEventHandler;
+    http_config.user_data = this;
+    http_config.buffer_size = _config.rx_buffer_size;
+    http_config.buffer_size_tx = _config.tx_buffer_size;
+
+    esp_https_ota_config_t ota_config = {};
+    ota_config.http_config = &http_config;
+
+    esp_https_ota_handle_t handle = NULL;
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = esp_https_ota_begin(&ota_config, &handle);
+    if(ret != ESP_OK) {
+        log_e("OTA begin failed(%d)", ret);
+        _stats.elapsed_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+        return ret;
+    }
+    _stats.connect_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+    _stats.image_size = esp_https_ota_get_image_size(handle);
+    _tokens = 0;
+    _refill_us = esp_timer_get_time();
+    _throttled_us = 0;
+    int read = 0;
+    do {
+        if(_cancel_id == req.id) {
+            ret = ESP_ERR_INVALID_STATE;
+            break;
+        }
+        ret = esp_https_ota_perform(handle);
+        int now_read = esp_https_ota_get_image_len_read(handle);
+        throttle(now_read - read);
+        read = now_read;
+    } while(ret == ESP_ERR_HTTPS_OTA_IN_PROGRESS);
+
+    _stats.bytes = esp_https_ota_get_image_len_read(handle);
+    if(ret == ESP_OK && !esp_https_ota_is_complete_data_received(handle)) {
+        log_e("OTA image incomplete");
+        ret = ESP_FAIL;
+    }
+    // Benchmark runs verify the download but leave the boot partition alone.
+    if(ret == ESP_OK && !_config.benchmark) {
+        ret = esp_https_ota_finish(handle);
+    } else {
+        esp_https_ota_abort(handle);
+    }
+
+    _stats.elapsed_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+    _stats.throughput = _stats.elapsed_ms ? (uint32_t)((uint64_t)_stats.bytes * 1000 / _stats.elapsed_ms) : 0;
+    log_i("OTA%s %u bytes in %u ms (connect %u ms), %u B/s (core %d, prio %u, stack %u, rx %d, tx %d, tls in %d out %d)",
+          _config.benchmark ? " benchmark" : "",
+          (unsigned)_stats.bytes, (unsigned)_stats.elapsed_ms, (unsigned)_stats.connect_ms,
+          (unsigned)_stats.throughput,
+          (int)_config.core, (unsigned)_config.priority, (unsigned)_config.stack_size,
+          http_config.buffer_size, http_config.buffer_size_tx,
+          CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN, CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN);
+    return ret;
+}
+
+void HttpsOTAUpdateClass::task(void *param)
 {
-    if(ota_status) {     
-        set_bit =  xEventGroupGetBits(ota_status);
-        if(set_bit == OTA_IDLE_BIT) {
-            return HTTPS_OTA_IDLE;
+    HttpsOTAUpdateClass *ota = (HttpsOTAUpdateClass *)param;
+    HttpsOTARequest_t req;
+
+    while(xQueuePeek(ota->_queue, &req, portMAX_DELAY) == pdTRUE) {
+        // Taken off the queue under the lock, so cancel() finds a request
+        // either still queued or as _current_id, never in between.
+        {
+            FEmbed::OSMutexLocker locker(ota->_lock);
+            if(xQueueReceive(ota->_queue, &req, 0) != pdTRUE) {
+                continue;   // flushed by cancel()
+            }
+            if(req.url == NULL) {
+                break;      // stop request from end()
+            }
+            ota->_current_id = req.id;
+            ota->_state = ota->_cancel_id == req.id ? HTTPS_OTA_CANCELLED : HTTPS_OTA_UPDATING;
+        }
+        if(ota->_state == HTTPS_OTA_CANCELLED) {
+            continue;
         }
-        if(set_bit == OTA_UPDATING_BIT) {
-            return HTTPS_OTA_UPDATING;
+        memset(&ota->_stats, 0, sizeof(ota->_stats));
+        ota->_stats.request_id = req.id;
+        esp_err_t ret = ota->run(req);
+        ota->_stats.result = ret;
+        HttpsOTAStats_t stats;
+        {
+            FEmbed::OSMutexLocker locker(ota->_lock);
+            if(ret == ESP_OK) {
+                ota->_state = HTTPS_OTA_SUCCESS;
+            } else if(ota->_cancel_id == req.id) {
+                ota->_state = HTTPS_OTA_CANCELLED;
+            } else {
+                ota->_state = HTTPS_OTA_FAIL;
+            }
+            ota->_last_stats = ota->_stats;
+            stats = ota->_stats;
         }
-        if(set_bit == OTA_SUCCESS_BIT) {
-            return HTTPS_OTA_SUCCESS;
+        CompleteCb complete = ota->_complete_cb;
+        if(complete) {
+            complete(&stats);
         }
-        if(set_bit == OTA_FAIL_BIT) {
-            return HTTPS_OTA_FAIL;
+    }
+    ota->_task = NULL;
+    vTaskDelete(NULL);
+}
+
+bool HttpsOTAUpdateClass::startWorker()
+{
+    if(_task) {
+        return true;
+    }
+    if(!startEventTask()) {
+        // Fall back to calling the callback from the OTA task.
+        log_w("OTA events delivered synchronously");
+    }
+    if(!_queue) {
+        _queue = xQueueCreate(HTTPS_OTA_QUEUE_LEN, sizeof(HttpsOTARequest_t));
+        if(!_queue) {
+            log_e("OTA queue create failed");
+            return false;
         }
     }
-    return HTTPS_OTA_ERR;
+    if (xTaskCreateUniversal(&HttpsOTAUpdateClass::task, "https_ota_task", _config.stack_size, this,
+                             _config.priority, &_task, _config.core) != pdPASS) {
+        log_e("Couldn't create ota task\n");
+        _task = NULL;
+        return false;
+    }
+    return true;
+}
+
+HttpsOTAStatus_t HttpsOTAUpdateClass::status()
+{
+    return _state;
 }
 
 void HttpsOTAUpdateClass::onHttpEvent(HttpEventCb cbEvent)
 {
-    cb = cbEvent;
+    _cb = cbEvent;
+}
+
+void HttpsOTAUpdateClass::onComplete(CompleteCb cb)
+{
+    _complete_cb = cb;
+}
+
+void HttpsOTAUpdateClass::setConfig(const HttpsOTAConfig_t &cfg)
+{
+    _config = cfg;
+}
+
+const HttpsOTAConfig_t &HttpsOTAUpdateClass::getConfig()
+{
+    return _config;
+}
+
+HttpsOTAStats_t HttpsOTAUpdateClass::lastStats()
+{
+    FEmbed::OSMutexLocker locker(_lock);
+    return _last_stats;
+}
+
+size_t HttpsOTAUpdateClass::pending()
+{
+    return _queue ? uxQueueMessagesWaiting(_queue) : 0;
+}
+
+uint32_t HttpsOTAUpdateClass::enqueue(const char *url, const char *cert_pem, bool skip_cert_common_name_check)
+{
+    if(!url) {
+        return 0;
+    }
+    if(!startWorker()) {
+        return 0;
+    }
+
+    // Under _lock so cancelRequest() rotating the queue cannot fill it
+    // under us and drop either request.
+    FEmbed::OSMutexLocker locker(_lock);
+    HttpsOTARequest_t req;
+    if(++_next_id == 0) {
+        _next_id = 1;
+    }
+    req.id = _next_id;
+    req.url = url;
+    req.cert_pem = cert_pem;
+    req.skip_cert_common_name_check = skip_cert_common_name_check;
+    if(xQueueSend(_queue, &req, 0) != pdTRUE) {
+        log_e("OTA queue full");
+        return 0;
+    }
+    return req.id;
 }
 
 void HttpsOTAUpdateClass::begin(const char *url, const char *cert_pem, bool skip_cert_common_name_check)
 {
-    config.url = url;
-    config.cert_pem = cert_pem; 
-    config.skip_cert_common_name_check = skip_cert_common_name_check;
-    config.event_handler = http_event_handler;
+    enqueue(url, cert_pem, skip_cert_common_name_check);
+}
+
+void HttpsOTAUpdateClass::cancel(bool flush)
+{
+    FEmbed::OSMutexLocker locker(_lock);
+    if(flush && _queue) {
+        xQueueReset(_queue);
+    }
+    // A finished id is harmless here, the next request has a new one.
+    _cancel_id = _current_id;
+}
 
-    if(!ota_status) {
-        ota_status = xEventGroupCreate();
-        if(!ota_status) {
-            log_e("OTA Event Group Create Failed");
+bool HttpsOTAUpdateClass::cancelRequest(uint32_t id)
+{
+    if(id == 0) {
+        return false;
+    }
+    FEmbed::OSMutexLocker locker(_lock);
+    if(id == _current_id && _state == HTTPS_OTA_UPDATING) {
+        _cancel_id = id;
+        return true;
+    }
+    // Rotate the queue once, dropping the request. The OTA task only
+    // dequeues under _lock.
+    bool found = false;
+    size_t n = _queue ? uxQueueMessagesWaiting(_queue) : 0;
+    HttpsOTARequest_t req;
+    for(size_t i = 0; i < n && xQueueReceive(_queue, &req, 0) == pdTRUE; i++) {
+        if(req.id == id) {
+            found = true;
+        } else {
+            xQueueSend(_queue, &req, 0);
+        }
+    }
+    return found;
+}
+
+void HttpsOTAUpdateClass::end()
+{
+    if(_task) {
+        cancel(true);
+        HttpsOTARequest_t stop = {};
+        xQueueSend(_queue, &stop, portMAX_DELAY);
+        while(_task) {
+            vTaskDelay(pdMS_TO_TICKS(10));
         }
-        xEventGroupSetBits(ota_status, OTA_IDLE_BIT);
     }
- 
-    if (xTaskCreate(&https_ota_task, "https_ota_task", OTA_TASK_STACK_SIZE, &config, 5, NULL) != pdPASS) {
-        log_e("Couldn't create ota task\n"); 
+    stopEventTask();
+    if(_queue) {
+        vQueueDelete(_queue);
+        _queue = NULL;
     }
+    _state = HTTPS_OTA_IDLE;
 }
 
 HttpsOTAUpdateClass HttpsOTA;
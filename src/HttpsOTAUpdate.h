@@ -1,4 +1,8 @@
+#include <osMutex.h>
 #include "esp_http_client.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
 #define HttpEvent_t esp_http_client_event_t
 
 typedef enum
@@ -7,15 +11,208 @@ typedef enum
     HTTPS_OTA_UPDATING,
     HTTPS_OTA_SUCCESS,
     HTTPS_OTA_FAIL,
-    HTTPS_OTA_ERR
+    HTTPS_OTA_ERR,
+    HTTPS_OTA_CANCELLED
 }HttpsOTAStatus_t;
 
+/**
+ * OTA worker task placement and HTTP buffer sizing.
+ *
+ * TLS record sizes are fixed by mbedTLS at build time
+ * (CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN/OUT_CONTENT_LEN), they are only
+ * reported here so benchmark runs can be compared.
+ */
+typedef struct
+{
+    BaseType_t core;            ///< core to pin the OTA task to, -1 for no affinity
+    UBaseType_t priority;       ///< OTA task priority
+    uint32_t stack_size;        ///< OTA task stack size in bytes
+    int rx_buffer_size;         ///< HTTP receive buffer, 0 keeps esp_http_client default
+    int tx_buffer_size;         ///< HTTP transmit buffer, 0 keeps esp_http_client default
+    bool benchmark;             ///< download and verify only, never switch boot partition
+    bool async_events;          ///< deliver onHttpEvent callbacks from a separate task, see below
+    UBaseType_t event_priority; ///< priority of the event delivery task
+}HttpsOTAConfig_t;
+
+#define HTTPS_OTA_CONFIG_DEFAULT() { \
+    .core = -1,                      \
+    .priority = 5,                   \
+    .stack_size = 9216,              \
+    .rx_buffer_size = 0,             \
+    .tx_buffer_size = 0,             \
+    .benchmark = false,              \
+    .async_events = false,           \
+    .event_priority = 1,             \
+}
+
+/**
+ * Result of the last OTA run, filled when the task finishes.
+ */
+typedef struct
+{
+    uint32_t request_id;        ///< id returned by enqueue()
+    size_t bytes;               ///< image bytes received
+    int image_size;             ///< size announced by the server, -1 if unknown
+    uint32_t connect_ms;        ///< time until the TLS session and image header were ready
+    uint32_t elapsed_ms;        ///< time from connect to finish
+    uint32_t throughput;        ///< bytes per second
+    esp_err_t result;           ///< esp_https_ota result code
+    uint32_t events_posted;     ///< HTTP events queued for async delivery
+    uint32_t events_dropped;    ///< HTTP events lost because the queue was full
+    uint32_t throttled_ms;      ///< time spent waiting on the rate limiter
+}HttpsOTAStats_t;
+
+/**
+ * One queued download. The strings are not copied and must stay valid
+ * until the request has been processed.
+ */
+typedef struct
+{
+    uint32_t id;
+    const char *url;
+    const char *cert_pem;
+    bool skip_cert_common_name_check;
+}HttpsOTARequest_t;
+
+#ifndef HTTPS_OTA_QUEUE_LEN
+#define HTTPS_OTA_QUEUE_LEN 4
+#endif
+
+/**
+ * Asynchronous event delivery (opt-in through `async_events`) copies each
+ * event into a fixed slot, header strings and ON_DATA payloads longer than
+ * the slot are truncated and `client` is always NULL in the delivered event.
+ * Callbacks that use `client` need the default synchronous delivery.
+ */
+#ifndef HTTPS_OTA_EVENT_QUEUE_LEN
+#define HTTPS_OTA_EVENT_QUEUE_LEN 16            // must be a power of two
+#endif
+#ifndef HTTPS_OTA_EVENT_HEADER_LEN
+#define HTTPS_OTA_EVENT_HEADER_LEN 64
+#endif
+#ifndef HTTPS_OTA_EVENT_DATA_LEN
+#define HTTPS_OTA_EVENT_DATA_LEN 64
+#endif
+#ifndef HTTPS_OTA_EVENT_STACK_SIZE
+#define HTTPS_OTA_EVENT_STACK_SIZE 3072
+#endif
+
+struct HttpsOTAEventRing;
+
+/**
+ * HTTPS OTA engine.
+ *
+ * Each instance owns one worker task which is created on the first
+ * request and then serves queued requests back to back. State moves
+ * IDLE -> UPDATING -> SUCCESS/FAIL/CANCELLED and back to UPDATING when the
+ * next queued request starts.
+ */
 class HttpsOTAUpdateClass {
 
     public:
+    typedef void (*HttpEventCb)(HttpEvent_t *);
+    typedef void (*CompleteCb)(const HttpsOTAStats_t *);
+
+    HttpsOTAUpdateClass();
+    ~HttpsOTAUpdateClass();
+
     void begin(const char *url, const char *cert_pem, bool skip_cert_common_name_check = true);
     void onHttpEvent(void (*http_event_cb_t)(HttpEvent_t *));
+
+    /**
+     * Called from the OTA task with the report of every finished request,
+     * successful or not.
+     */
+    void onComplete(CompleteCb cb);
     HttpsOTAStatus_t status();
+
+    /**
+     * Queue a download behind the ones already pending.
+     * @return request id, 0 if the queue is full or the worker could not start
+     */
+    uint32_t enqueue(const char *url, const char *cert_pem, bool skip_cert_common_name_check = true);
+
+    /**
+     * Abort the running download, and drop the pending ones when flush is set.
+     */
+    void cancel(bool flush = true);
+
+    /**
+     * Abort one request, running or still queued.
+     * @return false if the id is neither running nor pending
+     */
+    bool cancelRequest(uint32_t id);
+
+    /**
+     * Cancel everything and stop the worker task.
+     */
+    void end();
+
+    /**
+     * Limit the download rate, takes effect immediately.
+     * @param bytes_per_sec 0 for unlimited
+     * @param burst bucket size in bytes, 0 for one second worth of data
+     */
+    void setRateLimit(uint32_t bytes_per_sec, uint32_t burst = 0);
+
+    /**
+     * Switch to idle_bytes_per_sec (0 for unlimited) once no other network
+     * activity was reported for quiet_ms. quiet_ms = 0 disables idle mode.
+     */
+    void setIdleRate(uint32_t idle_bytes_per_sec, uint32_t quiet_ms);
+
+    /**
+     * Report traffic from other sockets, e.g. on each MQTT publish, so idle
+     * mode falls back to the normal rate limit.
+     */
+    void notifyNetworkActivity();
+
+    size_t pending();
+    uint32_t currentRequest() { return _current_id; }
+
+    /**
+     * Set task placement and buffer sizes. Placement takes effect when the
+     * worker is started, buffer sizes on the next request.
+     */
+    void setConfig(const HttpsOTAConfig_t &cfg);
+    const HttpsOTAConfig_t &getConfig();
+    HttpsOTAStats_t lastStats();
+
+    private:
+    static void task(void *param);
+    static void eventTask(void *param);
+    static esp_err_t httpEventHandler(esp_http_client_event_t *event);
+    void postEvent(esp_http_client_event_t *event);
+    bool startEventTask();
+    void stopEventTask();
+    esp_err_t run(const HttpsOTARequest_t &req);
+    void throttle(size_t bytes);
+    bool startWorker();
+
+    HttpsOTAConfig_t _config;
+    HttpsOTAStats_t _stats;         ///< written by the OTA task while a request runs
+    HttpsOTAStats_t _last_stats;    ///< published copy, guarded by `_lock`
+    FEmbed::OSMutex _lock;          ///< queue access, `_next_id`, `_current_id`/`_cancel_id` and `_last_stats`
+    HttpEventCb _cb;
+    CompleteCb _complete_cb;
+    QueueHandle_t _queue;
+    TaskHandle_t _task;
+    TaskHandle_t _event_task;
+    HttpsOTAEventRing *_events;
+    volatile bool _event_stop;
+    volatile HttpsOTAStatus_t _state;
+    volatile uint32_t _current_id;
+    volatile uint32_t _cancel_id;
+    uint32_t _next_id;
+
+    volatile uint32_t _rate_limit;
+    volatile uint32_t _rate_burst;
+    volatile uint32_t _idle_rate;
+    volatile uint32_t _idle_quiet_ms;
+    volatile uint32_t _last_activity_ms;    ///< 32 bit so other tasks write it atomically
+    int64_t _tokens;
+    int64_t _refill_us;
+    int64_t _throttled_us;
 };
 
 extern HttpsOTAUpdateClass HttpsOTA;
@@ -0,0 +1,252 @@
+/*
+ * NvsConfigStore.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include "NvsConfigStore.h"
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "NvsCfg"
+#else
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define log_w(fmt, ...) fprintf(stderr, "NvsCfg: " fmt "\n", ##__VA_ARGS__)
+#endif
+
+/// FNV-1a with the basis offset by the displacement `seed`, then the
+/// murmur3 finalizer: plain FNV-1a keeps the low bits of keys that only
+/// differ in high bits equal for every seed, `% count` needs them mixed.
+/// Must match tools/nvs_cfgstore_gen.py.
+static uint32_t cfg_hash(uint32_t seed, const char *key, size_t length)
+{
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < length; i++)
+    {
+        h ^= (uint8_t)key[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+NvsConfigStore::NvsConfigStore()
+    : _base(NULL), _size(0), _header(NULL), _g(NULL), _entries(NULL)
+{
+#ifdef ESP_PLATFORM
+    _mmap = 0;
+#else
+    _map_size = 0;
+#endif
+}
+
+NvsConfigStore::~NvsConfigStore()
+{
+    end();
+}
+
+bool NvsConfigStore::begin(const char *partition)
+{
+    end();
+#ifdef ESP_PLATFORM
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                           ESP_PARTITION_SUBTYPE_ANY, partition);
+    if (!part)
+    {
+        log_w("partition %s not found.", partition);
+        return false;
+    }
+    const void *ptr;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    esp_err_t err = esp_partition_mmap(part, 0, part->size, ESP_PARTITION_MMAP_DATA, &ptr, &_mmap);
+#else
+    esp_err_t err = esp_partition_mmap(part, 0, part->size, SPI_FLASH_MMAP_DATA, &ptr, &_mmap);
+#endif
+    if (err != ESP_OK)
+    {
+        log_w("mmap %s failed(%d).", partition, err);
+        return false;
+    }
+    _base = (const uint8_t *)ptr;
+    _size = part->size;
+#else
+    int fd = open(partition, O_RDONLY);
+    if (fd < 0)
+    {
+        log_w("open %s failed.", partition);
+        return false;
+    }
+    struct stat st;
+    void *ptr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+    {
+        log_w("mmap %s failed.", partition);
+        return false;
+    }
+    _base = (const uint8_t *)ptr;
+    _size = st.st_size;
+    _map_size = st.st_size;
+#endif
+
+    const NvsConfigHeader *hdr = (const NvsConfigHeader *)_base;
+    bool ok = _size >= sizeof(NvsConfigHeader) && hdr->magic == NVS_CONFIG_MAGIC &&
+              hdr->version == NVS_CONFIG_VERSION && hdr->entry_size == sizeof(NvsConfigEntry) &&
+              hdr->size <= _size && ((hdr->g_offset | hdr->entries_offset) & 3) == 0 &&
+              hdr->g_offset + (uint64_t)hdr->count * sizeof(int32_t) <= hdr->size &&
+              hdr->entries_offset + (uint64_t)hdr->count * sizeof(NvsConfigEntry) <= hdr->size;
+    if (!ok)
+    {
+        log_w("%s holds no valid config image.", partition);
+        end();
+        return false;
+    }
+    _header = hdr;
+    _size = hdr->size;
+    _g = (const int32_t *)(_base + hdr->g_offset);
+    _entries = (const NvsConfigEntry *)(_base + hdr->entries_offset);
+    return true;
+}
+
+void NvsConfigStore::end()
+{
+    if (!_base)
+        return;
+#ifdef ESP_PLATFORM
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    esp_partition_munmap(_mmap);
+#else
+    spi_flash_munmap(_mmap);
+#endif
+    _mmap = 0;
+#else
+    munmap((void *)_base, _map_size);
+    _map_size = 0;
+#endif
+    _base = NULL;
+    _size = 0;
+    _header = NULL;
+    _g = NULL;
+    _entries = NULL;
+}
+
+/// Entries sit in hash order: the first hash picks a displacement, which
+/// either names the slot directly (negative) or seeds the second hash.
+const NvsConfigEntry *NvsConfigStore::find(const char *key)
+{
+    if (!_header || _header->count == 0)
+        return NULL;
+    uint32_t n = _header->count;
+    size_t length = strlen(key);
+    int32_t d = _g[cfg_hash(0, key, length) % n];
+    uint32_t index = d < 0 ? (uint32_t)(-d - 1) : cfg_hash(d, key, length) % n;
+    if (index >= n)
+        return NULL;
+    const NvsConfigEntry *e = &_entries[index];
+    if (e->key_length != length || e->key_offset + (uint64_t)length > _size ||
+        e->value_offset + (uint64_t)e->value_length > _size)
+        return NULL;
+    if (memcmp(_base + e->key_offset, key, length) != 0)
+        return NULL;
+    return e;
+}
+
+int64_t NvsConfigStore::getInt(const char *key, int64_t default_value)
+{
+    const NvsConfigEntry *e = find(key);
+    if (!e || e->type == NVS_CFG_STR || e->type == NVS_CFG_BLOB || e->value_length < (e->type & 0x0f))
+        return default_value;
+    uint64_t raw = 0;
+    memcpy(&raw, _base + e->value_offset, e->type & 0x0f);
+    switch (e->type)
+    {
+    case NVS_CFG_U8:
+        return (uint8_t)raw;
+    case NVS_CFG_I8:
+        return (int8_t)raw;
+    case NVS_CFG_U16:
+        return (uint16_t)raw;
+    case NVS_CFG_I16:
+        return (int16_t)raw;
+    case NVS_CFG_U32:
+        return (uint32_t)raw;
+    case NVS_CFG_I32:
+        return (int32_t)raw;
+    case NVS_CFG_U64:
+    case NVS_CFG_I64:
+        return (int64_t)raw;
+    default:
+        return default_value;
+    }
+}
+
+const char *NvsConfigStore::getString(const char *key)
+{
+    const NvsConfigEntry *e = find(key);
+    if (!e || e->type != NVS_CFG_STR || e->value_length == 0)
+        return NULL;
+    const char *value = (const char *)_base + e->value_offset;
+    return value[e->value_length - 1] == 0 ? value : NULL;
+}
+
+const uint8_t *NvsConfigStore::getBlob(const char *key, size_t *length)
+{
+    const NvsConfigEntry *e = find(key);
+    if (!e || e->type != NVS_CFG_BLOB)
+        return NULL;
+    if (length)
+        *length = e->value_length;
+    return _base + e->value_offset;
+}
+
+size_t NvsConfigStore::getBlobSize(const char *key)
+{
+    size_t length = 0;
+    return getBlob(key, &length) ? length : 0;
+}
+
+bool NvsConfigStore::getBlob(const char *key, uint8_t *blob, size_t length)
+{
+    size_t stored;
+    const uint8_t *data = getBlob(key, &stored);
+    if (!data || stored > length)
+        return false;
+    memcpy(blob, data, stored);
+    return true;
+}
+
+#ifdef ESP_PLATFORM
+bool NvsConfigStore::getString(const char *key, String &res)
+{
+    const char *value = getString(key);
+    if (!value)
+        return false;
+    res = value;
+    return true;
+}
+#endif
@@ -0,0 +1,126 @@
+/*
+ * NvsConfigStore.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef __NVS_CONFIG_STORE_H__
+#define __NVS_CONFIG_STORE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef ESP_PLATFORM
+#include <Arduino.h>
+#include "esp_idf_version.h"
+extern "C"
+{
+#include "esp_partition.h"
+}
+#endif
+
+#define NVS_CONFIG_MAGIC 0x4746434e // "NCFG"
+#define NVS_CONFIG_VERSION 2
+
+/// Value types, numerically equal to nvs_type_t.
+enum NvsConfigType : uint8_t
+{
+    NVS_CFG_U8 = 0x01,
+    NVS_CFG_I8 = 0x11,
+    NVS_CFG_U16 = 0x02,
+    NVS_CFG_I16 = 0x12,
+    NVS_CFG_U32 = 0x04,
+    NVS_CFG_I32 = 0x14,
+    NVS_CFG_U64 = 0x08,
+    NVS_CFG_I64 = 0x18,
+    NVS_CFG_STR = 0x21,
+    NVS_CFG_BLOB = 0x42,
+};
+
+/// Image layout, little endian, every offset relative to the image start
+/// and 4 byte aligned. See tools/nvs_cfgstore_gen.py.
+struct NvsConfigHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;     ///< sizeof(NvsConfigEntry)
+    uint32_t count;
+    uint32_t g_offset;       ///< int32_t[count] hash displacement table
+    uint32_t entries_offset; ///< NvsConfigEntry[count] in hash order
+    uint32_t size;           ///< bytes used by the image
+    uint32_t reserved[2];
+};
+
+struct NvsConfigEntry
+{
+    uint32_t key_offset;
+    uint32_t value_offset;
+    uint32_t value_length; ///< strings include the terminator
+    uint16_t key_length;
+    uint8_t type;          ///< NvsConfigType
+    uint8_t reserved;
+};
+
+/**
+ * Read-only key/value store in its own flash partition, for large static
+ * configuration. Images are built on the host by tools/nvs_cfgstore_gen.py.
+ *
+ * The partition is memory mapped. A lookup hashes the key twice through a
+ * minimal perfect hash, checks the one candidate entry and returns pointers
+ * straight into flash, values are never copied to RAM unless asked. On a
+ * host build `begin()` takes a file path and maps it with mmap().
+ * Returned pointers stay valid until `end()`.
+ */
+class NvsConfigStore
+{
+public:
+    NvsConfigStore();
+    ~NvsConfigStore();
+
+    bool begin(const char *partition = "config"); /// Partition label, or file path on the host
+    void end();
+    bool isValid() { return _header != NULL; }
+    size_t count() { return _header ? _header->count : 0; }
+
+    bool contains(const char *key) { return find(key) != NULL; }
+    int64_t getInt(const char *key, int64_t default_value = 0);
+    const char *getString(const char *key);                  /// NULL when missing
+    const uint8_t *getBlob(const char *key, size_t *length); /// NULL when missing
+    size_t getBlobSize(const char *key);
+    bool getBlob(const char *key, uint8_t *blob, size_t length); /// Copies, like ArduinoNvs::getBlob()
+#ifdef ESP_PLATFORM
+    bool getString(const char *key, String &res);
+#endif
+
+private:
+    const NvsConfigEntry *find(const char *key);
+
+    const uint8_t *_base;
+    size_t _size;
+    const NvsConfigHeader *_header;
+    const int32_t *_g;
+    const NvsConfigEntry *_entries;
+#ifdef ESP_PLATFORM
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    esp_partition_mmap_handle_t _mmap;
+#else
+    spi_flash_mmap_handle_t _mmap;
+#endif
+#else
+    size_t _map_size; ///< length passed to mmap(), `_size` shrinks to the image
+#endif
+};
+
+#endif
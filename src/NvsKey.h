@@ -0,0 +1,140 @@
+/*
+ * NvsKey.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __NVS_KEY_H__
+#define __NVS_KEY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+extern "C"
+{
+#include "nvs.h"
+}
+
+/**
+ * Storage mapping of the value types usable with NvsKey. Floating point
+ * values are stored bit-cast into the integer of the same width, not as
+ * blobs, so they cost a single entry and no type probing.
+ */
+template <typename T>
+struct NvsTraits;
+
+#define NVS_TRAITS_INT(T, NVS_TYPE)                          \
+    template <>                                              \
+    struct NvsTraits<T>                                      \
+    {                                                        \
+        typedef T raw_type;                                  \
+        static constexpr nvs_type_t type = NVS_TYPE;         \
+        static raw_type encode(T value) { return value; }    \
+        static T decode(raw_type raw) { return raw; }        \
+    }
+
+NVS_TRAITS_INT(uint8_t, NVS_TYPE_U8);
+NVS_TRAITS_INT(int8_t, NVS_TYPE_I8);
+NVS_TRAITS_INT(uint16_t, NVS_TYPE_U16);
+NVS_TRAITS_INT(int16_t, NVS_TYPE_I16);
+NVS_TRAITS_INT(uint32_t, NVS_TYPE_U32);
+NVS_TRAITS_INT(int32_t, NVS_TYPE_I32);
+NVS_TRAITS_INT(uint64_t, NVS_TYPE_U64);
+NVS_TRAITS_INT(int64_t, NVS_TYPE_I64);
+
+#undef NVS_TRAITS_INT
+
+template <>
+struct NvsTraits<bool>
+{
+    typedef uint8_t raw_type;
+    static constexpr nvs_type_t type = NVS_TYPE_U8;
+    static raw_type encode(bool value) { return value ? 1 : 0; }
+    static bool decode(raw_type raw) { return raw != 0; }
+};
+
+template <>
+struct NvsTraits<float>
+{
+    typedef uint32_t raw_type;
+    static constexpr nvs_type_t type = NVS_TYPE_U32;
+    static raw_type encode(float value)
+    {
+        raw_type raw;
+        memcpy(&raw, &value, sizeof(raw));
+        return raw;
+    }
+    static float decode(raw_type raw)
+    {
+        float value;
+        memcpy(&value, &raw, sizeof(value));
+        return value;
+    }
+};
+
+template <>
+struct NvsTraits<double>
+{
+    typedef uint64_t raw_type;
+    static constexpr nvs_type_t type = NVS_TYPE_U64;
+    static raw_type encode(double value)
+    {
+        raw_type raw;
+        memcpy(&raw, &value, sizeof(raw));
+        return raw;
+    }
+    static double decode(raw_type raw)
+    {
+        double value;
+        memcpy(&value, &raw, sizeof(value));
+        return value;
+    }
+};
+
+/**
+ * Typed NVS key, usually declared once as a constexpr constant:
+ *
+ *     constexpr NvsKey<float> kGain("gain", 1.0f);
+ *     float gain = NVS.get(kGain);
+ *     NVS.set(kGain, 2.5f);
+ *
+ * The key length is checked at compile time and the value type selects the
+ * nvs_get_*()/nvs_set_*() call, so no runtime type lookup is needed.
+ */
+template <typename T>
+class NvsKey
+{
+public:
+    typedef T value_type;
+    typedef NvsTraits<T> traits;
+
+    template <size_t N>
+    constexpr NvsKey(const char (&name)[N], T default_value = T())
+        : _name(name), _default(default_value)
+    {
+        static_assert(N <= NVS_KEY_NAME_MAX_SIZE, "NVS key is longer than 15 characters");
+    }
+
+    constexpr const char *name() const { return _name; }
+    constexpr T defaultValue() const { return _default; }
+
+private:
+    const char *_name;
+    T _default;
+};
+
+#endif
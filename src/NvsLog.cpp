@@ -0,0 +1,273 @@
+/*
+ * NvsLog.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include "NvsLog.h"
+#include "esp_timer.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "NvsLog"
+
+NvsCounter::NvsCounter(ArduinoNvs &nvs, const char *key, uint32_t persistEvery, uint32_t persistMs)
+    : _nvs(nvs), _type(NVS_TYPE_U64), _persist_every(persistEvery), _persist_ms(persistMs), _loaded(false), _stored(0),
+      _pending(0), _pending_count(0), _last_persist_us(0), _writes(0)
+{
+    strncpy(_key, key, NVS_KEY_NAME_MAX_SIZE - 1);
+    _key[NVS_KEY_NAME_MAX_SIZE - 1] = 0;
+}
+
+NvsCounter::~NvsCounter()
+{
+    flush();
+}
+
+/// Caller holds `_mutex`. Reads the stored value on first use, the
+/// ArduinoNvs object may not be usable at construction.
+void NvsCounter::load()
+{
+    if (_loaded)
+        return;
+    _stored = (uint64_t)_nvs.getInt(_key, 0);
+    _type = _nvs.getIntType(_key);
+    if (_type == NVS_TYPE_ANY)
+        _type = NVS_TYPE_U64;
+    _last_persist_us = esp_timer_get_time();
+    _loaded = true;
+}
+
+/// Largest counter value `type` holds, 0 for the types setInt() can't write.
+static uint64_t type_max(nvs_type_t type)
+{
+    switch (type)
+    {
+    case NVS_TYPE_U8:
+        return UINT8_MAX;
+    case NVS_TYPE_I16:
+        return INT16_MAX;
+    case NVS_TYPE_U16:
+        return UINT16_MAX;
+    case NVS_TYPE_I32:
+        return INT32_MAX;
+    case NVS_TYPE_U32:
+        return UINT32_MAX;
+    case NVS_TYPE_I64:
+        return INT64_MAX;
+    case NVS_TYPE_U64:
+        return UINT64_MAX;
+    default:
+        return 0;
+    }
+}
+
+static bool set_as(ArduinoNvs &nvs, const char *key, nvs_type_t type, uint64_t value)
+{
+    switch (type)
+    {
+    case NVS_TYPE_U8:
+        return nvs.setInt(key, (uint8_t)value);
+    case NVS_TYPE_I16:
+        return nvs.setInt(key, (int16_t)value);
+    case NVS_TYPE_U16:
+        return nvs.setInt(key, (uint16_t)value);
+    case NVS_TYPE_I32:
+        return nvs.setInt(key, (int32_t)value);
+    case NVS_TYPE_U32:
+        return nvs.setInt(key, (uint32_t)value);
+    case NVS_TYPE_I64:
+        return nvs.setInt(key, (int64_t)value);
+    default:
+        return nvs.setInt(key, value);
+    }
+}
+
+/// Caller holds `_mutex`. Writes in the stored type, NVS refuses to
+/// replace a key with another type.
+bool NvsCounter::persist()
+{
+    uint64_t total = _stored + _pending;
+    if (total > type_max(_type))
+    {
+        // Widened by erase and rewrite, a power cut in between loses the
+        // counter.
+        if (!_nvs.erase(_key, false))
+            return false;
+        _type = NVS_TYPE_U64;
+    }
+    if (!set_as(_nvs, _key, _type, total))
+        return false;
+    _stored = total;
+    _pending = 0;
+    _pending_count = 0;
+    _last_persist_us = esp_timer_get_time();
+    _writes++;
+    return true;
+}
+
+uint64_t NvsCounter::add(uint64_t delta)
+{
+    FEmbed::OSMutexLocker locker(_mutex);
+    load();
+    _pending += delta;
+    _pending_count++;
+    bool due = _persist_every && _pending_count >= _persist_every;
+    if (_persist_ms && esp_timer_get_time() - _last_persist_us >= (int64_t)_persist_ms * 1000)
+        due = true;
+    if (due && !persist())
+        log_w("%s: persist failed, %u increments pending.", _key, (unsigned)_pending_count);
+    return _stored + _pending;
+}
+
+uint64_t NvsCounter::value()
+{
+    FEmbed::OSMutexLocker locker(_mutex);
+    load();
+    return _stored + _pending;
+}
+
+bool NvsCounter::set(uint64_t value)
+{
+    FEmbed::OSMutexLocker locker(_mutex);
+    _loaded = true;
+    _stored = 0;
+    _pending = value;
+    return persist();
+}
+
+bool NvsCounter::flush()
+{
+    FEmbed::OSMutexLocker locker(_mutex);
+    if (!_loaded || _pending_count == 0)
+        return true;
+    return persist();
+}
+
+NvsRingLog::NvsRingLog(ArduinoNvs &nvs, const char *name, uint16_t slots, size_t recordSize)
+    : _nvs(nvs), _slots(slots), _record_size(recordSize), _buf(sizeof(uint32_t) + recordSize), _opened(false), _next_seq(0), _count(0)
+{
+    strncpy(_name, name, NVS_KEY_NAME_MAX_SIZE - 1);
+    _name[NVS_KEY_NAME_MAX_SIZE - 1] = 0;
+    if (_slots > 0xfff)
+        _slots = 0xfff;
+}
+
+void NvsRingLog::slotKey(char *out, uint32_t seq)
+{
+    // 11 name characters, the dot and 3 hex digits, `_slots` <= 0xfff.
+    snprintf(out, NVS_KEY_NAME_MAX_SIZE, "%.11s.%x", _name, (unsigned)(seq % _slots) & 0xfff);
+}
+
+/// Caller holds `_mutex`. One read per slot, the highest sequence number
+/// is the last append.
+void NvsRingLog::open()
+{
+    if (_opened)
+        return;
+    _opened = true;
+    if (_slots == 0)
+        return;
+
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t *buf = _buf.data();
+    bool found = false;
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < _slots; i++)
+    {
+        slotKey(key, i);
+        size_t length = _nvs.getBlobSize(key);
+        if (length < sizeof(uint32_t) || length > _buf.size() || !_nvs.getBlob(key, buf, length))
+            continue;
+        uint32_t seq;
+        memcpy(&seq, buf, sizeof(seq));
+        if (seq % _slots != i)
+            continue;
+        if (!found || (int32_t)(seq - last) > 0)
+            last = seq;
+        found = true;
+        _count++;
+    }
+    _next_seq = found ? last + 1 : 0;
+    log_d("%s: %u records, next %u.", _name, (unsigned)_count, (unsigned)_next_seq);
+}
+
+bool NvsRingLog::append(const void *record, size_t length)
+{
+    if (length > _record_size || _slots == 0)
+        return false;
+    FEmbed::OSMutexLocker locker(_mutex);
+    open();
+
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t *buf = _buf.data();
+    memcpy(buf, &_next_seq, sizeof(uint32_t));
+    memcpy(buf + sizeof(uint32_t), record, length);
+    slotKey(key, _next_seq);
+    if (!_nvs.setBlob(key, buf, sizeof(uint32_t) + length))
+        return false;
+    _next_seq++;
+    if (_count < _slots)
+        _count++;
+    return true;
+}
+
+size_t NvsRingLog::size()
+{
+    FEmbed::OSMutexLocker locker(_mutex);
+    open();
+    return _count;
+}
+
+size_t NvsRingLog::read(size_t index, void *record, size_t length)
+{
+    FEmbed::OSMutexLocker locker(_mutex);
+    open();
+    if (index >= _count)
+        return 0;
+
+    uint32_t seq = _next_seq - _count + index;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t *buf = _buf.data();
+    slotKey(key, seq);
+    size_t stored = _nvs.getBlobSize(key);
+    if (stored < sizeof(uint32_t) || stored > _buf.size() || !_nvs.getBlob(key, buf, stored))
+        return 0;
+    uint32_t stored_seq;
+    memcpy(&stored_seq, buf, sizeof(stored_seq));
+    stored -= sizeof(uint32_t);
+    if (stored_seq != seq || stored > length)
+        return 0;
+    memcpy(record, buf + sizeof(uint32_t), stored);
+    return stored;
+}
+
+bool NvsRingLog::clear()
+{
+    FEmbed::OSMutexLocker locker(_mutex);
+    open();
+    bool ok = true;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    for (uint32_t i = 0; i < _count; i++)
+    {
+        slotKey(key, _next_seq - 1 - i);
+        if (!_nvs.erase(key, false))
+            ok = false;
+    }
+    _count = 0;
+    _next_seq = 0;
+    return _nvs.commit() && ok;
+}
@@ -0,0 +1,106 @@
+/*
+ * NvsLog.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef __NVS_LOG_H__
+#define __NVS_LOG_H__
+
+#include <osMutex.h>
+#include <vector>
+#include "ArduinoNvs.h"
+
+/**
+ * Counter persisted in one NVS key, for values updated far more often than
+ * flash should be written: uptime, cycle counts, energy totals.
+ *
+ * Increments are summed in RAM and written once `persistEvery` of them are
+ * pending or `persistMs` passed since the last write, checked on each
+ * `add()`. NVS is log-structured and already spreads every write over the
+ * partition, wear only depends on how often the counter is written.
+ * A reset or power cut loses the pending increments, up to `persistEvery - 1`
+ * of them or those of the last `persistMs`; call `flush()` before a planned
+ * one. The key keeps the integer type it was created with, a value that
+ * outgrows it is rewritten as U64.
+ */
+class NvsCounter
+{
+public:
+    NvsCounter(ArduinoNvs &nvs, const char *key, uint32_t persistEvery = 100, uint32_t persistMs = 60000);
+    ~NvsCounter();
+
+    uint64_t add(uint64_t delta = 1); /// Returns the new value, a failed write is logged and retried on the next add
+    uint64_t value();
+    bool set(uint64_t value);
+    bool flush();
+
+    uint32_t writes() { return _writes; } /// Flash writes made so far
+
+private:
+    void load();
+    bool persist();
+
+    ArduinoNvs &_nvs;
+    char _key[NVS_KEY_NAME_MAX_SIZE];
+    nvs_type_t _type; ///< type the key is stored as
+    uint32_t _persist_every;
+    uint32_t _persist_ms;
+    bool _loaded;
+    uint64_t _stored;
+    uint64_t _pending;
+    uint32_t _pending_count;
+    int64_t _last_persist_us;
+    uint32_t _writes;
+    FEmbed::OSMutex _mutex;
+};
+
+/**
+ * Fixed size ring of records, one NVS blob per slot named "<name>.<slot>".
+ *
+ * Each record carries a sequence number, so an append is a single blob
+ * write and the head is found again by scanning the slots on first use.
+ * `name` is at most 11 characters, `slots` at most 4095.
+ */
+class NvsRingLog
+{
+public:
+    NvsRingLog(ArduinoNvs &nvs, const char *name, uint16_t slots, size_t recordSize);
+
+    bool append(const void *record, size_t length);
+    size_t size();     /// Records stored, at most `slots`
+    size_t capacity() { return _slots; }
+
+    /// Copies record `index`, 0 being the oldest. Returns its length, 0 if
+    /// missing or longer than `length`.
+    size_t read(size_t index, void *record, size_t length);
+    bool clear();
+
+private:
+    void open();
+    void slotKey(char *out, uint32_t seq);
+
+    ArduinoNvs &_nvs;
+    char _name[NVS_KEY_NAME_MAX_SIZE];
+    uint16_t _slots;
+    size_t _record_size;
+    std::vector<uint8_t> _buf; ///< one slot, sequence number and record
+    bool _opened;
+    uint32_t _next_seq; ///< sequence number of the next append
+    uint32_t _count;
+    FEmbed::OSMutex _mutex;
+};
+
+#endif
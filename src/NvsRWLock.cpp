@@ -0,0 +1,111 @@
+/*
+ * NvsRWLock.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include "NvsRWLock.h"
+#include "esp_timer.h"
+
+NvsRWLock::NvsRWLock() : _readers(0), _draining(false), _contended(0), _wait_us(0)
+{
+    _mutex = xSemaphoreCreateMutex();
+    _write = xSemaphoreCreateMutex();
+    _drained = xSemaphoreCreateBinary();
+}
+
+NvsRWLock::~NvsRWLock()
+{
+    vSemaphoreDelete(_drained);
+    vSemaphoreDelete(_write);
+    vSemaphoreDelete(_mutex);
+}
+
+/// Start of the wait when `sem` was busy, 0 when it was taken right away.
+int64_t NvsRWLock::take(SemaphoreHandle_t sem)
+{
+    if (xSemaphoreTake(sem, 0) == pdTRUE)
+        return 0;
+    int64_t start = esp_timer_get_time();
+    xSemaphoreTake(sem, portMAX_DELAY);
+    return start;
+}
+
+/// Caller holds `_mutex`.
+void NvsRWLock::count(int64_t start)
+{
+    _contended++;
+    _wait_us += esp_timer_get_time() - start;
+}
+
+uint32_t NvsRWLock::contention() const
+{
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    uint32_t n = _contended;
+    xSemaphoreGive(_mutex);
+    return n;
+}
+
+uint64_t NvsRWLock::waitUs() const
+{
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    uint64_t us = _wait_us;
+    xSemaphoreGive(_mutex);
+    return us;
+}
+
+void NvsRWLock::lockShared()
+{
+    // Passing through `_write` queues the reader behind a waiting writer.
+    int64_t start = take(_write);
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    _readers++;
+    if (start)
+        count(start);
+    xSemaphoreGive(_mutex);
+    xSemaphoreGive(_write);
+}
+
+void NvsRWLock::unlockShared()
+{
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    if (--_readers == 0 && _draining)
+        xSemaphoreGive(_drained);
+    xSemaphoreGive(_mutex);
+}
+
+void NvsRWLock::lock()
+{
+    int64_t start = take(_write);
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    while (_readers > 0)
+    {
+        if (!start)
+            start = esp_timer_get_time();
+        _draining = true;
+        xSemaphoreGive(_mutex);
+        xSemaphoreTake(_drained, portMAX_DELAY);
+        xSemaphoreTake(_mutex, portMAX_DELAY);
+    }
+    _draining = false;
+    if (start)
+        count(start);
+    xSemaphoreGive(_mutex);
+}
+
+void NvsRWLock::unlock()
+{
+    xSemaphoreGive(_write);
+}
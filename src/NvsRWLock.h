@@ -0,0 +1,84 @@
+/*
+ * NvsRWLock.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef __NVS_RW_LOCK_H__
+#define __NVS_RW_LOCK_H__
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+/**
+ * Reader/writer lock used by ArduinoNvs, one per namespace.
+ *
+ * Writers are preferred: once a writer waits no new reader is admitted,
+ * so a write waits for at most the reads already in progress. The write
+ * side is a FreeRTOS mutex, a higher priority task blocked on it, reader
+ * or writer, raises the priority of the writer holding or draining the
+ * lock. Readers in progress are not boosted.
+ */
+class NvsRWLock
+{
+public:
+    NvsRWLock();
+    ~NvsRWLock();
+
+    void lockShared();
+    void unlockShared();
+    void lock();
+    void unlock();
+
+    /// Number of acquisitions that had to wait, and their total wait.
+    uint32_t contention() const;
+    uint64_t waitUs() const;
+
+private:
+    int64_t take(SemaphoreHandle_t sem);
+    void count(int64_t start);
+
+    SemaphoreHandle_t _mutex;   ///< protects the fields below
+    SemaphoreHandle_t _write;   ///< held by the writer, briefly by each reader on entry
+    SemaphoreHandle_t _drained; ///< given by the last reader while a writer waits
+    int _readers;
+    bool _draining;
+    uint32_t _contended;
+    uint64_t _wait_us;
+};
+
+class NvsReadLocker
+{
+public:
+    explicit NvsReadLocker(NvsRWLock &lock) : _lock(lock) { _lock.lockShared(); }
+    ~NvsReadLocker() { _lock.unlockShared(); }
+
+private:
+    NvsRWLock &_lock;
+};
+
+class NvsWriteLocker
+{
+public:
+    explicit NvsWriteLocker(NvsRWLock &lock) : _lock(lock) { _lock.lock(); }
+    ~NvsWriteLocker() { _lock.unlock(); }
+
+private:
+    NvsRWLock &_lock;
+};
+
+#endif
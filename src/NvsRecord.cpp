@@ -0,0 +1,151 @@
+/*
+ * NvsRecord.cpp
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <string.h>
+#include "NvsRecord.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "NvsRecord"
+
+NvsRecord::NvsRecord(ArduinoNvs &nvs, const char *key, const NvsField *fields, size_t count, uint16_t version)
+    : _nvs(nvs), _fields(fields), _count(count), _version(version), _stored_version(0), _valid(true)
+{
+    strncpy(_key, key, NVS_KEY_NAME_MAX_SIZE - 1);
+    _key[NVS_KEY_NAME_MAX_SIZE - 1] = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (fields[i].tag == 0 || fields[i].size == 0 || fields[i].size > 255)
+        {
+            log_e("%s: field %u is not storable.", _key, (unsigned)i);
+            _valid = false;
+        }
+    }
+}
+
+const NvsField *NvsRecord::field(uint8_t tag)
+{
+    for (size_t i = 0; i < _count; i++)
+    {
+        if (_fields[i].tag == tag)
+            return &_fields[i];
+    }
+    return NULL;
+}
+
+size_t NvsRecord::encode(const void *record, std::vector<uint8_t> &out)
+{
+    const uint8_t *base = (const uint8_t *)record;
+    out.clear();
+    if (!_valid)
+        return 0;
+    out.push_back(_version & 0xff);
+    out.push_back(_version >> 8);
+    for (size_t i = 0; i < _count; i++)
+    {
+        const NvsField &f = _fields[i];
+        const uint8_t *value = base + f.offset;
+        size_t length = f.size;
+        if (f.kind == NVS_FIELD_TEXT)
+            length = strnlen((const char *)value, f.size);
+        out.push_back(f.tag);
+        out.push_back((uint8_t)length);
+        out.insert(out.end(), value, value + length);
+    }
+    return out.size();
+}
+
+/// Copies a little endian integer of `from` bytes into one of `to` bytes,
+/// sign extending when the field is signed.
+static void convert_int(uint8_t *dst, size_t to, const uint8_t *src, size_t from, bool is_signed)
+{
+    uint8_t fill = (is_signed && from && (src[from - 1] & 0x80)) ? 0xff : 0;
+    for (size_t i = 0; i < to; i++)
+        dst[i] = i < from ? src[i] : fill;
+}
+
+bool NvsRecord::decode(const uint8_t *data, size_t length, void *record)
+{
+    if (!_valid || length < 2)
+        return false;
+    // Validate the framing first so a truncated blob leaves `record` alone.
+    size_t pos = 2;
+    while (pos < length)
+    {
+        if (length - pos < 2 || length - pos - 2 < data[pos + 1])
+            return false;
+        pos += 2 + data[pos + 1];
+    }
+
+    uint8_t *base = (uint8_t *)record;
+    for (pos = 2; pos < length; pos += 2 + data[pos + 1])
+    {
+        const NvsField *f = field(data[pos]);
+        if (!f)
+            continue;
+        const uint8_t *value = data + pos + 2;
+        size_t n = data[pos + 1];
+        uint8_t *dst = base + f->offset;
+        switch (f->kind)
+        {
+        case NVS_FIELD_UINT:
+        case NVS_FIELD_INT:
+            convert_int(dst, f->size, value, n, f->kind == NVS_FIELD_INT);
+            break;
+        case NVS_FIELD_TEXT:
+            if (n >= f->size)
+                n = f->size - 1;
+            memcpy(dst, value, n);
+            memset(dst + n, 0, f->size - n);
+            break;
+        default:
+            if (n > f->size)
+                n = f->size;
+            memcpy(dst, value, n);
+            memset(dst + n, 0, f->size - n);
+            break;
+        }
+    }
+    _stored_version = data[0] | (data[1] << 8);
+    return true;
+}
+
+bool NvsRecord::load(void *record)
+{
+    std::vector<uint8_t> blob;
+    if (!_nvs.getBlob(_key, blob))
+        return false;
+    if (!decode(blob.data(), blob.size(), record))
+    {
+        log_w("%s: malformed record.", _key);
+        return false;
+    }
+    return true;
+}
+
+bool NvsRecord::save(const void *record, bool forceCommit)
+{
+    std::vector<uint8_t> blob;
+    if (!encode(record, blob))
+    {
+        log_e("%s: not saved, the field list is not storable.", _key);
+        return false;
+    }
+    return _nvs.setBlob(_key, blob, forceCommit);
+}
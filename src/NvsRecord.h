@@ -0,0 +1,140 @@
+/*
+ * NvsRecord.h
+ *
+ * Copyright (c) 2026 Gene Kong
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef __NVS_RECORD_H__
+#define __NVS_RECORD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+#include "ArduinoNvs.h"
+
+/// How a field is encoded, derived from the member type by NVS_FIELD.
+enum NvsFieldKind : uint8_t
+{
+    NVS_FIELD_UINT, ///< unsigned integer, bool or unsigned enum
+    NVS_FIELD_INT,  ///< signed integer or signed enum
+    NVS_FIELD_TEXT, ///< NUL terminated char array, stored without the padding
+    NVS_FIELD_RAW,  ///< anything else, copied byte for byte
+};
+
+struct NvsField
+{
+    uint8_t tag;  ///< 1..255, never reused for a different meaning
+    NvsFieldKind kind;
+    uint16_t offset;
+    uint16_t size;
+};
+
+template <typename T>
+constexpr NvsFieldKind nvs_field_kind()
+{
+    return std::is_same<typename std::remove_extent<T>::type, char>::value && std::is_array<T>::value ? NVS_FIELD_TEXT
+         : std::is_integral<T>::value || std::is_enum<T>::value
+               ? (std::is_signed<typename std::conditional<std::is_enum<T>::value, std::underlying_type<T>, std::remove_cv<T>>::type::type>::value
+                      ? NVS_FIELD_INT : NVS_FIELD_UINT)
+               : NVS_FIELD_RAW;
+}
+
+/// Compile-time checks of NVS_FIELD, a field that does not fit the record
+/// format fails the build instead of being dropped.
+template <unsigned Tag>
+constexpr uint8_t nvs_field_tag()
+{
+    static_assert(Tag >= 1 && Tag <= 255, "NvsField tag must be 1..255");
+    return Tag;
+}
+
+template <size_t Offset, size_t Size>
+constexpr uint16_t nvs_field_offset()
+{
+    static_assert(Size >= 1 && Size <= 255, "NvsField member must be 1..255 bytes");
+    static_assert(Offset <= 0xffff, "NvsField member offset must fit 16 bits");
+    return Offset;
+}
+
+/// Describes `Struct::member` stored under `tag`.
+#define NVS_FIELD(Struct, member, tag)                                            \
+    {                                                                             \
+        nvs_field_tag<(tag)>(), nvs_field_kind<decltype(Struct::member)>(),       \
+            nvs_field_offset<offsetof(Struct, member), sizeof(Struct::member)>(), \
+            (uint16_t)sizeof(Struct::member)                                      \
+    }
+
+/**
+ * Stores a whole settings struct in one NVS blob, so loading it is a single
+ * lookup instead of one per field.
+ *
+ *     struct Settings { uint16_t port = 1883; char host[32] = "broker"; bool tls = false; };
+ *     static const NvsField kSettings[] = {
+ *         NVS_FIELD(Settings, port, 1),
+ *         NVS_FIELD(Settings, host, 2),
+ *         NVS_FIELD(Settings, tls, 3),
+ *     };
+ *     NvsRecord record(NVS, "settings", kSettings, 1);
+ *
+ * The blob is a little endian u16 schema version followed by one
+ * {u8 tag, u8 length, value} per field. Decoding skips tags it does not
+ * know and leaves fields missing from the blob at whatever the struct held,
+ * so firmware can add and drop fields in either direction. Integers are
+ * widened or narrowed when a field changed size, text and raw fields are
+ * truncated or zero padded. Fields are 1..255 bytes, NVS_FIELD checks
+ * this at compile time.
+ */
+class NvsRecord
+{
+public:
+    NvsRecord(ArduinoNvs &nvs, const char *key, const NvsField *fields, size_t count, uint16_t version);
+    template <size_t N>
+    NvsRecord(ArduinoNvs &nvs, const char *key, const NvsField (&fields)[N], uint16_t version)
+        : NvsRecord(nvs, key, fields, N, version)
+    {
+    }
+
+    /// Fills `record` from flash. Returns false, leaving it untouched, if
+    /// the key is missing, the blob is malformed or not `isValid()`.
+    bool load(void *record);
+    /// Fails without writing if a field is not storable, see `isValid()`.
+    bool save(const void *record, bool forceCommit = true);
+
+    /// False if a field list built without NVS_FIELD has a tag of 0 or a
+    /// field outside 1..255 bytes.
+    bool isValid() { return _valid; }
+
+    /// Schema version found by the last successful `load()`, 0 before that.
+    /// Compare with `version()` to run migrations the tags cannot express.
+    uint16_t storedVersion() { return _stored_version; }
+    uint16_t version() { return _version; }
+
+    size_t encode(const void *record, std::vector<uint8_t> &out); /// 0 if not `isValid()`
+    bool decode(const uint8_t *data, size_t length, void *record);
+
+private:
+    const NvsField *field(uint8_t tag);
+
+    ArduinoNvs &_nvs;
+    char _key[NVS_KEY_NAME_MAX_SIZE];
+    const NvsField *_fields;
+    size_t _count;
+    uint16_t _version;
+    uint16_t _stored_version;
+    bool _valid;
+};
+
+#endif
@@ -6,6 +6,8 @@
 #include "WiFi.h"
 #include <functional>
 #include "esp_wifi.h"
+#include "esp_timer.h"
+#include "esp_idf_version.h"
 
 #ifdef  LOG_TAG
 #undef  LOG_TAG
@@ -26,7 +28,12 @@ namespace FEmbed {
 //     mdns_handle_system_event(nullptr, event);
 // }
 
-mDNS::mDNS() : results(nullptr) {}
+mDNS::mDNS()
+    : results(nullptr), _results_cached(false), _cache_enabled(false), _refresher(nullptr), _refresh_stop(false),
+      _poller(nullptr), _poll_stop(false), _next_query(0) {
+    memset(&_cache_stats, 0, sizeof(_cache_stats));
+}
+
 mDNS::~mDNS() {
     end();
 }
@@ -47,6 +54,13 @@ bool mDNS::begin(const char *hostName) {
 }
 
 void mDNS::end() {
+    _stopPoller();
+    _stopRefresher();
+    clearCache();
+    {
+        OSMutexLocker locker(_cache_lock);
+        _releaseResults();
+    }
     mdns_free();
 }
 
@@ -150,11 +164,50 @@ bool mDNS::addServiceTxt(char *name, char *proto, char *key, char *value) {
     return true;
 }
 
+static uint32_t result_ttl(mdns_result_t *r) {
+    uint32_t ttl = 0;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+    for (; r; r = r->next) {
+        if (r->ttl && (!ttl || r->ttl < ttl)) ttl = r->ttl;
+    }
+#endif
+    return ttl ? ttl : MDNS_CACHE_DEFAULT_TTL;
+}
+
+// mdns_query_a() without dropping the record TTL.
+static esp_err_t query_a(const char *host, uint32_t timeout, uint32_t *addr, uint32_t *ttl) {
+    mdns_result_t *r = nullptr;
+    esp_err_t err = mdns_query(host, nullptr, nullptr, MDNS_TYPE_A, timeout, 1, &r);
+    if (err) return err;
+    err = ESP_ERR_NOT_FOUND;
+    for (mdns_ip_addr_t *a = r ? r->addr : nullptr; a; a = a->next) {
+        if (a->addr.type == MDNS_IP_PROTOCOL_V4) {
+            *addr = a->addr.u_addr.ip4.addr;
+            *ttl = result_ttl(r);
+            err = ESP_OK;
+            break;
+        }
+    }
+    mdns_query_results_free(r);
+    return err;
+}
+
 IPAddress mDNS::queryHost(char *host, uint32_t timeout) {
-    esp_ip4_addr_t addr;
-    addr.addr = 0;
+    String key(host);
+    key.toLowerCase();
+    if (_cache_enabled) {
+        OSMutexLocker locker(_cache_lock);
+        CacheEntry *e = _findCache(key, false);
+        if (e) {
+            _cache_stats.hits++;
+            e->used = true;
+            return IPAddress(e->addr);
+        }
+        _cache_stats.misses++;
+    }
 
-    esp_err_t err = mdns_query_a(host, timeout, &addr);
+    uint32_t addr = 0, ttl = 0;
+    esp_err_t err = query_a(host, timeout, &addr, &ttl);
     if (err) {
         if (err == ESP_ERR_NOT_FOUND) {
             log_w("Host was not found!");
@@ -163,7 +216,10 @@ IPAddress mDNS::queryHost(char *host, uint32_t timeout) {
         log_e("Query Failed");
         return {};
     }
-    return IPAddress(addr.addr);
+    if (_cache_enabled) {
+        _storeCache(key, false, addr, nullptr, ttl);
+    }
+    return IPAddress(addr);
 }
 
 int mDNS::queryService(char *service, char *proto) {
@@ -172,9 +228,9 @@ int mDNS::queryService(char *service, char *proto) {
         return 0;
     }
 
-    if (results) {
-        mdns_query_results_free(results);
-        results = nullptr;
+    {
+        OSMutexLocker locker(_cache_lock);
+        _releaseResults();
     }
 
     char srv[strlen(service) + 2];
@@ -190,14 +246,43 @@ int mDNS::queryService(char *service, char *proto) {
         sprintf(prt, "_%s", proto);
     }
 
-    esp_err_t err = mdns_query_ptr(srv, prt, 3000, 20, &results);
-    if (err) {
-        log_e("Query Failed");
-        return 0;
+    String key = String(srv);
+    key += ".";
+    key += prt;
+    if (_cache_enabled) {
+        OSMutexLocker locker(_cache_lock);
+        CacheEntry *e = _findCache(key, true);
+        if (e) {
+            _cache_stats.hits++;
+            e->used = true;
+            results = e->answers;
+            _results_cached = true;
+        } else {
+            _cache_stats.misses++;
+        }
     }
+
     if (!results) {
-        log_w("No results found!");
-        return 0;
+        mdns_result_t *found = nullptr;
+        esp_err_t err = mdns_query_ptr(srv, prt, 3000, 20, &found);
+        if (err) {
+            log_e("Query Failed");
+            return 0;
+        }
+        if (!found) {
+            log_w("No results found!");
+            return 0;
+        }
+        {
+            // Point `results` at it first, the refresher may replace the
+            // entry as soon as it is stored.
+            OSMutexLocker locker(_cache_lock);
+            results = found;
+            _results_cached = _cache_enabled;
+        }
+        if (_cache_enabled) {
+            _storeCache(key, true, 0, found, result_ttl(found));
+        }
     }
 
     mdns_result_t *r = results;
@@ -209,6 +294,396 @@ int mDNS::queryService(char *service, char *proto) {
     return i;
 }
 
+void mDNS::setCacheEnabled(bool enable) {
+    _cache_enabled = enable;
+    if (!enable) {
+        _stopRefresher();
+        clearCache();
+    }
+}
+
+void mDNS::clearCache() {
+    OSMutexLocker locker(_cache_lock);
+    for (size_t i = 0; i < _cache.size(); i++) {
+        _dropAnswers(_cache[i].answers);
+    }
+    _cache.clear();
+}
+
+mDNS::CacheStats mDNS::cacheStats() {
+    OSMutexLocker locker(_cache_lock);
+    CacheStats stats = _cache_stats;
+    stats.entries = _cache.size();
+    return stats;
+}
+
+// Caller holds _cache_lock. Returns the entry while it is still valid.
+mDNS::CacheEntry *mDNS::_findCache(const String &key, bool service) {
+    int64_t now = esp_timer_get_time();
+    for (size_t i = 0; i < _cache.size(); i++) {
+        CacheEntry &e = _cache[i];
+        if (e.service == service && e.key == key) {
+            return now < e.expires_us ? &e : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+void mDNS::_storeCache(const String &key, bool service, uint32_t addr, mdns_result_t *answers, uint32_t ttl) {
+    int64_t now = esp_timer_get_time();
+    {
+        OSMutexLocker locker(_cache_lock);
+        CacheEntry *e = nullptr;
+        for (size_t i = 0; i < _cache.size() && !e; i++) {
+            if (_cache[i].service == service && _cache[i].key == key) e = &_cache[i];
+        }
+        if (!e && _cache.size() >= MDNS_CACHE_SIZE) {
+            e = &_cache[0];
+            for (size_t i = 1; i < _cache.size(); i++) {
+                if (_cache[i].expires_us < e->expires_us) e = &_cache[i];
+            }
+        }
+        if (!e) {
+            _cache.emplace_back();
+            e = &_cache.back();
+            e->answers = nullptr;
+        }
+        if (e->answers != answers) {
+            _dropAnswers(e->answers);
+        }
+        e->key = key;
+        e->service = service;
+        e->addr = addr;
+        e->answers = answers;
+        e->refresh_us = now + (int64_t) ttl * 800000;
+        e->expires_us = now + (int64_t) ttl * 1000000;
+        e->used = false;
+    }
+    _startRefresher();
+}
+
+// Caller holds _cache_lock. `results` may still be read by the user, the
+// list it points at is only freed by the next queryService().
+void mDNS::_dropAnswers(mdns_result_t *answers) {
+    if (!answers) return;
+    if (answers == results) {
+        _retired.push_back(answers);
+    } else {
+        mdns_query_results_free(answers);
+    }
+}
+
+// Caller holds _cache_lock.
+void mDNS::_releaseResults() {
+    if (results && !_results_cached) {
+        mdns_query_results_free(results);
+    }
+    results = nullptr;
+    _results_cached = false;
+    for (size_t i = 0; i < _retired.size(); i++) {
+        mdns_query_results_free(_retired[i]);
+    }
+    _retired.clear();
+}
+
+// Queries and the refresher itself store answers concurrently, the task
+// handle is only tested and set under _cache_lock.
+void mDNS::_startRefresher() {
+    OSMutexLocker locker(_cache_lock);
+    if (_refresher) {
+        xTaskNotifyGive(_refresher);
+        return;
+    }
+    _refresh_stop = false;
+    if (xTaskCreate(_refreshTask, "mdns_cache", 3072, this, 1, &_refresher) != pdPASS) {
+        log_e("Failed starting cache refresh task");
+        _refresher = nullptr;
+    }
+}
+
+void mDNS::_stopRefresher() {
+    {
+        OSMutexLocker locker(_cache_lock);
+        if (!_refresher) return;
+        _refresh_stop = true;
+        xTaskNotifyGive(_refresher);
+    }
+    while (_refresher) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+}
+
+// Re-queries the entries that are due and were used, drops expired ones.
+// Returns the time in ms until the next entry is due.
+uint32_t mDNS::_refreshDue() {
+    for (;;) {
+        int64_t now = esp_timer_get_time();
+        int64_t next = INT64_MAX;
+        String key;
+        bool service = false;
+        {
+            OSMutexLocker locker(_cache_lock);
+            for (size_t i = 0; i < _cache.size();) {
+                CacheEntry &e = _cache[i];
+                if (now >= e.expires_us) {
+                    _dropAnswers(e.answers);
+                    _cache.erase(_cache.begin() + i);
+                    continue;
+                }
+                if (now >= e.refresh_us && key.length() == 0) {
+                    if (e.used) {
+                        key = e.key;
+                        service = e.service;
+                    }
+                    // Not refreshed again, it stays valid until it expires.
+                    e.refresh_us = e.expires_us;
+                }
+                if (e.refresh_us < next) next = e.refresh_us;
+                i++;
+            }
+        }
+        if (_refresh_stop) return 0;
+        if (key.length() == 0) {
+            if (next == INT64_MAX) return portMAX_DELAY;
+            int64_t ms = (next - now) / 1000 + 1;
+            return ms < 60000 ? (uint32_t) ms : 60000;
+        }
+
+        esp_err_t err;
+        if (service) {
+            mdns_result_t *found = nullptr;
+            int dot = key.indexOf('.');
+            String srv = key.substring(0, dot);
+            String prt = key.substring(dot + 1);
+            err = mdns_query_ptr(srv.c_str(), prt.c_str(), 3000, 20, &found);
+            if (!err && found) {
+                _storeCache(key, true, 0, found, result_ttl(found));
+            }
+        } else {
+            uint32_t addr, ttl;
+            err = query_a(key.c_str(), 2000, &addr, &ttl);
+            if (!err) {
+                _storeCache(key, false, addr, nullptr, ttl);
+            }
+        }
+        if (!err) {
+            OSMutexLocker locker(_cache_lock);
+            _cache_stats.refreshes++;
+        }
+    }
+}
+
+void mDNS::_refreshTask(void *param) {
+    mDNS *self = (mDNS *) param;
+    while (!self->_refresh_stop) {
+        uint32_t wait = self->_refreshDue();
+        if (self->_refresh_stop) break;
+        ulTaskNotifyTake(pdTRUE, wait == portMAX_DELAY ? portMAX_DELAY : pdMS_TO_TICKS(wait));
+    }
+    {
+        OSMutexLocker locker(self->_cache_lock);
+        self->_refresher = nullptr;
+    }
+    vTaskDelete(nullptr);
+}
+
+// The async query API changed with the IDF 5 mdns component: creation takes
+// a notifier and results come with their count.
+static mdns_search_once_t *search_new(const char *name, const char *service, const char *proto, uint16_t type,
+                                      uint32_t timeout, size_t max_results) {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    return mdns_query_async_new(name, service, proto, type, timeout, max_results, nullptr);
+#else
+    return mdns_query_async_new(name, service, proto, type, timeout, max_results);
+#endif
+}
+
+static bool search_done(mdns_search_once_t *search, mdns_result_t **answers) {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    uint8_t count = 0;
+    return mdns_query_async_get_results(search, 0, answers, &count);
+#else
+    return mdns_query_async_get_results(search, 0, answers);
+#endif
+}
+
+mDNS::QueryHandle mDNS::queryServiceAsync(const char *service, const char *proto, QueryCb cb, void *arg,
+                                          uint32_t timeout, size_t maxResults) {
+    if (!service || !service[0] || !proto || !proto[0] || !cb) {
+        log_e("Bad Parameters");
+        return 0;
+    }
+    char srv[strlen(service) + 2];
+    char prt[strlen(proto) + 2];
+    if (service[0] == '_') {
+        sprintf(srv, "%s", service);
+    } else {
+        sprintf(srv, "_%s", service);
+    }
+    if (proto[0] == '_') {
+        sprintf(prt, "%s", proto);
+    } else {
+        sprintf(prt, "_%s", proto);
+    }
+
+    mdns_search_once_t *search = search_new(nullptr, srv, prt, MDNS_TYPE_PTR, timeout, maxResults);
+    if (!search) {
+        log_e("Query Failed");
+        return 0;
+    }
+    String key = String(srv);
+    key += ".";
+    key += prt;
+    return _startQuery(key, true, search, cb, arg);
+}
+
+mDNS::QueryHandle mDNS::queryHostAsync(const char *host, QueryCb cb, void *arg, uint32_t timeout) {
+    if (!host || !host[0] || !cb) {
+        log_e("Bad Parameters");
+        return 0;
+    }
+    mdns_search_once_t *search = search_new(host, nullptr, nullptr, MDNS_TYPE_A, timeout, 1);
+    if (!search) {
+        log_e("Query Failed");
+        return 0;
+    }
+    String key(host);
+    key.toLowerCase();
+    return _startQuery(key, false, search, cb, arg);
+}
+
+mDNS::QueryHandle mDNS::_startQuery(const String &key, bool service, mdns_search_once_t *search, QueryCb cb,
+                                    void *arg) {
+    OSMutexLocker locker(_query_lock);
+    AsyncQuery q;
+    q.handle = ++_next_query ? _next_query : ++_next_query;
+    q.key = key;
+    q.service = service;
+    q.search = search;
+    q.cb = cb;
+    q.arg = arg;
+    q.cancelled = false;
+    _queries.push_back(q);
+    if (!_poller) {
+        _poll_stop = false;
+        if (xTaskCreate(_pollTask, "mdns_query", 3072, this, 1, &_poller) != pdPASS) {
+            log_e("Failed starting query task");
+            _poller = nullptr;
+        }
+    }
+    return q.handle;
+}
+
+bool mDNS::cancelQuery(QueryHandle handle) {
+    OSMutexLocker locker(_query_lock);
+    for (size_t i = 0; i < _queries.size(); i++) {
+        if (_queries[i].handle == handle && !_queries[i].cancelled) {
+            _queries[i].cancelled = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool mDNS::isQueryPending(QueryHandle handle) {
+    OSMutexLocker locker(_query_lock);
+    for (size_t i = 0; i < _queries.size(); i++) {
+        if (_queries[i].handle == handle) return !_queries[i].cancelled;
+    }
+    return false;
+}
+
+// Collects finished searches under the lock, then calls back without it so
+// callbacks may start or cancel queries. Returns false once nothing is
+// pending.
+bool mDNS::_pollQueries() {
+    struct Event {
+        QueryHandle handle;
+        QueryCb cb;
+        void *arg;
+        mdns_result_t *answers;
+        String key;
+        bool service;
+    };
+    std::vector<Event> events;
+    bool pending;
+    {
+        OSMutexLocker locker(_query_lock);
+        for (size_t i = 0; i < _queries.size();) {
+            AsyncQuery &q = _queries[i];
+            mdns_result_t *answers = nullptr;
+            if (!search_done(q.search, &answers)) {
+                i++;
+                continue;
+            }
+            mdns_query_async_delete(q.search);
+            if (!q.cancelled) {
+                events.push_back({q.handle, q.cb, q.arg, answers, q.key, q.service});
+            } else if (answers) {
+                mdns_query_results_free(answers);
+            }
+            _queries.erase(_queries.begin() + i);
+        }
+        pending = !_queries.empty();
+    }
+
+    for (size_t i = 0; i < events.size(); i++) {
+        Event &ev = events[i];
+        ev.cb(this, ev.handle, ev.answers, true, ev.arg);
+        if (!ev.answers || !_cache_enabled) {
+            if (ev.answers) mdns_query_results_free(ev.answers);
+            continue;
+        }
+        if (ev.service) {
+            _storeCache(ev.key, true, 0, ev.answers, result_ttl(ev.answers));
+            continue;
+        }
+        for (mdns_ip_addr_t *a = ev.answers->addr; a; a = a->next) {
+            if (a->addr.type == MDNS_IP_PROTOCOL_V4) {
+                _storeCache(ev.key, false, a->addr.u_addr.ip4.addr, nullptr, result_ttl(ev.answers));
+                break;
+            }
+        }
+        mdns_query_results_free(ev.answers);
+    }
+    return pending;
+}
+
+void mDNS::_pollTask(void *param) {
+    mDNS *self = (mDNS *) param;
+    for (;;) {
+        if (!self->_poll_stop && self->_pollQueries()) {
+            vTaskDelay(pdMS_TO_TICKS(MDNS_ASYNC_POLL_MS));
+            continue;
+        }
+        // A query started after the last poll found this task still alive.
+        OSMutexLocker locker(self->_query_lock);
+        if (self->_poll_stop || self->_queries.empty()) {
+            self->_poller = nullptr;
+            break;
+        }
+    }
+    vTaskDelete(nullptr);
+}
+
+// Searches still running are freed by mdns_free().
+void mDNS::_stopPoller() {
+    _poll_stop = true;
+    while (_poller) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    OSMutexLocker locker(_query_lock);
+    for (size_t i = 0; i < _queries.size(); i++) {
+        mdns_result_t *answers = nullptr;
+        if (search_done(_queries[i].search, &answers)) {
+            mdns_query_async_delete(_queries[i].search);
+            if (answers) mdns_query_results_free(answers);
+        }
+    }
+    _queries.clear();
+    _poll_stop = false;
+}
+
 mdns_result_t *mDNS::_getResult(int idx) {
     mdns_result_t *result = results;
     int i = 0;
@@ -7,16 +7,36 @@
 #define EXAMPLE_WEBSOCKETSERVER_LIB_FEMBED_ESP_SRC_MDNS_HPP_
 
 #include <Service.h>
+#include <osMutex.h>
+#include <vector>
 #include "Arduino.h"
 #include "IPv6Address.h"
 #include "IPAddress.h"
 #include "mdns.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 //this should be defined at build time
 #ifndef ARDUINO_VARIANT
 #define ARDUINO_VARIANT "esp32"
 #endif
 
+// Answers kept by queryHost()/queryService(), oldest expiry evicted first.
+#ifndef MDNS_CACHE_SIZE
+#define MDNS_CACHE_SIZE 8
+#endif
+
+// TTL assumed when the mdns component does not report one (RFC 6762 host
+// record TTL).
+#ifndef MDNS_CACHE_DEFAULT_TTL
+#define MDNS_CACHE_DEFAULT_TTL 120
+#endif
+
+// How often the async query task checks for finished searches.
+#ifndef MDNS_ASYNC_POLL_MS
+#define MDNS_ASYNC_POLL_MS 10
+#endif
+
 namespace FEmbed {
 
 class mDNS : public Service<mDNS> {
@@ -72,6 +92,48 @@ class mDNS : public Service<mDNS> {
         return queryService(service.c_str(), proto.c_str());
     }
 
+    /**
+     * Answers of queryHost() and queryService() are cached until their TTL
+     * runs out. A task re-queries entries that were read since the last
+     * refresh at 80% of their TTL, so names in regular use never block
+     * again; unused entries simply expire. Off by default, the refresh task
+     * only starts once setCacheEnabled(true) was called and an answer is
+     * cached.
+     */
+    struct CacheStats {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t refreshes;    // background re-queries
+        size_t entries;
+    };
+    void setCacheEnabled(bool enable);
+    bool isCacheEnabled() { return _cache_enabled; }
+    void clearCache();
+    CacheStats cacheStats();
+
+    /**
+     * Non-blocking queries. The callback runs once per handle on the mDNS
+     * query task, with answers that are only valid during the call; `done`
+     * is always set. The mdns component hands answers over only when a
+     * search ends, so they arrive at the timeout, or earlier once
+     * maxResults responders replied; pick the timeout accordingly. Answers
+     * are stored in the cache but async queries always go to the network.
+     */
+    typedef uint32_t QueryHandle;
+    typedef void (*QueryCb)(mDNS *mdns, QueryHandle handle, mdns_result_t *answers, bool done, void *arg);
+
+    QueryHandle queryServiceAsync(const char *service, const char *proto, QueryCb cb, void *arg = nullptr,
+                                  uint32_t timeout = 3000, size_t maxResults = 20);
+    QueryHandle queryHostAsync(const char *host, QueryCb cb, void *arg = nullptr, uint32_t timeout = 2000);
+
+    /**
+     * No callback is made for the handle afterwards, unless one is already
+     * running. The mdns component cannot stop a search early, it still runs
+     * until its timeout in the background.
+     */
+    bool cancelQuery(QueryHandle handle);
+    bool isQueryPending(QueryHandle handle);
+
     String hostname(int idx);
     IPAddress IP(int idx);
     IPv6Address IPv6(int idx);
@@ -83,8 +145,56 @@ class mDNS : public Service<mDNS> {
     String txtKey(int idx, int txtIdx);
 
  private:
+    struct CacheEntry {
+        String key;                 // host name, or "_service._proto"
+        bool service;
+        uint32_t addr;              // host answer
+        mdns_result_t *answers;     // service answers, owned by the entry
+        int64_t refresh_us;
+        int64_t expires_us;
+        bool used;                  // read since the last refresh
+    };
+
+    CacheEntry *_findCache(const String &key, bool service);
+    void _storeCache(const String &key, bool service, uint32_t addr, mdns_result_t *answers, uint32_t ttl);
+    void _dropAnswers(mdns_result_t *answers);
+    void _releaseResults();
+    void _startRefresher();
+    void _stopRefresher();
+    uint32_t _refreshDue();
+    static void _refreshTask(void *param);
+
+    struct AsyncQuery {
+        QueryHandle handle;
+        String key;                 // as for CacheEntry
+        bool service;
+        mdns_search_once_t *search;
+        QueryCb cb;
+        void *arg;
+        bool cancelled;
+    };
+
+    QueryHandle _startQuery(const String &key, bool service, mdns_search_once_t *search, QueryCb cb, void *arg);
+    void _stopPoller();
+    bool _pollQueries();
+    static void _pollTask(void *param);
+
     String _hostname;
     mdns_result_t *results;
+    bool _results_cached;       // `results` belongs to the cache
+    bool _cache_enabled;
+    std::vector<CacheEntry> _cache;
+    std::vector<mdns_result_t *> _retired;  // replaced while `results` pointed at them
+    OSMutex _cache_lock;
+    TaskHandle_t _refresher;
+    volatile bool _refresh_stop;
+    CacheStats _cache_stats;
+
+    std::vector<AsyncQuery> _queries;
+    OSMutex _query_lock;
+    TaskHandle_t _poller;
+    volatile bool _poll_stop;
+    QueryHandle _next_query;
     mdns_result_t *_getResult(int idx);
     mdns_txt_item_t *_getResultTxt(int idx, int txtIdx);
 };
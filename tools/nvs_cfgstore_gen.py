@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+#
+# nvs_cfgstore_gen.py
+#
+# Copyright (c) 2026 Gene Kong
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+"""Build a read-only config image for NvsConfigStore.
+
+Input is a CSV file with `key,type,value` rows, type being one of u8, i8,
+u16, i16, u32, i32, u64, i64, string, hex, base64 or file (value is a path
+relative to the CSV). Flash the output to a data partition, e.g.
+
+    nvs_cfgstore_gen.py config.csv config.bin --size 0x10000
+    esptool.py write_flash <partition offset> config.bin
+"""
+
+import argparse
+import base64
+import csv
+import os
+import struct
+import sys
+
+MAGIC = 0x4746434e
+VERSION = 2
+HEADER = struct.Struct('<IHHIIII8x')
+ENTRY = struct.Struct('<IIIHBx')
+
+TYPES = {
+    'u8': (0x01, '<B'), 'i8': (0x11, '<b'),
+    'u16': (0x02, '<H'), 'i16': (0x12, '<h'),
+    'u32': (0x04, '<I'), 'i32': (0x14, '<i'),
+    'u64': (0x08, '<Q'), 'i64': (0x18, '<q'),
+}
+TYPE_STR = 0x21
+TYPE_BLOB = 0x42
+
+
+def cfg_hash(seed, key):
+    """FNV-1a with the basis offset by seed plus the murmur3 finalizer, matches cfg_hash() in NvsConfigStore.cpp."""
+    h = (2166136261 ^ seed) & 0xffffffff
+    for b in key:
+        h ^= b
+        h = (h * 16777619) & 0xffffffff
+    h ^= h >> 16
+    h = (h * 0x85ebca6b) & 0xffffffff
+    h ^= h >> 13
+    h = (h * 0xc2b2ae35) & 0xffffffff
+    h ^= h >> 16
+    return h
+
+
+def build_mph(keys):
+    """Hash and displace: returns the displacement table and the keys in slot order."""
+    n = len(keys)
+    buckets = [[] for _ in range(n)]
+    for k in keys:
+        buckets[cfg_hash(0, k) % n].append(k)
+    order = sorted(range(n), key=lambda b: -len(buckets[b]))
+    g = [0] * n
+    slots = [None] * n
+
+    for b in order:
+        bucket = buckets[b]
+        if len(bucket) <= 1:
+            break
+        d = 1
+        while True:
+            used = []
+            for k in bucket:
+                s = cfg_hash(d, k) % n
+                if slots[s] is not None or s in used:
+                    break
+                used.append(s)
+            else:
+                break
+            d += 1
+            if d >= 0x7fffffff:
+                raise RuntimeError('no displacement found')
+        g[b] = d
+        for k, s in zip(bucket, used):
+            slots[s] = k
+
+    free = [i for i in range(n) if slots[i] is None]
+    for b in order:
+        if len(buckets[b]) == 1:
+            s = free.pop()
+            g[b] = -s - 1
+            slots[s] = buckets[b][0]
+    return g, slots
+
+
+def parse_value(kind, value, base_dir):
+    if kind in TYPES:
+        code, fmt = TYPES[kind]
+        return code, struct.pack(fmt, int(value, 0))
+    if kind == 'string':
+        return TYPE_STR, value.encode('utf-8') + b'\0'
+    if kind == 'hex':
+        return TYPE_BLOB, bytes.fromhex(value)
+    if kind == 'base64':
+        return TYPE_BLOB, base64.b64decode(value)
+    if kind == 'file':
+        with open(os.path.join(base_dir, value), 'rb') as f:
+            return TYPE_BLOB, f.read()
+    raise ValueError('unknown type %s' % kind)
+
+
+def align4(data):
+    data.extend(b'\0' * (-len(data) % 4))
+
+
+def build_image(items):
+    keys = [k for k, _, _ in items]
+    values = {k: (t, v) for k, t, v in items}
+    n = len(keys)
+    g, slots = build_mph(keys) if n else ([], [])
+
+    g_offset = HEADER.size
+    entries_offset = g_offset + 4 * n
+    data = bytearray()
+    data_offset = entries_offset + ENTRY.size * n
+    entries = bytearray()
+    for k in slots:
+        kind, value = values[k]
+        key_offset = data_offset + len(data)
+        data.extend(k)
+        align4(data)
+        value_offset = data_offset + len(data)
+        data.extend(value)
+        align4(data)
+        entries.extend(ENTRY.pack(key_offset, value_offset, len(value), len(k), kind))
+
+    size = data_offset + len(data)
+    image = bytearray(HEADER.pack(MAGIC, VERSION, ENTRY.size, n, g_offset, entries_offset, size))
+    image.extend(struct.pack('<%di' % n, *g))
+    image.extend(entries)
+    image.extend(data)
+    return image
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('input', help='CSV file with key,type,value rows')
+    parser.add_argument('output', help='image file to write')
+    parser.add_argument('--size', type=lambda x: int(x, 0), help='pad the image to the partition size')
+    args = parser.parse_args()
+
+    items = []
+    seen = set()
+    base_dir = os.path.dirname(os.path.abspath(args.input))
+    with open(args.input, newline='') as f:
+        for row in csv.reader(f):
+            if not row or row[0].startswith('#') or row[:2] == ['key', 'type']:
+                continue
+            if len(row) != 3:
+                sys.exit('bad row: %s' % ','.join(row))
+            key = row[0].encode('utf-8')
+            if key in seen:
+                sys.exit('duplicate key: %s' % row[0])
+            if len(key) > 0xffff:
+                sys.exit('key too long: %s' % row[0])
+            seen.add(key)
+            kind, value = parse_value(row[1].strip(), row[2], base_dir)
+            items.append((key, kind, value))
+
+    image = build_image(items)
+    if args.size is not None:
+        if len(image) > args.size:
+            sys.exit('image is %d bytes, larger than --size' % len(image))
+        image.extend(b'\xff' * (args.size - len(image)))
+    with open(args.output, 'wb') as f:
+        f.write(image)
+    print('%d keys, %d bytes' % (len(items), len(image)))
+
+
+if __name__ == '__main__':
+    main()
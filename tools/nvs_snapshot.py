@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+#
+# nvs_snapshot.py
+#
+# Copyright (c) 2026 Gene Kong
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+"""Build or dump ArduinoNvs namespace snapshots.
+
+A snapshot is what ArduinoNvs::exportTo() produces and importFrom() takes:
+
+    u32 magic "NVSX", u16 version, u16 reserved, u32 count
+    count * { u8 nvs_type_t, u8 key length, u32 value length, key, value }
+    u32 CRC-32 (zlib) of everything before it
+
+    nvs_snapshot.py build provision.csv provision.bin
+    nvs_snapshot.py dump provision.bin
+
+The CSV has `key,type,value` rows, type being one of u8, i8, u16, i16, u32,
+i32, u64, i64, string, hex, base64 or file (value is a path relative to the
+CSV). Keys are at most 15 characters.
+"""
+
+import argparse
+import base64
+import csv
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = 0x5853564e
+VERSION = 1
+HEADER = struct.Struct('<IHHI')
+ENTRY = struct.Struct('<BBI')
+
+TYPES = {
+    'u8': (0x01, '<B'), 'i8': (0x11, '<b'),
+    'u16': (0x02, '<H'), 'i16': (0x12, '<h'),
+    'u32': (0x04, '<I'), 'i32': (0x14, '<i'),
+    'u64': (0x08, '<Q'), 'i64': (0x18, '<q'),
+}
+TYPE_STR = 0x21
+TYPE_BLOB = 0x42
+KEY_MAX = 15
+
+
+def parse_value(kind, value, base_dir):
+    if kind in TYPES:
+        code, fmt = TYPES[kind]
+        return code, struct.pack(fmt, int(value, 0))
+    if kind == 'string':
+        return TYPE_STR, value.encode('utf-8') + b'\0'
+    if kind == 'hex':
+        return TYPE_BLOB, bytes.fromhex(value)
+    if kind == 'base64':
+        return TYPE_BLOB, base64.b64decode(value)
+    if kind == 'file':
+        with open(os.path.join(base_dir, value), 'rb') as f:
+            return TYPE_BLOB, f.read()
+    raise ValueError('unknown type %s' % kind)
+
+
+def build(entries):
+    out = bytearray(HEADER.pack(MAGIC, VERSION, 0, len(entries)))
+    for key, kind, value in entries:
+        out += ENTRY.pack(kind, len(key), len(value)) + key + value
+    out += struct.pack('<I', zlib.crc32(out) & 0xffffffff)
+    return out
+
+
+def parse(data):
+    if len(data) < HEADER.size + 4:
+        raise ValueError('too short')
+    magic, version, _, count = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError('not a snapshot')
+    crc, = struct.unpack_from('<I', data, len(data) - 4)
+    if zlib.crc32(data[:-4]) & 0xffffffff != crc:
+        raise ValueError('checksum mismatch')
+    pos = HEADER.size
+    entries = []
+    for _ in range(count):
+        kind, key_len, length = ENTRY.unpack_from(data, pos)
+        pos += ENTRY.size
+        key = bytes(data[pos:pos + key_len])
+        pos += key_len
+        entries.append((key, kind, bytes(data[pos:pos + length])))
+        pos += length
+    if pos != len(data) - 4:
+        raise ValueError('trailing data')
+    return entries
+
+
+def cmd_build(args):
+    entries = []
+    seen = set()
+    base_dir = os.path.dirname(os.path.abspath(args.input))
+    with open(args.input, newline='') as f:
+        for row in csv.reader(f):
+            if not row or row[0].startswith('#') or row[:2] == ['key', 'type']:
+                continue
+            if len(row) != 3:
+                sys.exit('bad row: %s' % ','.join(row))
+            key = row[0].encode('utf-8')
+            if not key or len(key) > KEY_MAX:
+                sys.exit('key length must be 1..%d: %s' % (KEY_MAX, row[0]))
+            if key in seen:
+                sys.exit('duplicate key: %s' % row[0])
+            seen.add(key)
+            kind, value = parse_value(row[1].strip(), row[2], base_dir)
+            entries.append((key, kind, value))
+    data = build(entries)
+    with open(args.output, 'wb') as f:
+        f.write(data)
+    print('%d entries, %d bytes' % (len(entries), len(data)))
+
+
+def cmd_dump(args):
+    with open(args.input, 'rb') as f:
+        entries = parse(f.read())
+    names = {code: name for name, (code, _) in TYPES.items()}
+    for key, kind, value in entries:
+        if kind in names:
+            shown = struct.unpack(TYPES[names[kind]][1], value)[0]
+            print('%s,%s,%d' % (key.decode(), names[kind], shown))
+        elif kind == TYPE_STR:
+            print('%s,string,%s' % (key.decode(), value[:-1].decode('utf-8', 'replace')))
+        else:
+            print('%s,hex,%s' % (key.decode(), value.hex()))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest='command')
+    sub.required = True
+    p = sub.add_parser('build', help='build a snapshot from a CSV file')
+    p.add_argument('input')
+    p.add_argument('output')
+    p.set_defaults(func=cmd_build)
+    p = sub.add_parser('dump', help='print a snapshot as CSV')
+    p.add_argument('input')
+    p.set_defaults(func=cmd_dump)
+    args = parser.parse_args()
+    try:
+        args.func(args)
+    except ValueError as e:
+        sys.exit(str(e))
+
+
+if __name__ == '__main__':
+    main()